@@ -1,5 +1,8 @@
 #pragma once
 
+// Build configuration: CONFIG_* values from the makefile
+#include "config.h"
+
 // Unsigned integer types
 typedef unsigned char uint8_t;
 typedef unsigned short uint16_t;
@@ -21,8 +24,10 @@ typedef uint64_t vaddr_t; // Virtual address
 #define false 0
 #define NULL  ((void *)0)
 
+#define PAGE_SIZE 4096
+
 #define align_up(value, align)   (((value) + (align) - 1) / (align) * (align))
-#define is_aligned(value, align) __builtin_is_aligned(value, align)
+#define is_aligned(value, align) (((value) & ((align) - 1)) == 0)
 #define offsetof(type, member)   __builtin_offsetof(type, member)
 
 // Variadic argument wrappers for printf
@@ -37,71 +42,331 @@ typedef uint64_t vaddr_t; // Virtual address
 #define set_csr(reg, val)   asm volatile("csrs " #reg ", %0" : : "r"(val))
 #define clr_csr(reg, val)   asm volatile("csrc " #reg ", %0" : : "r"(val))
 
-// System Call Numbers
-#define SYS_PUTS   1
-#define SYS_YIELD  2
-#define SYS_OPEN   3
-#define SYS_CLOSE  4
-#define SYS_READ   5
-#define SYS_WRITE  6
-#define SYS_UNLINK 7
-#define SYS_LIST   8
+// System call numbers
+#include "syscall.h"
+
+// Scheduling classes, see process_create()
+// SCHED_RT processes always run before SCHED_FAIR ones; within SCHED_RT a
+// lower prio is more urgent. A SCHED_FAIR prio is a weight: the process
+// gets that many time slices each time it is dispatched.
+#define SCHED_FAIR 0
+#define SCHED_RT   1
+#define SCHED_NCLASSES 2
+#define RT_PRIO_MAX 31
+#define FAIR_WEIGHT_MAX 16
 
 // File operation constants
 #define MAX_FILENAME 64
-#define MAX_FILE_SIZE 4096  // 1 page
-#define MAX_INODES 16
-#define MAX_OPEN_FILES 8
-#define MAX_PROCESSES 2
+#define MAX_FILE_SIZE (CONFIG_MAX_FILE_SIZE_MB * 1024 * 1024)  // Grown in extents of up to 4MB
+#define MAX_INODES CONFIG_MAX_INODES            // Power of two, see dir_index in kernel.c
+#define MAX_OPEN_FILES CONFIG_MAX_OPEN_FILES    // Per process; tables grow up to this
+
+// fs_open() flags (files are always created if missing)
+#define O_APPEND 0x1        // Every write goes to the end of the file
+#define O_TRUNC  0x2        // Empty the file on open
+#define O_BLOCK  0x4        // Reads at end of file wait for more data
+#define O_SYNC   0x8        // Writes return once on disk (group-committed)
+
+// Pipe flags (SYS_PIPE)
+#define PIPE_FLIP 0x1       // Move whole aligned pages by remapping, not copying
 
-// Inline syscall function - executes ecall instruction
+// fs_mmap() protection and flags
+#define MAX_MAPPINGS 8      // Per process
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define MAP_SHARED 0x1
+#define MAP_FAILED ((uint64_t)-1)
+
+// fs_lseek() whence
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+#define MAX_HARTS CONFIG_MAX_HARTS  // boot.S has a boot stack for each
+
+// Inline syscall functions - execute the ecall instruction
 // Syscall convention:
 // - a7 = syscall ID
-// - a0 = first argument (also used for return value)
-// - a1 = second argument
-// - a2 = third argument
-static inline uint64_t syscall(uint64_t id, uint64_t arg0, uint64_t arg1, uint64_t arg2) {
-    uint64_t ret;
+// - a0-a5 = arguments (a0 is also used for the return value)
+// - Every other register is preserved across the call
+static inline uint64_t syscall6(uint64_t id, uint64_t arg0, uint64_t arg1, uint64_t arg2,
+                                uint64_t arg3, uint64_t arg4, uint64_t arg5) {
+    register uint64_t a0 asm("a0") = arg0;
+    register uint64_t a1 asm("a1") = arg1;
+    register uint64_t a2 asm("a2") = arg2;
+    register uint64_t a3 asm("a3") = arg3;
+    register uint64_t a4 asm("a4") = arg4;
+    register uint64_t a5 asm("a5") = arg5;
+    register uint64_t a7 asm("a7") = id;
     asm volatile(
-        "mv a7, %1\n"      // Move syscall ID to a7
-        "mv a0, %2\n"      // Move arg0 to a0
-        "mv a1, %3\n"      // Move arg1 to a1
-        "mv a2, %4\n"      // Move arg2 to a2
         "ecall\n"          // Execute syscall (trap to kernel)
-        "mv %0, a0\n"      // Move return value from a0
-        : "=r" (ret)
-        : "r" (id), "r" (arg0), "r" (arg1), "r" (arg2)
-        : "a0", "a1", "a2", "a7"
+        : "+r" (a0)
+        : "r" (a1), "r" (a2), "r" (a3), "r" (a4), "r" (a5), "r" (a7)
+        : "memory"         // The kernel may read or write our buffers
     );
-    return ret;
+    return a0;
+}
+
+static inline uint64_t syscall(uint64_t id, uint64_t arg0, uint64_t arg1, uint64_t arg2) {
+    return syscall6(id, arg0, arg1, arg2, 0, 0, 0);
 }
 
 // Trap frame structure - matches register save order in trap_vector
+// mepc/mstatus are restored from the frame on the way out, so a handler
+// changes the return address by updating frame->mepc
+// Syscall handlers and interrupt stubs only get the caller-saved registers
+// (ra, t0-t6, a0-a7), sp, tp and mepc/mstatus; gp and s0-s11 are not saved.
+// sp and tp are those of the interrupted code, which for a process is its
+// U-mode stack and thread pointer.
 typedef struct {
     uint64_t ra, sp, gp, tp, t0, t1, t2, s0, s1;
     uint64_t a0, a1, a2, a3, a4, a5, a6, a7;
     uint64_t s2, s3, s4, s5, s6, s7, s8, s9, s10, s11;
     uint64_t t3, t4, t5, t6;
+    uint64_t mepc, mstatus;
 } TrapFrame;
 
+// Submission ring operations (RingSqe.opcode)
+#define RING_OP_NOP    0
+#define RING_OP_OPEN   1    // addr = filename, flags
+#define RING_OP_CLOSE  2    // fd
+#define RING_OP_READ   3    // fd, addr = buffer, len
+#define RING_OP_WRITE  4    // fd, addr = buffer, len
+#define RING_OP_UNLINK 5    // addr = filename
+#define RING_OP_PREAD  6    // fd, addr = buffer, len, offset
+#define RING_OP_PWRITE 7    // fd, addr = buffer, len, offset
+
+// Submission entry, filled in by the process
+typedef struct {
+    uint32_t opcode;
+    int32_t fd;
+    uint64_t addr;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t flags;
+    uint64_t user_data;     // Copied to the matching completion
+} RingSqe;
+
+// Completion entry, filled in by SYS_SUBMIT
+typedef struct {
+    uint64_t user_data;
+    int64_t result;         // Return value of the fs_* call
+} RingCqe;
+
+// Submission/completion ring shared by a process and the kernel
+// Indices run freely and are masked with entries - 1. The process writes
+// SQEs and sq_tail and reads CQEs up to cq_tail; the kernel advances sq_head
+// and cq_tail. sqes/cqes are the process's addresses for the arrays.
+typedef struct {
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    uint32_t entries;       // Power of two
+    uint32_t reserved;
+    RingSqe *sqes;
+    RingCqe *cqes;
+} Ring;
+
+// Lock annotations, checked at compile time by clang's -Wthread-safety
+// (see readme.md); other compilers ignore them.
+// A function marked REQUIRES(l) must be called with l held, ACQUIRE(l)
+// returns with it held, RELEASE(l) drops it; the _SHARED forms are for
+// the read side of an RwLock. GUARDED_BY(l) data may only be touched with
+// l held.
+#if defined(__clang__)
+#define CAPABILITY(name)        __attribute__((capability(name)))
+#define GUARDED_BY(l)           __attribute__((guarded_by(l)))
+#define REQUIRES(...)           __attribute__((requires_capability(__VA_ARGS__)))
+#define REQUIRES_SHARED(...)    __attribute__((requires_shared_capability(__VA_ARGS__)))
+#define ACQUIRE(...)            __attribute__((acquire_capability(__VA_ARGS__)))
+#define ACQUIRE_SHARED(...)     __attribute__((acquire_shared_capability(__VA_ARGS__)))
+#define RELEASE(...)            __attribute__((release_capability(__VA_ARGS__)))
+#define RELEASE_SHARED(...)     __attribute__((release_shared_capability(__VA_ARGS__)))
+#define EXCLUDES(...)           __attribute__((locks_excluded(__VA_ARGS__)))
+#define NO_LOCK_ANALYSIS        __attribute__((no_thread_safety_analysis))
+#else
+#define CAPABILITY(name)
+#define GUARDED_BY(l)
+#define REQUIRES(...)
+#define REQUIRES_SHARED(...)
+#define ACQUIRE(...)
+#define ACQUIRE_SHARED(...)
+#define RELEASE(...)
+#define RELEASE_SHARED(...)
+#define EXCLUDES(...)
+#define NO_LOCK_ANALYSIS
+#endif
+
+// Spinlock - see spin_lock() in kernel.c
+typedef struct CAPABILITY("spinlock") {
+    volatile uint32_t locked;
+} Spinlock;
+
+// RwLock - spinning reader/writer lock, see rw_read_lock() in kernel.c
+// state counts the readers inside, or is RW_WRITER
+typedef struct CAPABILITY("rwlock") {
+    volatile uint32_t state;
+} RwLock;
+
+// Seqcount - lets readers go lock-free and retry if a writer got in, see seq_read_begin()
+typedef struct {
+    volatile uint32_t seq;      // Odd while a write is in progress
+} Seqcount;
+
+// WaitQueue - processes blocked until wq_wake_all(), see wq_wait() in kernel.c
+typedef struct {
+    Spinlock lock;
+    struct process *head;
+    struct process *tail;
+} WaitQueue;
+
 // Function declarations
 void *memset(void *dst, int c, size_t n);
 void *memcpy(void *dst, const void *src, size_t n);
+void *memmove(void *dst, const void *src, size_t n);
 char *strcpy(char *dst, const char *src);
 int strcmp(const char *s1, const char *s2);
 void printf(const char *fmt, ...);
+
+// pr_debug - printf for boot progress messages, compiled out without CONFIG_DEBUG
+// The arguments are still type-checked, so nothing goes unused.
+#if CONFIG_DEBUG
+#define pr_debug(...) printf(__VA_ARGS__)
+#else
+#define pr_debug(...) do { if (0) printf(__VA_ARGS__); } while (0)
+#endif
+void putchar(char c);
+void puts(const char *s);
+void uart_init(void);
+void uart_interrupt(void);
+void console_write(const char *s, size_t len);
+void console_poll(void);
+void console_flush(void);
 void trap_init(void);
+void trap_init_hart(void);
 void trap_handler(TrapFrame *frame);
+void syscall_handler(TrapFrame *frame);
+void mem_routines_init(void);
+void mem_routines_init_hart(void);
+void fpu_init(void);
+int fpu_trap(TrapFrame *frame);
+void vec_kernel_begin(void);
+void timer_init(void);
+void timer_init_hart(void);
+void timer_interrupt(void);
+void ipi_send(uint64_t hartid);
+void ipi_interrupt(void);
+void external_interrupt(void);
+void hart_idle(void);
+void plic_init(void);
+void plic_init_hart(void);
+void plic_enable(uint32_t irq);
+void panic(const char *msg);
+void poweroff(void);
+
+// Harts and locking
+uint64_t hart_id(void);
+void push_off(void);
+void pop_off(void);
+void spin_lock(Spinlock *lock) ACQUIRE(lock);
+void spin_unlock(Spinlock *lock) RELEASE(lock);
+void rw_read_lock(RwLock *lock) ACQUIRE_SHARED(lock);
+void rw_read_unlock(RwLock *lock) RELEASE_SHARED(lock);
+void rw_write_lock(RwLock *lock) ACQUIRE(lock);
+void rw_write_unlock(RwLock *lock) RELEASE(lock);
+uint32_t seq_read_begin(const Seqcount *sc);
+int seq_read_retry(const Seqcount *sc, uint32_t start);
+void seq_write_begin(Seqcount *sc);
+void seq_write_end(Seqcount *sc);
+
+// File system
+int fs_open(const char *filename, int flags);
+int fs_close(int fd);
+int fs_read(int fd, char *buf, int count);
+int fs_write(int fd, const char *buf, int count);
+int pipe_create(uint64_t fds, int flags);
+int fs_pread(int fd, char *buf, int count, uint64_t offset);
+int fs_pwrite(int fd, const char *buf, int count, uint64_t offset);
+int64_t fs_lseek(int fd, int64_t offset, int whence);
+uint64_t fs_mmap(uint64_t length, int prot, int flags, int fd, uint64_t offset);
+int fs_munmap(uint64_t addr, uint64_t length);
+int fs_unlink(const char *filename);
+void fs_list(void);
+int fs_load(void);
+int fs_sync(void);
+
+// Block device - virtio-blk
+int vblk_init(void);
+int vblk_present(void);
+uint32_t vblk_irq(void);
+void vblk_interrupt(void);
 
-// System call interface
+// Scheduling
+void yield(void);
+void process_exit(void);
+int process_fork(TrapFrame *frame);
+int current_pid(void);
+int sched_setprio(int pid, int prio);
+int process_sleep(uint64_t ticks);
+void sleep_wake_expired(void);
+void wq_wait(WaitQueue *wq, Spinlock *lk) REQUIRES(lk);
+void wq_wake_all(WaitQueue *wq);
+void sched_print_stats(void);
+void kstat_print(void);
+
+// Submission rings
+uint64_t ring_setup(uint32_t entries);
+int ring_submit(uint32_t count);
+
+// Virtual memory - Sv39 page tables, see vm_map()
+typedef uint64_t pte_t;
+typedef pte_t *pagetable_t;
+void vm_init(void);
+void vm_init_hart(void);
+pagetable_t vm_create(void);
+int vm_map(pagetable_t pt, uint64_t va, uint64_t pa, uint64_t size, uint64_t perm);
+void vm_unmap(pagetable_t pt, uint64_t va, uint64_t size);
+void vm_destroy(pagetable_t pt);
+int vm_fork(pagetable_t src, pagetable_t dst, uint64_t skip_start, uint64_t skip_end);
+int vm_cow_fault(pagetable_t pt, uint64_t va);
+uint64_t vm_alloc_va(uint64_t length);
+void vm_flush_current(void);
+pagetable_t current_pagetable(void);
+int copyin(void *dst, uint64_t src, uint64_t len);
+int copyout(uint64_t dst, const void *src, uint64_t len);
+int copyinstr(char *dst, uint64_t src, uint64_t max);
+
+// System call interface (user.c)
+void sys_exit(void);
+int sys_fork(void);
+void sys_stats(void);
+int sys_sleep(uint64_t ticks);
+int sys_pipe(int fds[2], int flags);
+int sys_sync(void);
 void sys_puts(const char *s);
 void sys_yield(void);
-int sys_open(const char *filename);
+int sys_open(const char *filename, int flags);
 int sys_close(int fd);
 int sys_read(int fd, char *buf, int count);
 int sys_write(int fd, const char *buf, int count);
 int sys_unlink(const char *filename);
 void sys_list(void);
+int sys_pread(int fd, char *buf, int count, uint64_t offset);
+int sys_pwrite(int fd, const char *buf, int count, uint64_t offset);
+int64_t sys_lseek(int fd, int64_t offset, int whence);
+void *sys_mmap(void *addr, uint64_t length, int prot, int flags, int fd, uint64_t offset);
+int sys_munmap(void *addr, uint64_t length);
+int sys_setprio(int pid, int prio);
+void syscall_bench(void);
+Ring *sys_ring_setup(uint32_t entries);
+int sys_submit(uint32_t count);
+
+// User programs (user.c), run in U-mode
+void process_a(void);
+void process_b(void);
+void writeback_main(void);
+void process_return(void);
+void bench_main(void);
 
 // Helper functions
 size_t strlen(const char *s);
\ No newline at end of file
@@ -1,20 +1,157 @@
 #include "common.h"
 
-// QEMU virt machine UART0 base address
+// ============================================================================
+// Console - 16550 UART with an Interrupt-driven Transmit Ring
+// ============================================================================
+// Output is appended to uart_tx and the UART drains it: whenever the
+// transmitter is empty (LSR.THRE) we refill its FIFO from the ring, and the
+// THR-empty interrupt (PLIC source UART0_IRQ) says when to do it again. The
+// kernel runs with interrupts off, so that interrupt is only taken while a
+// hart runs a process in U-mode. Idle harts push bytes from
+// scheduler_idle(), and a writer that finds the ring full drains it by
+// polling. Once panic() has begun, everything goes straight to THR.
+
+// QEMU virt machine UART0 base address and its PLIC source
 #define UART0_BASE 0x10000000
+#define UART0_IRQ  10
 
-// We cast the address to a pointer so we can write to it.
+// We cast the register addresses to pointers so we can access them.
 // 'volatile' tells the compiler: "Do not optimize this! The value changes outside code control."
-#define UART0_DR ((volatile uint8_t *)UART0_BASE)
+#define UART_REG(r)    ((volatile uint8_t *)(UART0_BASE + (r)))
+#define UART_THR       UART_REG(0)      // Transmit holding register (write)
+#define UART_IER       UART_REG(1)      // Interrupt enable
+#define UART_FCR       UART_REG(2)      // FIFO control (write)
+#define UART_LSR       UART_REG(5)      // Line status
+#define UART_IER_THRI  (1 << 1)         // Interrupt when THR is empty
+#define UART_FCR_INIT  0x07             // Enable and clear both FIFOs
+#define UART_LSR_THRE  (1 << 5)         // THR and TX FIFO are empty
+#define UART_FIFO_SIZE 16
+
+#define UART_TX_SIZE   4096             // Power of two
+
+static char uart_tx[UART_TX_SIZE];
+static uint32_t uart_tx_head;           // Next free slot (free-running)
+static uint32_t uart_tx_tail;           // Next byte for the UART (free-running)
+static uint8_t uart_ier;                // Last value written to UART_IER
+static Spinlock uart_lock;
+static volatile int console_panicked;   // Set by console_flush(), never cleared
+
+/**
+ * uart_init - Turn on the UART FIFOs, with interrupts off until output is queued
+ */
+void uart_init(void) {
+    *UART_FCR = UART_FCR_INIT;
+    *UART_IER = 0;
+    uart_ier = 0;
+}
+
+/**
+ * uart_putc_sync - Wait for the transmitter and send one byte, bypassing the ring
+ */
+static void uart_putc_sync(char c) {
+    while ((*UART_LSR & UART_LSR_THRE) == 0) {
+    }
+    *UART_THR = c;
+}
+
+/**
+ * uart_tx_fill - Move queued bytes into the TX FIFO if it has drained
+ * Leaves the THR-empty interrupt enabled exactly while bytes remain queued.
+ * Caller holds uart_lock.
+ */
+static void uart_tx_fill(void) {
+    if (*UART_LSR & UART_LSR_THRE) {
+        for (int i = 0; i < UART_FIFO_SIZE && uart_tx_tail != uart_tx_head; i++) {
+            *UART_THR = uart_tx[uart_tx_tail++ % UART_TX_SIZE];
+        }
+    }
+    uint8_t ier = uart_tx_tail != uart_tx_head ? UART_IER_THRI : 0;
+    if (ier != uart_ier) {
+        *UART_IER = ier;
+        uart_ier = ier;
+    }
+}
+
+/**
+ * console_write - Queue len bytes for the UART
+ * The bytes go into the ring contiguously, so output from one call is
+ * never interleaved with another hart's.
+ */
+void console_write(const char *s, size_t len) {
+    if (console_panicked) {
+        while (len-- > 0) {
+            uart_putc_sync(*s++);
+        }
+        return;
+    }
+
+    spin_lock(&uart_lock);
+    while (len > 0) {
+        uint32_t room = UART_TX_SIZE - (uart_tx_head - uart_tx_tail);
+        if (room == 0) {
+            // Full, and with the lock held nobody else can drain it
+            uart_tx_fill();
+            continue;
+        }
+        uint32_t pos = uart_tx_head % UART_TX_SIZE;
+        uint32_t n = UART_TX_SIZE - pos;
+        if (n > room) {
+            n = room;
+        }
+        if (n > len) {
+            n = len;
+        }
+        memcpy(&uart_tx[pos], s, n);
+        uart_tx_head += n;
+        s += n;
+        len -= n;
+    }
+    uart_tx_fill();
+    spin_unlock(&uart_lock);
+}
+
+/**
+ * uart_interrupt - THR-empty interrupt: refill the FIFO from the ring
+ */
+void uart_interrupt(void) {
+    spin_lock(&uart_lock);
+    uart_tx_fill();
+    spin_unlock(&uart_lock);
+}
+
+/**
+ * console_poll - Push queued output without waiting for an interrupt
+ * For idle harts, which never take one.
+ */
+void console_poll(void) {
+    // Unlocked peek so idle harts don't hammer the lock
+    if (uart_tx_tail == uart_tx_head) {
+        return;
+    }
+    spin_lock(&uart_lock);
+    uart_tx_fill();
+    spin_unlock(&uart_lock);
+}
+
+/**
+ * console_flush - Drain the ring synchronously and stop using it
+ * For panic(): skips uart_lock, since this hart may already hold it, and
+ * makes every later write synchronous.
+ */
+void console_flush(void) {
+    console_panicked = 1;
+    *UART_IER = 0;
+    while (uart_tx_tail != uart_tx_head) {
+        uart_putc_sync(uart_tx[uart_tx_tail++ % UART_TX_SIZE]);
+    }
+}
 
 void putchar(char c) {
-    *UART0_DR = c;
+    console_write(&c, 1);
 }
 
 void puts(const char *s) {
-    while (*s) {
-        putchar(*s++);
-    }
+    console_write(s, strlen(s));
 }
 
 /**
@@ -40,94 +177,378 @@ int strcmp(const char *s1, const char *s2) {
     return (unsigned char)*s1 - (unsigned char)*s2;
 }
 
+// ============================================================================
+// Memory Routines - memset / memcpy / memmove
+// ============================================================================
+// The scalar versions work a 64-bit word at a time with the main loop
+// unrolled to one 64-byte block per iteration. If the hart implements the
+// vector extension, mem_routines_init() switches to the RVV versions in
+// boot.S, which let the hardware pick the widest strip it can handle.
+//
+// The makefile passes -fno-tree-loop-distribute-patterns so GCC doesn't turn
+// these loops back into calls to memset/memcpy.
+
+// A 64-bit word that may alias any other type
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+#define MISA_V          (1ULL << ('V' - 'A'))
+#define MSTATUS_VS_INIT (1ULL << 9)
+
+extern void *memset_rvv(void *dst, int c, size_t n);
+extern void *memcpy_rvv(void *dst, const void *src, size_t n);
+
+/**
+ * memset_scalar - Fill memory using aligned 64-bit stores
+ */
+static void *memset_scalar(void *dst, int c, size_t n) {
+    uint8_t *d = (uint8_t *)dst;
+
+    // Byte stores until dst is word aligned
+    while (n > 0 && ((uint64_t)d & 7) != 0) {
+        *d++ = (uint8_t)c;
+        n--;
+    }
+
+    word_t w = (uint8_t)c * 0x0101010101010101ULL;
+    word_t *dw = (word_t *)d;
+    while (n >= 64) {
+        dw[0] = w;
+        dw[1] = w;
+        dw[2] = w;
+        dw[3] = w;
+        dw[4] = w;
+        dw[5] = w;
+        dw[6] = w;
+        dw[7] = w;
+        dw += 8;
+        n -= 64;
+    }
+    while (n >= 8) {
+        *dw++ = w;
+        n -= 8;
+    }
+
+    d = (uint8_t *)dw;
+    while (n > 0) {
+        *d++ = (uint8_t)c;
+        n--;
+    }
+    return dst;
+}
+
+/**
+ * memcpy_scalar - Copy memory forwards using 64-bit loads and stores
+ * Also safe for overlapping regions as long as dst <= src.
+ */
+static void *memcpy_scalar(void *dst, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+
+    if ((((uint64_t)d ^ (uint64_t)s) & 7) == 0) {
+        // Same alignment: byte copy up to a word boundary, then go word-wide
+        while (n > 0 && ((uint64_t)d & 7) != 0) {
+            *d++ = *s++;
+            n--;
+        }
+
+        word_t *dw = (word_t *)d;
+        const word_t *sw = (const word_t *)s;
+        while (n >= 64) {
+            word_t w0 = sw[0], w1 = sw[1], w2 = sw[2], w3 = sw[3];
+            word_t w4 = sw[4], w5 = sw[5], w6 = sw[6], w7 = sw[7];
+            dw[0] = w0;
+            dw[1] = w1;
+            dw[2] = w2;
+            dw[3] = w3;
+            dw[4] = w4;
+            dw[5] = w5;
+            dw[6] = w6;
+            dw[7] = w7;
+            dw += 8;
+            sw += 8;
+            n -= 64;
+        }
+        while (n >= 8) {
+            *dw++ = *sw++;
+            n -= 8;
+        }
+        d = (uint8_t *)dw;
+        s = (const uint8_t *)sw;
+    } else {
+        // Mutually misaligned: misaligned word accesses may trap and be
+        // emulated, so stay with bytes but unroll the loop
+        while (n >= 8) {
+            d[0] = s[0];
+            d[1] = s[1];
+            d[2] = s[2];
+            d[3] = s[3];
+            d[4] = s[4];
+            d[5] = s[5];
+            d[6] = s[6];
+            d[7] = s[7];
+            d += 8;
+            s += 8;
+            n -= 8;
+        }
+    }
+
+    while (n > 0) {
+        *d++ = *s++;
+        n--;
+    }
+    return dst;
+}
+
+/**
+ * memcpy_backward - Copy memory from the end, for overlapping dst > src
+ */
+static void *memcpy_backward(void *dst, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dst + n;
+    const uint8_t *s = (const uint8_t *)src + n;
+
+    if ((((uint64_t)d ^ (uint64_t)s) & 7) == 0) {
+        while (n > 0 && ((uint64_t)d & 7) != 0) {
+            *--d = *--s;
+            n--;
+        }
+
+        word_t *dw = (word_t *)d;
+        const word_t *sw = (const word_t *)s;
+        while (n >= 64) {
+            word_t w0 = sw[-1], w1 = sw[-2], w2 = sw[-3], w3 = sw[-4];
+            word_t w4 = sw[-5], w5 = sw[-6], w6 = sw[-7], w7 = sw[-8];
+            dw[-1] = w0;
+            dw[-2] = w1;
+            dw[-3] = w2;
+            dw[-4] = w3;
+            dw[-5] = w4;
+            dw[-6] = w5;
+            dw[-7] = w6;
+            dw[-8] = w7;
+            dw -= 8;
+            sw -= 8;
+            n -= 64;
+        }
+        while (n >= 8) {
+            *--dw = *--sw;
+            n -= 8;
+        }
+        d = (uint8_t *)dw;
+        s = (const uint8_t *)sw;
+    }
+
+    while (n > 0) {
+        *--d = *--s;
+        n--;
+    }
+    return dst;
+}
+
+// Selected once at boot by mem_routines_init(). Initialized so they live in
+// .data and work before clear_bss() runs.
+static void *(*memset_impl)(void *, int, size_t) = memset_scalar;
+static void *(*memcpy_impl)(void *, const void *, size_t) = memcpy_scalar;
+
+/**
+ * mem_vector_begin - Before the RVV routines touch the vector registers
+ */
+static inline void mem_vector_begin(void) {
+    if (memcpy_impl == memcpy_rvv) {
+        vec_kernel_begin();
+    }
+}
+
+void *memset(void *dst, int c, size_t n) {
+    mem_vector_begin();
+    return memset_impl(dst, c, n);
+}
+
+void *memcpy(void *dst, const void *src, size_t n) {
+    mem_vector_begin();
+    return memcpy_impl(dst, src, n);
+}
+
+/**
+ * memmove - Copy memory where the regions may overlap
+ * A forward copy is safe whenever dst is below src (each strip is loaded
+ * before anything that could overwrite it is stored), so only the
+ * dst-above-src overlap needs the backward copy.
+ */
+void *memmove(void *dst, const void *src, size_t n) {
+    if ((uint64_t)dst <= (uint64_t)src || (uint64_t)dst >= (uint64_t)src + n) {
+        return memcpy(dst, src, n);
+    }
+    return memcpy_backward(dst, src, n);
+}
+
+/**
+ * mem_routines_init - Pick the memset/memcpy implementation for this hart
+ * Uses the RVV versions when misa reports the V extension.
+ */
+void mem_routines_init(void) {
+    if (read_csr(misa) & MISA_V) {
+        memset_impl = memset_rvv;
+        memcpy_impl = memcpy_rvv;
+        mem_routines_init_hart();
+        pr_debug("Memory routines: RVV\n");
+    } else {
+        pr_debug("Memory routines: scalar (64-bit)\n");
+    }
+}
+
+/**
+ * mem_routines_init_hart - Per-hart setup for the selected routines
+ * Vector instructions trap while mstatus.VS is Off, and mstatus is per hart.
+ */
+void mem_routines_init_hart(void) {
+    if (memset_impl == memset_rvv) {
+        set_csr(mstatus, MSTATUS_VS_INIT);
+    }
+}
+
+// printf formats into one of these on the stack, then hands it to
+// console_write() in one go
+#define PRINTF_BUF_SIZE 256
+
+typedef struct {
+    char buf[PRINTF_BUF_SIZE];
+    size_t len;
+} PrintBuf;
+
+/**
+ * pb_putc - Append a character to a PrintBuf, writing it out when full
+ */
+static void pb_putc(PrintBuf *pb, char c) {
+    if (pb->len == sizeof(pb->buf)) {
+        console_write(pb->buf, pb->len);
+        pb->len = 0;
+    }
+    pb->buf[pb->len++] = c;
+}
+
+/**
+ * pb_puts - Append a string to a PrintBuf
+ */
+static void pb_puts(PrintBuf *pb, const char *s) {
+    while (*s) {
+        pb_putc(pb, *s++);
+    }
+}
+
+/**
+ * pb_putu - Append an unsigned decimal number to a PrintBuf
+ */
+static void pb_putu(PrintBuf *pb, uint64_t num) {
+    // Convert to string and print in reverse order
+    char digits[20];
+    int len = 0;
+    do {
+        digits[len++] = '0' + (num % 10);
+        num /= 10;
+    } while (num > 0);
+    while (len > 0) {
+        pb_putc(pb, digits[--len]);
+    }
+}
+
 /**
  * printf - A minimal printf implementation for bare metal
- * Supports: %s (string), %d (decimal), %x (hex), %% (literal %)
+ * Supports: %s (string), %d (decimal), %u (unsigned decimal), %x (hex),
+ * %% (literal %). %x prints the low 32 bits as 8 digits; %lx and %llx
+ * print the whole 64-bit value without leading zeros. Every integer
+ * argument is read as 64 bits, so 'l' changes nothing for %d and %u.
  *
  * Uses va_list macros to properly handle variadic arguments
  * across different calling conventions (RISC-V uses registers)
+ *
+ * Output up to PRINTF_BUF_SIZE bytes reaches the console in one piece, so
+ * lines from different harts don't mix.
  */
 void printf(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
+    PrintBuf pb;
+    pb.len = 0;
 
     while (*fmt) {
         if (*fmt == '%') {
             fmt++;
+            int is_long = 0;
+            while (*fmt == 'l') {
+                is_long = 1;
+                fmt++;
+            }
             switch (*fmt) {
                 case 's': {
                     // String argument
                     const char *str = va_arg(args, const char *);
-                    if (str == NULL) {
-                        puts("(null)");
-                    } else {
-                        while (*str) {
-                            putchar(*str++);
-                        }
-                    }
+                    pb_puts(&pb, str == NULL ? "(null)" : str);
                     break;
                 }
                 case 'd': {
                     // Decimal integer
                     int64_t num = va_arg(args, int64_t);
-                    if (num == 0) {
-                        putchar('0');
-                    } else {
+                    if (num < 0) {
                         // Handle negative numbers
-                        if (num < 0) {
-                            putchar('-');
-                            num = -num;
-                        }
-                        // Convert to string and print
-                        char digits[20];
-                        int len = 0;
-                        while (num > 0) {
-                            digits[len++] = '0' + (num % 10);
-                            num /= 10;
-                        }
-                        // Print in reverse order
-                        while (len > 0) {
-                            putchar(digits[--len]);
-                        }
+                        pb_putc(&pb, '-');
+                        pb_putu(&pb, -(uint64_t)num);
+                    } else {
+                        pb_putu(&pb, num);
                     }
                     break;
                 }
+                case 'u': {
+                    // Unsigned decimal integer
+                    pb_putu(&pb, va_arg(args, uint64_t));
+                    break;
+                }
                 case 'x': {
-                    // Hexadecimal (8 digits, zero-padded)
+                    // Hexadecimal: 8 digits, zero-padded, or all significant digits with 'l'
                     uint64_t num = va_arg(args, uint64_t);
                     char hex[16] = "0123456789abcdef";
-                    // Print 8 hex digits (32-bit value)
-                    for (int i = 7; i >= 0; i--) {
-                        putchar(hex[(num >> (i * 4)) & 0xF]);
+                    int i = 7;
+                    if (is_long) {
+                        i = 15;
+                        while (i > 0 && ((num >> (i * 4)) & 0xF) == 0) {
+                            i--;
+                        }
+                    }
+                    for (; i >= 0; i--) {
+                        pb_putc(&pb, hex[(num >> (i * 4)) & 0xF]);
                     }
                     break;
                 }
                 case '%': {
                     // Literal percent sign
-                    putchar('%');
+                    pb_putc(&pb, '%');
                     break;
                 }
                 default: {
                     // Unknown format specifier, just print it
-                    putchar('%');
-                    putchar(*fmt);
+                    pb_putc(&pb, '%');
+                    pb_putc(&pb, *fmt);
                     break;
                 }
             }
             fmt++;
         } else {
-            putchar(*fmt++);
+            pb_putc(&pb, *fmt++);
         }
     }
 
+    console_write(pb.buf, pb.len);
     va_end(args);
 }
 
 /**
  * panic - Halt the system with an error message
  * This is called when an unrecoverable error occurs
+ * Output from here on bypasses the console ring, so it gets out even if
+ * nothing is left to take UART interrupts.
  */
 void panic(const char *msg) {
+    // Get queued output out first, then write synchronously from here on
+    console_flush();
     puts("\n!!! KERNEL PANIC !!!\n");
     puts(msg);
     puts("\n");
@@ -136,6 +557,22 @@ void panic(const char *msg) {
     }
 }
 
+// SiFive test device (QEMU virt): writing PASS powers the machine off
+#define SIFIVE_TEST      ((volatile uint32_t *)0x100000)
+#define SIFIVE_TEST_PASS 0x5555
+
+/**
+ * poweroff - Flush the console and power the machine off
+ * Used by the benchmark image (make bench) so QEMU exits when it is done.
+ */
+void poweroff(void) {
+    console_flush();
+    *SIFIVE_TEST = SIFIVE_TEST_PASS;
+    while (1) {
+        __asm__ __volatile__("wfi");
+    }
+}
+
 /**
  * Clear the .bss section (uninitialized data)
  * This ensures all global variables are zero-initialized
@@ -143,147 +580,553 @@ void panic(const char *msg) {
 extern uint8_t __bss_start, __bss_end;
 
 void clear_bss(void) {
-    uint8_t *bss = &__bss_start;
-    while (bss < &__bss_end) {
-        *bss++ = 0;
+    memset(&__bss_start, 0, &__bss_end - &__bss_start);
+}
+
+// ============================================================================
+// Kernel Statistics - rdcycle Counters and Latency Histograms
+// ============================================================================
+// Build with CONFIG_KSTATS=y to count syscalls (by ID), traps (by cause), yields
+// and single-page allocations on each hart, with the cycles each one took
+// binned by powers of two. Without it the KSTAT_* macros expand to nothing
+// and SYS_STATS only reports what the kernel keeps track of anyway.
+//
+// Latencies are mcycle deltas, so they include time spent running other
+// processes when a handler switches away. A call that resumes on another
+// hart is counted but not timed: mcycle is per hart. Ecalls on the fast
+// path are counted per syscall but not as exceptions (they never reach
+// trap_handler); interrupts are recorded by their own handlers.
+
+// Forward declarations
+uint64_t free_page_count(void);
+void kmem_print(void);
+
+// Histogram indices: syscalls by ID, then trap causes, then yield()
+#define KSTAT_CAUSES       32   // Exception codes 0-15, then 16 + interrupt code
+#define KSTAT_SYSCALL(id)  (id)
+#define KSTAT_TRAP(cause)  (NR_SYSCALLS + ((cause) & (KSTAT_CAUSES - 1)))
+#define KSTAT_IRQ(code)    KSTAT_TRAP(16 + (code))
+#define KSTAT_YIELD        (NR_SYSCALLS + KSTAT_CAUSES)
+#define KSTAT_NHISTS       (KSTAT_YIELD + 1)
+
+#if CONFIG_KSTATS
+
+#define KSTAT_BUCKETS 24        // Bucket b: [2^b, 2^(b+1)) cycles; the last is open-ended
+
+typedef struct {
+    uint64_t count;
+    uint64_t timed;             // Samples in buckets (count minus migrations)
+    uint64_t total;             // Cycles over the timed samples
+    uint64_t max;
+    uint64_t buckets[KSTAT_BUCKETS];
+} KHist;
+
+typedef struct {
+    KHist hists[KSTAT_NHISTS];
+    uint64_t page_hits;         // alloc_page*() served from the hart's magazines
+    uint64_t page_misses;       // ... that had to take page_lock
+    uint64_t pages_freed;
+} KStats;
+
+// Only touched by their own hart, with interrupts off
+static KStats kstats[MAX_HARTS];
+
+#define KSTAT_BEGIN(t)        uint64_t t##_hart = hart_id(), t = read_csr(mcycle)
+#define KSTAT_END(idx, t)     kstat_record(&kstats[hart_id()].hists[idx], t##_hart, t)
+#define KSTAT_ADD(counter, n) (kstats[hart_id()].counter += (n))
+
+/**
+ * kstat_record - Count one event and bin the cycles since start
+ */
+static void kstat_record(KHist *h, uint64_t start_hart, uint64_t start) {
+    uint64_t cycles = read_csr(mcycle) - start;
+    h->count++;
+    if (hart_id() != start_hart) {
+        return;
+    }
+    int b = 0;
+    while (b < KSTAT_BUCKETS - 1 && (cycles >> (b + 1)) != 0) {
+        b++;
     }
+    h->timed++;
+    h->total += cycles;
+    if (cycles > h->max) {
+        h->max = cycles;
+    }
+    h->buckets[b]++;
 }
 
 /**
- * trap_init - Initialize trap handling
- * Sets up the trap vector address in the mtvec (Machine Trap Vector) CSR
- * Note: QEMU starts in machine mode, so we use mtvec not stvec
+ * syscall_timed - Run a syscall handler and record it under its ID
+ * The ecall fast path in boot.S calls this instead of fn when built with
+ * CONFIG_KSTATS, and syscall_handler() does the same on the full path.
  */
-void trap_init(void) {
-    // Write the address of trap_vector to mtvec
-    // mtvec[1:0] = 00 means "Direct" mode (jump to address)
-    // mtvec[63:2] = base address of trap vector
-    extern void trap_vector(void);
-    write_csr(mtvec, (uint64_t)trap_vector);
-    printf("Trap handler initialized at %x\n", (uint64_t)trap_vector);
+uint64_t syscall_timed(TrapFrame *frame, uint64_t (*fn)(TrapFrame *frame)) {
+    uint64_t id = frame->a7;
+    KSTAT_BEGIN(t);
+    uint64_t ret = fn(frame);
+    KSTAT_END(KSTAT_SYSCALL(id), t);
+    return ret;
 }
 
+static const char *kstat_syscall_names[NR_SYSCALLS] = {
+    [SYS_NULL] = "null",       [SYS_PUTS] = "puts",     [SYS_YIELD] = "yield",
+    [SYS_OPEN] = "open",       [SYS_CLOSE] = "close",   [SYS_READ] = "read",
+    [SYS_WRITE] = "write",     [SYS_UNLINK] = "unlink", [SYS_LIST] = "list",
+    [SYS_SETPRIO] = "setprio", [SYS_RING_SETUP] = "ring_setup",
+    [SYS_SUBMIT] = "submit",   [SYS_PREAD] = "pread",   [SYS_PWRITE] = "pwrite",
+    [SYS_LSEEK] = "lseek",     [SYS_MMAP] = "mmap",     [SYS_MUNMAP] = "munmap",
+    [SYS_EXIT] = "exit",       [SYS_FORK] = "fork",     [SYS_STATS] = "stats",
+    [SYS_SLEEP] = "sleep",     [SYS_PIPE] = "pipe",     [SYS_SYNC] = "sync",
+};
+
 /**
- * syscall_handler - Handle a system call from a user process
- * Called when trap_handler detects an ecall exception
- * @id: The syscall ID (from a7 register)
- * @arg0: First argument (from a0 register)
- * @arg1: Second argument (from a1 register)
- * @arg2: Third argument (from a2 register)
+ * kstat_print_hist - Print one histogram summed over all harts
+ * Skipped if it never fired. One line of totals, then one per non-empty bucket.
  */
-void syscall_handler(uint64_t id, uint64_t arg0, uint64_t arg1, uint64_t arg2) {
-    switch (id) {
-        case SYS_PUTS: {
-            // Print a string passed from the process
-            const char *s = (const char *)arg0;
-            if (s) {
-                puts(s);
-            }
-            break;
-        }
-        case SYS_YIELD: {
-            // Yield control to the next process
-            yield();
-            break;
-        }
-        case SYS_OPEN: {
-            // Open/create a file
-            const char *filename = (const char *)arg0;
-            // Return value is stored in frame->a0, but we need to update it
-            // For now, just call fs_open and it will be handled by the caller
-            int fd = fs_open(filename);
-            // Note: In a real syscall, we'd set the return value in the trap frame
-            break;
-        }
-        case SYS_CLOSE: {
-            // Close a file
-            int fd = (int)arg0;
-            fs_close(fd);
-            break;
-        }
-        case SYS_READ: {
-            // Read from a file
-            int fd = (int)arg0;
-            char *buf = (char *)arg1;
-            int count = (int)arg2;
-            fs_read(fd, buf, count);
-            break;
-        }
-        case SYS_WRITE: {
-            // Write to a file
-            int fd = (int)arg0;
-            const char *buf = (const char *)arg1;
-            int count = (int)arg2;
-            fs_write(fd, buf, count);
-            break;
+static void kstat_print_hist(int idx) {
+    KHist sum;
+    memset(&sum, 0, sizeof(sum));
+    for (int i = 0; i < MAX_HARTS; i++) {
+        KHist *h = &kstats[i].hists[idx];
+        sum.count += h->count;
+        sum.timed += h->timed;
+        sum.total += h->total;
+        if (h->max > sum.max) {
+            sum.max = h->max;
         }
-        case SYS_UNLINK: {
-            // Delete a file
-            const char *filename = (const char *)arg0;
-            fs_unlink(filename);
-            break;
+        for (int b = 0; b < KSTAT_BUCKETS; b++) {
+            sum.buckets[b] += h->buckets[b];
         }
-        case SYS_LIST: {
-            // List all files
-            fs_list();
-            break;
+    }
+    if (sum.count == 0) {
+        return;
+    }
+
+    uint64_t avg = sum.timed ? sum.total / sum.timed : 0;
+    if (idx < NR_SYSCALLS) {
+        const char *name = kstat_syscall_names[idx];
+        printf("syscall %s: %u calls, avg %u cycles, max %u\n",
+               name ? name : "?", sum.count, avg, sum.max);
+    } else if (idx < KSTAT_YIELD) {
+        uint64_t cause = idx - NR_SYSCALLS;
+        printf("%s %u: %u calls, avg %u cycles, max %u\n",
+               cause < 16 ? "exception" : "interrupt", cause % 16, sum.count, avg, sum.max);
+    } else {
+        printf("yield: %u calls, avg %u cycles, max %u\n", sum.count, avg, sum.max);
+    }
+    for (int b = 0; b < KSTAT_BUCKETS; b++) {
+        if (sum.buckets[b] != 0) {
+            printf("  2^%u: %u\n", b, sum.buckets[b]);
         }
-        default:
-            printf("[SYSCALL] Unknown syscall ID: %d\n", id);
     }
 }
 
+#else
+
+#define KSTAT_BEGIN(t)        do { } while (0)
+#define KSTAT_END(idx, t)     do { } while (0)
+#define KSTAT_ADD(counter, n) ((void)(n))
+
+#endif
+
 /**
- * sys_puts - System call to print a string
- * Invokes the SYS_PUTS syscall via ecall instruction
+ * kstat_print - Dump the kernel statistics (SYS_STATS)
  */
-void sys_puts(const char *s) {
-    syscall(SYS_PUTS, (uint64_t)s, 0, 0);
+void kstat_print(void) {
+    printf("Pages: %u free\n", free_page_count());
+    kmem_print();
+#if CONFIG_KSTATS
+    uint64_t hits = 0, misses = 0, freed = 0;
+    for (int i = 0; i < MAX_HARTS; i++) {
+        hits += kstats[i].page_hits;
+        misses += kstats[i].page_misses;
+        freed += kstats[i].pages_freed;
+    }
+    printf("Page allocs: %u magazine hits, %u misses, %u pages freed\n", hits, misses, freed);
+    for (int idx = 0; idx < KSTAT_NHISTS; idx++) {
+        kstat_print_hist(idx);
+    }
+#else
+    printf("Syscall, trap and allocator counters need a CONFIG_KSTATS=y build\n");
+#endif
+    sched_print_stats();
 }
 
+#define MTVEC_VECTORED 1
+
 /**
- * sys_yield - System call to yield control to next process
- * Invokes the SYS_YIELD syscall via ecall instruction
+ * trap_init - Initialize trap handling
+ * Sets up the trap vector address in the mtvec (Machine Trap Vector) CSR
+ * Note: QEMU starts in machine mode, so we use mtvec not stvec
  */
-void sys_yield(void) {
-    syscall(SYS_YIELD, 0, 0, 0);
+void trap_init(void) {
+    extern void trap_vector_table(void);
+    trap_init_hart();
+    pr_debug("Trap vector table initialized at %x\n", (uint64_t)trap_vector_table);
 }
 
 /**
- * trap_handler - Handle a trap (interrupt or exception)
- * Called by assembly trap_vector when a trap occurs
- * @frame: Pointer to saved CPU state
+ * trap_init_hart - Install the trap vector on the calling hart
+ * mtvec is a per-hart CSR, so every hart has to do this once.
  */
-void trap_handler(TrapFrame *frame) {
-    // Read the cause of the trap (machine mode)
-    uint64_t cause = read_csr(mcause);
-    uint64_t epc = read_csr(mepc);
-    uint64_t tval = read_csr(mtval);
+void trap_init_hart(void) {
+    // Write the address of trap_vector_table to mtvec
+    // mtvec[1:0] = 01 means "Vectored" mode: exceptions jump to the base,
+    // interrupt cause n to base + 4 * n (see boot.S)
+    // mtvec[63:2] = base address of trap vector
+    extern void trap_vector_table(void);
+    write_csr(mtvec, (uint64_t)trap_vector_table | MTVEC_VECTORED);
+}
 
-    // Decode the cause
-    // Bit 63: 1 = Interrupt, 0 = Exception
-    // Bits 62-0: Trap code
-    uint64_t is_interrupt = (cause >> 63) & 1;
-    uint64_t code = cause & 0x3F;
+/**
+ * System call handlers
+ * Each reads its arguments from the caller's saved a0-a5 and returns the
+ * value the caller gets back in a0. The ecall fast path in boot.S calls
+ * them straight from syscall_table. Pointer arguments are user addresses:
+ * strings are fetched with copyinstr(), and fs_* take buffers as user
+ * addresses themselves.
+ */
+static uint64_t syscall_null(TrapFrame *frame) {
+    (void)frame;
+    return 0;
+}
 
-    if (is_interrupt) {
-        printf("[INTERRUPT] Code: %d, EPC: %x\n", code, epc);
-    } else if (code != 8 && code != 9 && code != 11) {
-        printf("[EXCEPTION] Code: %d, EPC: %x, TVAL: %x\n", code, epc, tval);
+static uint64_t syscall_puts(TrapFrame *frame) {
+    // Print a string passed from the process, a chunk at a time
+    char chunk[128];
+    uint64_t s = frame->a0;
+    while (1) {
+        int len = copyinstr(chunk, s, sizeof(chunk) - 1);
+        if (len < 0) {
+            return (uint64_t)-1;
+        }
+        console_write(chunk, len);
+        if (len < (int)sizeof(chunk) - 1) {
+            return 0;
+        }
+        s += len;
+    }
+}
 
-        // Decode common exception codes
-        switch (code) {
-            case 0:
-                printf("  -> Instruction Address Misaligned\n");
-                break;
-            case 1:
-                printf("  -> Instruction Access Fault\n");
-                break;
-            case 2:
-                printf("  -> Illegal Instruction\n");
-                break;
-            case 3:
-                printf("  -> Breakpoint (ebreak)\n");
+static uint64_t syscall_exit(TrapFrame *frame) {
+    (void)frame;
+    process_exit();
+    return 0;
+}
+
+/**
+ * fetch_filename - Copy a filename from user address uaddr
+ * Names longer than MAX_FILENAME - 1 are cut short, as fs_open() would.
+ * Returns 0, or -1 if the string is not readable.
+ */
+static int fetch_filename(char *name, uint64_t uaddr) {
+    int len = copyinstr(name, uaddr, MAX_FILENAME);
+    if (len < 0) {
+        return -1;
+    }
+    if (len == MAX_FILENAME) {
+        name[MAX_FILENAME - 1] = '\0';
+    }
+    return 0;
+}
+
+static uint64_t syscall_yield(TrapFrame *frame) {
+    (void)frame;
+    yield();
+    return 0;
+}
+
+static uint64_t syscall_open(TrapFrame *frame) {
+    char name[MAX_FILENAME];
+    if (fetch_filename(name, frame->a0) != 0) {
+        return (uint64_t)-1;
+    }
+    return fs_open(name, (int)frame->a1);
+}
+
+static uint64_t syscall_close(TrapFrame *frame) {
+    return fs_close((int)frame->a0);
+}
+
+static uint64_t syscall_read(TrapFrame *frame) {
+    return fs_read((int)frame->a0, (char *)frame->a1, (int)frame->a2);
+}
+
+static uint64_t syscall_write(TrapFrame *frame) {
+    return fs_write((int)frame->a0, (const char *)frame->a1, (int)frame->a2);
+}
+
+static uint64_t syscall_unlink(TrapFrame *frame) {
+    char name[MAX_FILENAME];
+    if (fetch_filename(name, frame->a0) != 0) {
+        return (uint64_t)-1;
+    }
+    return fs_unlink(name);
+}
+
+static uint64_t syscall_list(TrapFrame *frame) {
+    (void)frame;
+    fs_list();
+    return 0;
+}
+
+static uint64_t syscall_pread(TrapFrame *frame) {
+    return fs_pread((int)frame->a0, (char *)frame->a1, (int)frame->a2, frame->a3);
+}
+
+static uint64_t syscall_pwrite(TrapFrame *frame) {
+    return fs_pwrite((int)frame->a0, (const char *)frame->a1, (int)frame->a2, frame->a3);
+}
+
+static uint64_t syscall_lseek(TrapFrame *frame) {
+    return fs_lseek((int)frame->a0, (int64_t)frame->a1, (int)frame->a2);
+}
+
+static uint64_t syscall_mmap(TrapFrame *frame) {
+    // a0 is the address hint, not used yet
+    return fs_mmap(frame->a1, (int)frame->a2, (int)frame->a3, (int)frame->a4, frame->a5);
+}
+
+static uint64_t syscall_munmap(TrapFrame *frame) {
+    return fs_munmap(frame->a0, frame->a1);
+}
+
+static uint64_t syscall_setprio(TrapFrame *frame) {
+    // Change a process's priority within its scheduling class
+    return sched_setprio((int)frame->a0, (int)frame->a1);
+}
+
+static uint64_t syscall_pipe(TrapFrame *frame) {
+    return pipe_create(frame->a0, (int)frame->a1);
+}
+
+static uint64_t syscall_sync(TrapFrame *frame) {
+    (void)frame;
+    return (uint64_t)fs_sync();
+}
+
+static uint64_t syscall_sleep(TrapFrame *frame) {
+    return (uint64_t)process_sleep(frame->a0);
+}
+
+static uint64_t syscall_stats(TrapFrame *frame) {
+    (void)frame;
+    kstat_print();
+    return 0;
+}
+
+static uint64_t syscall_ring_setup(TrapFrame *frame) {
+    return ring_setup((uint32_t)frame->a0);
+}
+
+static uint64_t syscall_submit(TrapFrame *frame) {
+    return ring_submit((uint32_t)frame->a0);
+}
+
+/**
+ * syscall_table - Handlers indexed by syscall ID (a7)
+ * Read directly by the ecall fast path in boot.S; a NULL slot makes it
+ * fall back to trap_handler, which handles SYS_FORK and reports any other
+ * unknown ID.
+ */
+typedef uint64_t (*syscall_fn)(TrapFrame *frame);
+
+const syscall_fn syscall_table[NR_SYSCALLS] = {
+    [SYS_NULL]       = syscall_null,
+    [SYS_PUTS]       = syscall_puts,
+    [SYS_YIELD]      = syscall_yield,
+    [SYS_OPEN]       = syscall_open,
+    [SYS_CLOSE]      = syscall_close,
+    [SYS_READ]       = syscall_read,
+    [SYS_WRITE]      = syscall_write,
+    [SYS_UNLINK]     = syscall_unlink,
+    [SYS_LIST]       = syscall_list,
+    [SYS_SETPRIO]    = syscall_setprio,
+    [SYS_RING_SETUP] = syscall_ring_setup,
+    [SYS_SUBMIT]     = syscall_submit,
+    [SYS_PREAD]      = syscall_pread,
+    [SYS_PWRITE]     = syscall_pwrite,
+    [SYS_LSEEK]      = syscall_lseek,
+    [SYS_MMAP]       = syscall_mmap,
+    [SYS_MUNMAP]     = syscall_munmap,
+    [SYS_EXIT]       = syscall_exit,
+    [SYS_STATS]      = syscall_stats,
+    [SYS_SLEEP]      = syscall_sleep,
+    [SYS_PIPE]       = syscall_pipe,
+    [SYS_SYNC]       = syscall_sync,
+};
+
+/**
+ * syscall_handler - Handle a system call on the full trap path
+ * Called when trap_handler detects an ecall exception, which only happens
+ * for IDs the fast path in boot.S rejects (or for every ecall when built
+ * with CONFIG_SYSCALL_SLOW_PATH=y). SYS_FORK is one of them on purpose: the child
+ * starts from a copy of the whole frame.
+ * @frame: Saved registers; a7 holds the syscall ID, a0-a5 the arguments
+ * The result goes back to the caller in frame->a0.
+ */
+void syscall_handler(TrapFrame *frame) {
+    uint64_t id = frame->a7;
+    if (id == SYS_FORK) {
+        // Needs every register in the frame, so it has no syscall_table slot
+        KSTAT_BEGIN(t);
+        frame->a0 = (uint64_t)process_fork(frame);
+        KSTAT_END(KSTAT_SYSCALL(SYS_FORK), t);
+        return;
+    }
+    if (id >= NR_SYSCALLS || syscall_table[id] == NULL) {
+        printf("[SYSCALL] Unknown syscall ID: %d\n", id);
+        frame->a0 = (uint64_t)-1;
+        return;
+    }
+#if CONFIG_KSTATS
+    frame->a0 = syscall_timed(frame, syscall_table[id]);
+#else
+    frame->a0 = syscall_table[id](frame);
+#endif
+}
+
+// Interrupt codes (mcause with bit 63 set)
+#define IRQ_M_SOFT  3
+#define IRQ_M_TIMER 7
+#define IRQ_M_EXT   11
+
+// PLIC - platform interrupt controller for devices (QEMU virt layout)
+// Each hart has two contexts, M-mode then S-mode
+#define PLIC_BASE           0x0c000000
+#define PLIC_MCONTEXT(h)    (2 * (h))
+#define PLIC_PRIORITY(irq)  ((volatile uint32_t *)(PLIC_BASE + 4 * (uint64_t)(irq)))
+#define PLIC_ENABLE(ctx)    ((volatile uint32_t *)(PLIC_BASE + 0x2000 + 0x80 * (ctx)))
+#define PLIC_THRESHOLD(ctx) ((volatile uint32_t *)(PLIC_BASE + 0x200000 + 0x1000 * (ctx)))
+#define PLIC_CLAIM(ctx)     ((volatile uint32_t *)(PLIC_BASE + 0x200004 + 0x1000 * (ctx)))
+#define MIE_MEIE            (1ULL << 11)
+
+static uint32_t plic_enabled[2];        // Sources every hart's M-mode context takes
+
+/**
+ * plic_enable - Give a source a PLIC priority and route it to every hart
+ * Harts that start later pick it up in plic_init_hart().
+ */
+void plic_enable(uint32_t irq) {
+    *PLIC_PRIORITY(irq) = 1;
+    __atomic_fetch_or(&plic_enabled[irq / 32], 1U << (irq % 32), __ATOMIC_RELAXED);
+    PLIC_ENABLE(PLIC_MCONTEXT(hart_id()))[irq / 32] |= 1U << (irq % 32);
+}
+
+/**
+ * plic_init - Route the UART to the boot hart
+ */
+void plic_init(void) {
+    plic_init_hart();
+    plic_enable(UART0_IRQ);
+    pr_debug("PLIC: UART IRQ %d\n", UART0_IRQ);
+}
+
+/**
+ * plic_init_hart - Let the calling hart's M-mode context take the enabled sources
+ * Any hart running a process can then refill the UART; the PLIC hands
+ * each interrupt to whichever claims it first.
+ */
+void plic_init_hart(void) {
+    uint64_t ctx = PLIC_MCONTEXT(hart_id());
+    for (int i = 0; i < 2; i++) {
+        PLIC_ENABLE(ctx)[i] = __atomic_load_n(&plic_enabled[i], __ATOMIC_RELAXED);
+    }
+    *PLIC_THRESHOLD(ctx) = 0;
+    set_csr(mie, MIE_MEIE);
+}
+
+/**
+ * external_interrupt - Machine external interrupt: claim and complete PLIC sources
+ * Entered straight from the trap_mext stub in boot.S.
+ */
+void external_interrupt(void) {
+    KSTAT_BEGIN(t);
+    volatile uint32_t *claim = PLIC_CLAIM(PLIC_MCONTEXT(hart_id()));
+    uint32_t irq;
+    while ((irq = *claim) != 0) {
+        if (irq == UART0_IRQ) {
+            uart_interrupt();
+        } else if (vblk_present() && irq == vblk_irq()) {
+            vblk_interrupt();
+        } else {
+            printf("[INTERRUPT] Unexpected external IRQ %d\n", irq);
+        }
+        *claim = irq;
+    }
+    KSTAT_END(KSTAT_IRQ(IRQ_M_EXT), t);
+}
+
+// mstatus.MPP: the privilege mode a trap came from
+#define MSTATUS_MPP   (3ULL << 11)
+#define MSTATUS_MPP_U (0ULL << 11)
+#define MSTATUS_MPIE  (1ULL << 7)
+
+#define TRAP_FRAME_SIZE 272     // Stack boot.S reserves per trap: TrapFrame, 16-byte aligned
+
+/**
+ * trap_handler - Handle a trap (interrupt or exception)
+ * Called by assembly trap_vector for exceptions other than the ecalls it
+ * handles itself and for interrupts without their own vector entry
+ * @frame: Pointer to saved CPU state
+ */
+void trap_handler(TrapFrame *frame) {
+    // Read the cause of the trap (machine mode)
+    uint64_t cause = read_csr(mcause);
+    uint64_t epc = frame->mepc;
+    uint64_t tval = read_csr(mtval);
+
+    // Decode the cause
+    // Bit 63: 1 = Interrupt, 0 = Exception
+    // Bits 62-0: Trap code
+    uint64_t is_interrupt = (cause >> 63) & 1;
+    uint64_t code = cause & 0x3F;
+    int from_user = (frame->mstatus & MSTATUS_MPP) == MSTATUS_MPP_U;
+    KSTAT_BEGIN(t);
+
+    // A store to a copy-on-write page: retry it once the page is our own
+    if (!is_interrupt && code == 15 && from_user && vm_cow_fault(current_pagetable(), tval) == 0) {
+        vm_flush_current();
+        KSTAT_END(KSTAT_TRAP(code), t);
+        return;
+    }
+
+    // First FP or vector instruction since the process was switched in
+    if (!is_interrupt && code == 2 && from_user && fpu_trap(frame) == 0) {
+        KSTAT_END(KSTAT_TRAP(code), t);
+        return;
+    }
+
+    if (is_interrupt) {
+        if (code == IRQ_M_TIMER) {
+            // Timer tick: preempt into the scheduler once the slice is used up
+            timer_interrupt();
+        } else if (code == IRQ_M_SOFT) {
+            // A more urgent process was queued for us
+            ipi_interrupt();
+        } else if (code == IRQ_M_EXT) {
+            external_interrupt();
+        } else {
+            printf("[INTERRUPT] Code: %d, EPC: %x\n", code, epc);
+        }
+    } else if (code != 8 && code != 9 && code != 11) {
+        printf("[EXCEPTION] Code: %d, EPC: %x, TVAL: %x\n", code, epc, tval);
+
+#if CONFIG_TRAP_DECODE
+        // Decode common exception codes
+        switch (code) {
+            case 0:
+                printf("  -> Instruction Address Misaligned\n");
+                break;
+            case 1:
+                printf("  -> Instruction Access Fault\n");
+                break;
+            case 2:
+                printf("  -> Illegal Instruction\n");
+                break;
+            case 3:
+                printf("  -> Breakpoint (ebreak)\n");
                 break;
             case 4:
                 printf("  -> Load Address Misaligned\n");
@@ -309,14 +1152,15 @@ void trap_handler(TrapFrame *frame) {
             default:
                 printf("  -> Unknown exception\n");
         }
+#endif
     }
 
     // Handle system calls (ecall) before advancing mepc
-    // This allows syscall_handler to modify registers before returning
+    // Normally boot.S takes the fast path and we never see ecalls here
     if (!is_interrupt && (code == 8 || code == 9 || code == 11)) {
         // This is an ecall - dispatch to the syscall handler
-        // Arguments are in frame->a0, frame->a1, frame->a2, and syscall ID in frame->a7
-        syscall_handler(frame->a7, frame->a0, frame->a1, frame->a2);
+        // Arguments are in frame->a0..a5, and syscall ID in frame->a7
+        syscall_handler(frame);
     }
 
     // For recoverable exceptions, advance mepc past the exception-causing instruction
@@ -326,604 +1170,6242 @@ void trap_handler(TrapFrame *frame) {
             // User may want to step past breakpoint, leave mepc as-is
         } else if (code == 8 || code == 9 || code == 11) {
             // For ecalls, skip the instruction (it's 4 bytes)
-            uint64_t new_epc = epc + 4;
-            write_csr(mepc, new_epc);
-            asm volatile("fence");
+            // trap_vector writes frame->mepc back before mret
+            frame->mepc = epc + 4;
         }
     }
 
+    if (!is_interrupt) {
+        KSTAT_END(KSTAT_TRAP(code), t);
+    }
+
     // If it's an unrecoverable exception, panic
     // Allow breakpoints (code 3) and ecalls (code 8, 9, 11) to be recoverable
+    // A process that faults in U-mode only takes itself down
     if (!is_interrupt && code != 3 && code != 8 && code != 9 && code != 11) {
+        if (from_user) {
+            printf("Killing process %d\n", current_pid());
+            process_exit();
+        }
         panic("Unrecoverable exception!");
     }
 }
 
 // ============================================================================
-// File System - RAM-Based
+// Virtual Memory - Sv39 Address Spaces
 // ============================================================================
+// The kernel stays in M-mode, where loads, stores and fetches are never
+// translated: it works on physical addresses throughout and takes no TLB
+// entries at all, so it needs no mapping of its own. Processes run in U-mode
+// on their own Sv39 page table, tagged with an ASID (see vm_activate()):
+//
+//   user image (user.c)    identity-mapped: text R-X and rodata R-- shared,
+//                          data/bss RW- copied per process
+//   USER_MMAP_BASE ...     file mappings and submission rings, see vm_alloc_va()
+//   ... USER_STACK_TOP     the user stack, USER_STACK_PAGES pages
+//
+// vm_map() uses the largest leaf (4KB, 2MB or 1GB) the alignment allows,
+// so a file mapping backed by a 4MB extent costs two TLB entries, not 1024.
 
 // Forward declarations
 uint64_t alloc_page(void);
+uint64_t alloc_page_nozero(void);
 void free_page(uint64_t page_addr);
-void yield(void);
+uint64_t alloc_pages(uint64_t count);
+uint64_t alloc_pages_nozero(uint64_t count);
+void free_pages(uint64_t addr, uint64_t count);
+void page_ref(uint64_t addr);
+int page_unref(uint64_t addr);
+int page_shared(uint64_t addr);
+
+#define PTE_V     (1ULL << 0)
+#define PTE_R     (1ULL << 1)
+#define PTE_W     (1ULL << 2)
+#define PTE_X     (1ULL << 3)
+#define PTE_U     (1ULL << 4)
+#define PTE_A     (1ULL << 6)
+#define PTE_D     (1ULL << 7)
+#define PTE_OWNED (1ULL << 8)   // RSW bit: the page belongs to this address space
+#define PTE_COW   (1ULL << 9)   // RSW bit: writable, but shared until the first store
+
+#define PTE_PA(pte)       (((pte) >> 10) << 12)
+#define PA_PTE(pa)        (((pa) >> 12) << 10)
+#define PTE_FLAGS(pte)    ((pte) & 0x3FF)
+#define PTE_LEAF(pte)     ((pte) & (PTE_R | PTE_W | PTE_X))
+#define VPN(va, level)    (((va) >> (12 + 9 * (level))) & 0x1FF)
+#define LEVEL_SIZE(level) (1ULL << (12 + 9 * (level)))     // 4KB, 2MB, 1GB
+#define PT_LEVELS         3
+
+#define SATP_SV39        (8ULL << 60)
+#define SATP_ASID_SHIFT  44
+#define SATP_ASID_MASK   0xFFFFULL
+
+#define USER_VA_END      (1ULL << 38)                   // Top of the lower half of Sv39
+#define USER_STACK_PAGES 4
+#define USER_STACK_TOP   (USER_VA_END - PAGE_SIZE)      // Unmapped guard page above it
+#define USER_MMAP_BASE   (1ULL << 37)
+
+// PMP entry 0 as one NAPOT region covering all of memory, RWX
+#define PMP_ALL_ADDR     0x003FFFFFFFFFFFFFULL
+#define PMP_ALL_CFG      0x1F
+
+static uint64_t asid_max;       // Largest ASID satp takes, 0 if it has none
 
 /**
- * Inode - File metadata
- * Stores filename, size, and pointer to data in memory
+ * vm_init - Check for Sv39 and probe how many ASID bits satp implements
+ * satp only affects S/U-mode, so writing it here is harmless.
  */
-typedef struct {
-    char filename[MAX_FILENAME];
-    uint64_t size;              // Current file size (0 = unused)
-    uint64_t data_addr;         // Pointer to data buffer (4KB page)
-    int in_use;                 // Is this inode active?
-} Inode;
+void vm_init(void) {
+    write_csr(satp, SATP_SV39 | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+    uint64_t satp = read_csr(satp);
+    write_csr(satp, 0);
+    if ((satp & SATP_SV39) != SATP_SV39) {
+        panic("Sv39 paging not supported");
+    }
+    asid_max = (satp >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+
+    vm_init_hart();
+    if (asid_max == 0) {
+        pr_debug("Sv39 paging enabled, no ASIDs (TLB flushed on every switch)\n");
+    } else {
+        pr_debug("Sv39 paging enabled, ASIDs 1-%d\n", asid_max);
+    }
+}
+
+/**
+ * vm_init_hart - Let the calling hart run processes in U-mode
+ * With PMP implemented, U-mode may not touch any memory until an entry
+ * allows it; one entry over everything leaves protection to the page
+ * tables. mcounteren/scounteren expose cycle, time and instret to U-mode.
+ */
+void vm_init_hart(void) {
+    write_csr(pmpaddr0, PMP_ALL_ADDR);
+    write_csr(pmpcfg0, PMP_ALL_CFG);
+    write_csr(mcounteren, 7);
+    write_csr(scounteren, 7);
+}
+
+/**
+ * vm_create - Allocate an empty page table, or NULL
+ */
+pagetable_t vm_create(void) {
+    return (pagetable_t)alloc_page();
+}
+
+/**
+ * vm_walk - Find the PTE that maps va at the given level (0 = 4KB leaf)
+ * Missing intermediate tables are allocated if alloc is set. Returns NULL
+ * if one is missing or memory ran out, or if a larger leaf covers va.
+ */
+static pte_t *vm_walk(pagetable_t pt, uint64_t va, int level, int alloc) {
+    for (int l = PT_LEVELS - 1; l > level; l--) {
+        pte_t *pte = &pt[VPN(va, l)];
+        if (*pte & PTE_V) {
+            if (PTE_LEAF(*pte)) {
+                return NULL;
+            }
+        } else {
+            uint64_t table = alloc ? alloc_page() : 0;
+            if (table == 0) {
+                return NULL;
+            }
+            *pte = PA_PTE(table) | PTE_V;
+        }
+        pt = (pagetable_t)PTE_PA(*pte);
+    }
+    return &pt[VPN(va, level)];
+}
+
+/**
+ * vm_lookup - Find the leaf PTE that maps va, and the level it is at
+ * Returns NULL if va is not mapped.
+ */
+static pte_t *vm_lookup(pagetable_t pt, uint64_t va, int *level) {
+    if (va >= USER_VA_END) {
+        return NULL;
+    }
+    for (int l = PT_LEVELS - 1; l >= 0; l--) {
+        pte_t *pte = &pt[VPN(va, l)];
+        if (!(*pte & PTE_V)) {
+            return NULL;
+        }
+        if (PTE_LEAF(*pte)) {
+            *level = l;
+            return pte;
+        }
+        pt = (pagetable_t)PTE_PA(*pte);
+    }
+    return NULL;
+}
+
+/**
+ * vm_map - Map [va, va + size) to the physical memory at pa
+ * Both addresses and size must be page-aligned; perm is the PTE_* bits to
+ * set (leaves are always marked accessed and dirty, so hardware never has
+ * to). Each step uses the largest leaf that va, pa and the bytes left line
+ * up with. Returns 0, or -1 if memory ran out or part of the range was
+ * already mapped; what was mapped before that stays mapped.
+ */
+int vm_map(pagetable_t pt, uint64_t va, uint64_t pa, uint64_t size, uint64_t perm) {
+    if (va >= USER_VA_END || size > USER_VA_END - va) {
+        return -1;
+    }
+    while (size > 0) {
+        int level = PT_LEVELS - 1;
+        while (level > 0 && (!is_aligned(va | pa, LEVEL_SIZE(level)) || size < LEVEL_SIZE(level))) {
+            level--;
+        }
+        pte_t *pte = vm_walk(pt, va, level, 1);
+        if (pte == NULL || (*pte & PTE_V)) {
+            printf("ERROR: Cannot map 0x%x\n", va);
+            return -1;
+        }
+        *pte = PA_PTE(pa) | perm | PTE_V | PTE_A | PTE_D;
+        va += LEVEL_SIZE(level);
+        pa += LEVEL_SIZE(level);
+        size -= LEVEL_SIZE(level);
+    }
+    return 0;
+}
+
+/**
+ * vm_free_leaf - Drop the address space's hold on the memory behind a leaf
+ * Owned pages are freed once no fork shares them any more.
+ */
+static void vm_free_leaf(pte_t pte, int level) {
+    if ((pte & PTE_OWNED) && page_unref(PTE_PA(pte))) {
+        free_pages(PTE_PA(pte), LEVEL_SIZE(level) / PAGE_SIZE);
+    }
+}
+
+/**
+ * vm_unmap - Remove the mappings in [va, va + size)
+ * Owned pages are freed; a larger leaf that the range only partly covers
+ * is removed whole. Intermediate tables stay until vm_destroy(). The
+ * caller flushes the TLB.
+ */
+void vm_unmap(pagetable_t pt, uint64_t va, uint64_t size) {
+    uint64_t end = va + size;
+    while (va < end) {
+        int level;
+        pte_t *pte = vm_lookup(pt, va, &level);
+        if (pte == NULL) {
+            va += PAGE_SIZE;
+            continue;
+        }
+        vm_free_leaf(*pte, level);
+        *pte = 0;
+        va = (va & ~(LEVEL_SIZE(level) - 1)) + LEVEL_SIZE(level);
+    }
+}
+
+/**
+ * vm_free_table - Free a page table page, everything below it and the pages it owns
+ */
+static void vm_free_table(pagetable_t pt, int level) {
+    for (int i = 0; i < 512; i++) {
+        pte_t pte = pt[i];
+        if (!(pte & PTE_V)) {
+            continue;
+        }
+        if (PTE_LEAF(pte)) {
+            vm_free_leaf(pte, level);
+        } else {
+            vm_free_table((pagetable_t)PTE_PA(pte), level - 1);
+        }
+    }
+    free_page((uint64_t)pt);
+}
+
+/**
+ * vm_destroy - Free a whole address space
+ * It must not be live in any satp that could still be used.
+ */
+void vm_destroy(pagetable_t pt) {
+    vm_free_table(pt, PT_LEVELS - 1);
+}
+
+/**
+ * vm_fork_table - Copy the mappings under one page table page into dst
+ * base is the address the table starts at, level its level.
+ */
+static int vm_fork_table(pagetable_t src, int level, uint64_t base, pagetable_t dst,
+                         uint64_t skip_start, uint64_t skip_end) {
+    for (int i = 0; i < 512; i++) {
+        pte_t *pte = &src[i];
+        uint64_t va = base + i * LEVEL_SIZE(level);
+        if (!(*pte & PTE_V)) {
+            continue;
+        }
+        if (!PTE_LEAF(*pte)) {
+            if (vm_fork_table((pagetable_t)PTE_PA(*pte), level - 1, va, dst, skip_start, skip_end) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (va >= skip_start && va < skip_end) {
+            continue;
+        }
+
+        pte_t *child = vm_walk(dst, va, level, 1);
+        if (child == NULL) {
+            return -1;
+        }
+        if (*pte & PTE_OWNED) {
+            if (*pte & PTE_W) {
+                *pte = (*pte & ~PTE_W) | PTE_COW;
+            }
+            page_ref(PTE_PA(*pte));
+        }
+        *child = *pte;
+    }
+    return 0;
+}
+
+/**
+ * vm_fork - Give dst a copy-on-write copy of address space src
+ * Pages src owns become shared and read-only in both, marked PTE_COW if
+ * they were writable; everything else (the shared image, file mappings)
+ * is simply mapped in dst too. Leaves in [skip_start, skip_end) are left
+ * out. Costs O(page table size): no data is copied until a store, see
+ * vm_cow_fault(). The caller flushes src's TLB entries. Returns 0, or -1
+ * if memory ran out (dst is then partly built for vm_destroy()).
+ */
+int vm_fork(pagetable_t src, pagetable_t dst, uint64_t skip_start, uint64_t skip_end) {
+    return vm_fork_table(src, PT_LEVELS - 1, 0, dst, skip_start, skip_end);
+}
+
+/**
+ * vm_cow_fault - Make a copy-on-write page at va writable
+ * While other address spaces share the page, its data is copied to a page
+ * of our own first; the last sharer just takes it over. Only 4KB pages are
+ * ever owned, so only they can be COW. The caller flushes the TLB.
+ * Returns 0, or -1 if va is not a COW page or memory ran out.
+ */
+int vm_cow_fault(pagetable_t pt, uint64_t va) {
+    int level;
+    pte_t *pte = vm_lookup(pt, va, &level);
+    if (pte == NULL || !(*pte & PTE_COW) || level != 0) {
+        return -1;
+    }
+
+    uint64_t pa = PTE_PA(*pte);
+    if (page_shared(pa)) {
+        uint64_t copy = alloc_page_nozero();
+        if (copy == 0) {
+            printf("ERROR: Out of memory for a copy-on-write page\n");
+            return -1;
+        }
+        memcpy((void *)copy, (const void *)pa, PAGE_SIZE);
+        if (page_unref(pa)) {
+            free_page(pa);      // The other sharers went away meanwhile
+        }
+        pa = copy;
+    }
+    *pte = PA_PTE(pa) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+    return 0;
+}
+
+/**
+ * vm_translate - Physical address behind user address va, or 0
+ * The page must be user-accessible and allow perm (PTE_R or PTE_W).
+ */
+static uint64_t vm_translate(pagetable_t pt, uint64_t va, uint64_t perm) {
+    int level;
+    pte_t *pte = vm_lookup(pt, va, &level);
+    if (pte == NULL || (*pte & (PTE_U | perm)) != (PTE_U | perm)) {
+        return 0;
+    }
+    return PTE_PA(*pte) + (va & (LEVEL_SIZE(level) - 1));
+}
+
+/**
+ * vm_copy - Copy len bytes between kernel memory and the calling process
+ * M-mode accesses are not translated, so the user range is walked in
+ * software a page at a time; a copy-on-write page is broken as a store
+ * from the process would. Code with no address space (the scheduler
+ * loop) passes kernel addresses, which are copied directly. Returns 0, or
+ * -1 if some page is not mapped with the access needed.
+ */
+static int vm_copy(uint64_t uaddr, void *kbuf, uint64_t len, int to_user) {
+    pagetable_t pt = current_pagetable();
+    if (pt == NULL) {
+        if (to_user) {
+            memcpy((void *)uaddr, kbuf, len);
+        } else {
+            memcpy(kbuf, (const void *)uaddr, len);
+        }
+        return 0;
+    }
+
+    uint8_t *k = (uint8_t *)kbuf;
+    while (len > 0) {
+        uint64_t pa = vm_translate(pt, uaddr, to_user ? PTE_W : PTE_R);
+        if (pa == 0 && to_user && vm_cow_fault(pt, uaddr) == 0) {
+            vm_flush_current();
+            pa = vm_translate(pt, uaddr, PTE_W);
+        }
+        if (pa == 0) {
+            return -1;
+        }
+        uint64_t chunk = PAGE_SIZE - (uaddr & (PAGE_SIZE - 1));
+        if (chunk > len) {
+            chunk = len;
+        }
+        if (to_user) {
+            memcpy((void *)pa, k, chunk);
+        } else {
+            memcpy(k, (const void *)pa, chunk);
+        }
+        uaddr += chunk;
+        k += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * copyin - Copy len bytes from user address src, returns 0 or -1
+ */
+int copyin(void *dst, uint64_t src, uint64_t len) {
+    return vm_copy(src, dst, len, 0);
+}
+
+/**
+ * copyout - Copy len bytes to user address dst, returns 0 or -1
+ */
+int copyout(uint64_t dst, const void *src, uint64_t len) {
+    return vm_copy(dst, (void *)src, len, 1);
+}
+
+/**
+ * copyinstr - Copy a NUL-terminated string from user address src
+ * Copies at most max bytes. Returns the string's length, max if there was
+ * no NUL within max bytes (dst is then unterminated), or -1 if the memory
+ * is not readable.
+ */
+int copyinstr(char *dst, uint64_t src, uint64_t max) {
+    pagetable_t pt = current_pagetable();
+    uint64_t i = 0;
+    while (i < max) {
+        const char *p = (const char *)src;
+        if (pt != NULL) {
+            p = (const char *)vm_translate(pt, src, PTE_R);
+            if (p == NULL) {
+                return -1;
+            }
+        }
+        uint64_t chunk = PAGE_SIZE - (src & (PAGE_SIZE - 1));
+        for (uint64_t j = 0; j < chunk && i < max; j++, i++) {
+            dst[i] = p[j];
+            if (p[j] == '\0') {
+                return (int)i;
+            }
+        }
+        src += chunk;
+    }
+    return (int)max;
+}
+
+// ============================================================================
+// File System - RAM-Based
+// ============================================================================
+
+// Forward declarations
+void yield(void);
+struct process *current_process(void);
+void sched_preempt(void);
+int sched_tick(void);
+void *kmalloc(size_t size);
+void kfree(void *obj);
+struct Pipe;
+#if CONFIG_FS
+static int pipe_read(struct Pipe *pipe, uint64_t buf, int count);
+static int pipe_write(struct Pipe *pipe, uint64_t buf, int count);
+static void pipe_dup(struct Pipe *pipe, int write_end);
+static void pipe_release(struct Pipe *pipe, int write_end);
+#endif
+
+/**
+ * Extent - A physically contiguous run of file data from the buddy allocator
+ * Packed into 32 bits as page frame number << 4 | order, so a whole inode
+ * fits in one cache line.
+ */
+typedef uint32_t Extent;
+
+#define EXTENT_PAGE_SHIFT 12
+#define EXTENT_MAX_ORDER  10            // Largest buddy block (MAX_ORDER), 4MB
+#define EXTENT(addr, order) ((Extent)(((addr) >> EXTENT_PAGE_SHIFT) << 4 | (order)))
+#define EXTENT_ADDR(e)      ((uint64_t)((e) >> 4) << EXTENT_PAGE_SHIFT)
+#define EXTENT_ORDER(e)     ((e) & 0xF)
+#define EXTENT_BYTES(e)     (1ULL << (EXTENT_PAGE_SHIFT + EXTENT_ORDER(e)))
+#define INODE_EXTENTS       12
+#define EXTENT_GROWTH       3           // log2 of the minimum growth, see fs_grow()
+// Extents a file grown in small steps uses before reaching EXTENT_MAX_ORDER
+#define EXTENT_RAMP         ((EXTENT_MAX_ORDER + EXTENT_GROWTH - 1) / EXTENT_GROWTH)
+
+_Static_assert((uint64_t)(INODE_EXTENTS - EXTENT_RAMP) << (EXTENT_PAGE_SHIFT + EXTENT_MAX_ORDER) >=
+               MAX_FILE_SIZE, "a file grown by small appends must reach MAX_FILE_SIZE (at most 32MB)");
+
+/**
+ * Inode - File metadata
+ * Stores size, the extents holding the data, and the hash of the name. The
+ * names themselves live in inode_names, so scanning inodes stays dense.
+ * Files start with no extents and grow one extent at a time.
+ */
+typedef struct {
+    uint32_t size;              // Current file size (at most MAX_FILE_SIZE)
+    uint32_t hash;              // fs_hash() of the filename
+    uint8_t state;              // INODE_FREE, INODE_LINKED or INODE_ORPHAN
+    uint8_t nextents;           // Extents in use
+    uint16_t opens;             // File descriptors referring to it
+    uint16_t maps;              // Mappings pinning its extents, see fs_mmap()
+    uint16_t reserved;
+    Extent extents[INODE_EXTENTS];
+} Inode;
+
+#define INODE_FREE   0
+#define INODE_LINKED 1          // In the directory
+#define INODE_ORPHAN 2          // Unlinked, freed when the last fd or mapping goes
+
+_Static_assert(sizeof(Inode) == 64, "Inode should fill exactly one cache line");
+
+/**
+ * FileDescriptor - Open file handle
+ * Every process has its own FdTable (Process.files) and an fd is an index
+ * into it. References an inode and tracks position, or one end of a pipe
+ * (see pipe_create()).
+ */
+typedef struct {
+    int inode_idx;              // Index into inode table
+    int flags;                  // O_APPEND, ...
+    uint64_t offset;            // Current read/write position
+    int in_use;                 // Is this fd open?
+    struct Pipe *pipe;          // Pipe end instead of a file, or NULL
+} FileDescriptor;
+
+#define FD_PIPE_WRITE 0x100     // flags: the write end of desc->pipe
+
+/**
+ * FdTable - A process's open files (Process.files)
+ * Empty until the first open, then doubles from FD_TABLE_MIN slots as
+ * needed, up to MAX_OPEN_FILES; see fd_alloc().
+ */
+typedef struct {
+    FileDescriptor *fds;        // From kmalloc(), indexed by fd
+    int size;                   // Slots in fds
+} FdTable;
+
+#define FD_TABLE_MIN 4
+
+/**
+ * Vma - A file mapping in a process
+ * Every process has MAX_MAPPINGS of these (Process.vmas), see fs_mmap().
+ */
+typedef struct {
+    uint64_t start;             // Address returned by fs_mmap(), 0 = unused
+    uint64_t length;
+    int inode_idx;
+    int prot;                   // PROT_READ / PROT_WRITE
+} Vma;
+
+FdTable *current_files(void);
+Vma *current_vmas(void);
+
+#if CONFIG_FS
+
+/**
+ * DirSlot - One slot of the directory index
+ * An open-addressing (linear probing) hash table from filename to inode.
+ * The slot keeps the hash, so probes only touch a name on a full match.
+ */
+typedef struct {
+    uint32_t hash;
+    int32_t inode;              // Index into inode_table, DIR_EMPTY if free
+} DirSlot;
+
+#define DIR_INDEX_SIZE (2 * MAX_INODES)     // Load factor stays <= 1/2
+#define DIR_EMPTY      (-1)
+
+_Static_assert((MAX_INODES & (MAX_INODES - 1)) == 0, "MAX_INODES must be a power of two");
+
+/**
+ * Filesystem state
+ * fs_lock covers the namespace (dir_index, inode_names, free_inodes), each
+ * inode's state, opens and maps, and the writeback bookkeeping. A file's
+ * bytes are covered by its inode_locks entry: reads share it, writes take
+ * it alone, so readers of one file never wait for each other. The fields
+ * that say where the bytes are (size, nextents, extents, the DiskInode
+ * dirty range) change only with both locks held, so either one is enough
+ * to read them. Take the inode lock first, then fs_lock; never sleep
+ * holding an inode lock.
+ *
+ * fs_find_inode() reads dir_index and inode_names with no lock at all:
+ * dir_seq tells it when to retry.
+ */
+static Spinlock fs_lock;
+static Inode inode_table[MAX_INODES];
+static RwLock inode_locks[MAX_INODES];
+static char inode_names[MAX_INODES][MAX_FILENAME];
+static DirSlot dir_index[DIR_INDEX_SIZE];   // Written under fs_lock, inside dir_seq
+static Seqcount dir_seq;
+static uint16_t free_inodes[MAX_INODES] GUARDED_BY(fs_lock);   // Stack of unused inode indices
+static int free_inode_count GUARDED_BY(fs_lock) = 0;
+static WaitQueue fs_readers;        // O_BLOCK readers waiting at end of file
+
+/**
+ * DiskInode - Where an inode's extents live on disk, see fs_sync()
+ * Kept beside inode_table, which has no room left, and saved with it.
+ * Extent i of the file is stored in the same number of blocks, from
+ * blocks[i] on.
+ */
+typedef struct {
+    uint32_t blocks[INODE_EXTENTS]; // First disk block of each extent, 0 until written back
+    uint32_t dirty_start;           // File bytes [dirty_start, dirty_end) are newer
+    uint32_t dirty_end;             // than the disk's copy
+    uint32_t synced_size;           // Size and extents whose data is on disk,
+    uint32_t synced_extents;        // as of the last fs_collect_inode()
+} DiskInode;
+
+_Static_assert(sizeof(DiskInode) == sizeof(Inode) && MAX_FILENAME == sizeof(Inode),
+               "inode_table, inode_names and disk_inodes must line up block for block");
+
+#define INODES_PER_BLOCK (PAGE_SIZE / sizeof(Inode))
+#define INODE_BLOCKS     (MAX_INODES / INODES_PER_BLOCK)    // Per metadata table
+
+_Static_assert(MAX_INODES >= INODES_PER_BLOCK, "MAX_INODES must be at least 64");
+
+static DiskInode disk_inodes[MAX_INODES];
+// Bit b: block b of the tables changed
+static uint64_t meta_dirty[(INODE_BLOCKS + 63) / 64] GUARDED_BY(fs_lock);
+static void disk_free_extents(int inode_idx) REQUIRES(fs_lock);
+static int fs_write_sync(void) EXCLUDES(fs_lock);
+
+/**
+ * fs_dirty_meta - Note that an inode's fields or name changed (fs_lock held)
+ */
+static void fs_dirty_meta(int inode_idx) REQUIRES(fs_lock) {
+    uint64_t block = inode_idx / INODES_PER_BLOCK;
+    meta_dirty[block / 64] |= 1ULL << (block % 64);
+}
+
+/**
+ * fs_dirty_data - Note that file bytes [start, end) changed (fs_lock held)
+ */
+static void fs_dirty_data(int inode_idx, uint64_t start, uint64_t end) REQUIRES(fs_lock) {
+    DiskInode *disk = &disk_inodes[inode_idx];
+    if (disk->dirty_end <= disk->dirty_start) {
+        disk->dirty_start = start;
+        disk->dirty_end = end;
+        return;
+    }
+    if (start < disk->dirty_start) {
+        disk->dirty_start = start;
+    }
+    if (end > disk->dirty_end) {
+        disk->dirty_end = end;
+    }
+}
+
+/**
+ * fs_init - Initialize the file system
+ * Called at boot, before anything can open a file.
+ */
+void fs_init(void) {
+    spin_lock(&fs_lock);
+    seq_write_begin(&dir_seq);
+    for (int i = 0; i < MAX_INODES; i++) {
+        inode_table[i].state = INODE_FREE;
+        inode_table[i].size = 0;
+        inode_table[i].nextents = 0;
+        inode_table[i].opens = 0;
+        inode_table[i].maps = 0;
+        // Hand out low indices first
+        free_inodes[i] = MAX_INODES - 1 - i;
+    }
+    free_inode_count = MAX_INODES;
+    for (int i = 0; i < DIR_INDEX_SIZE; i++) {
+        dir_index[i].inode = DIR_EMPTY;
+    }
+    seq_write_end(&dir_seq);
+    spin_unlock(&fs_lock);
+}
+
+/**
+ * fs_name_len - Length of a filename as stored (truncated to MAX_FILENAME - 1)
+ */
+static int fs_name_len(const char *filename) {
+    int len = 0;
+    while (len < MAX_FILENAME - 1 && filename[len]) {
+        len++;
+    }
+    return len;
+}
+
+/**
+ * fs_hash - FNV-1a hash of the first len bytes of a filename
+ */
+static uint32_t fs_hash(const char *filename, int len) {
+    uint32_t hash = 2166136261U;
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t)filename[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * fs_name_equal - Does inode idx have the name filename[0..len)?
+ */
+static int fs_name_equal(int idx, const char *filename, int len) {
+    const char *name = inode_names[idx];
+    for (int i = 0; i < len; i++) {
+        if (name[i] != filename[i]) {
+            return 0;
+        }
+    }
+    return name[len] == '\0';
+}
+
+/**
+ * dir_insert - Add an inode (whose hash and name are set) to the directory index
+ */
+static void dir_insert(int idx) REQUIRES(fs_lock) {
+    uint32_t hash = inode_table[idx].hash;
+    uint32_t slot = hash & (DIR_INDEX_SIZE - 1);
+    while (dir_index[slot].inode != DIR_EMPTY) {
+        slot = (slot + 1) & (DIR_INDEX_SIZE - 1);
+    }
+    seq_write_begin(&dir_seq);
+    dir_index[slot].hash = hash;
+    dir_index[slot].inode = idx;
+    seq_write_end(&dir_seq);
+}
+
+/**
+ * dir_remove - Drop an inode from the directory index
+ * Uses backward-shift deletion instead of tombstones: every later entry of
+ * the probe run that would no longer be reachable from its home slot is
+ * moved into the hole, so lookups never have to skip deleted slots.
+ */
+static void dir_remove(int idx) REQUIRES(fs_lock) {
+    const uint32_t mask = DIR_INDEX_SIZE - 1;
+    uint32_t hole = inode_table[idx].hash & mask;
+    while (dir_index[hole].inode != idx) {
+        hole = (hole + 1) & mask;
+    }
+
+    seq_write_begin(&dir_seq);
+    uint32_t slot = hole;
+    while (1) {
+        slot = (slot + 1) & mask;
+        if (dir_index[slot].inode == DIR_EMPTY) {
+            break;
+        }
+        // The entry may fill the hole unless its home lies after the hole
+        uint32_t home = dir_index[slot].hash & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            dir_index[hole] = dir_index[slot];
+            hole = slot;
+        }
+    }
+    dir_index[hole].inode = DIR_EMPTY;
+    seq_write_end(&dir_seq);
+}
+
+/**
+ * dir_lookup - Probe the directory index for filename[0..len)
+ * Safe without fs_lock, as fs_find_inode() uses it: every index read is
+ * checked and the probe is bounded, so a concurrent change can only make
+ * the answer wrong, never the walk. Returns inode index or -1.
+ */
+static int dir_lookup(const char *filename, int len, uint32_t hash) {
+    const uint32_t mask = DIR_INDEX_SIZE - 1;
+    uint32_t slot = hash & mask;
+    for (int probes = 0; probes < DIR_INDEX_SIZE; probes++) {
+        int32_t idx = __atomic_load_n(&dir_index[slot].inode, __ATOMIC_RELAXED);
+        if (idx < 0 || idx >= MAX_INODES) {
+            return -1;
+        }
+        if (dir_index[slot].hash == hash && fs_name_equal(idx, filename, len)) {
+            return idx;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+/**
+ * fs_find_inode - Find inode by filename, without taking fs_lock
+ * Retries while the directory changes under it (dir_seq), so concurrent
+ * lookups never wait for each other. The file may be gone by the time
+ * this returns; hold fs_lock and recheck dir_seq to rely on the answer,
+ * as fs_open() does.
+ * Returns inode index or -1 if not found
+ */
+int fs_find_inode(const char *filename) {
+    int len = fs_name_len(filename);
+    uint32_t hash = fs_hash(filename, len);
+    uint32_t seq;
+    int inode_idx;
+    do {
+        seq = seq_read_begin(&dir_seq);
+        inode_idx = dir_lookup(filename, len, hash);
+    } while (seq_read_retry(&dir_seq, seq));
+    return inode_idx;
+}
+
+/**
+ * fs_lookup_or_create - Find a file by name, creating it if missing
+ * Returns the inode index or -1 on error.
+ */
+static int fs_lookup_or_create(const char *filename) REQUIRES(fs_lock) {
+    // Find existing file
+    int len = fs_name_len(filename);
+    int inode_idx = dir_lookup(filename, len, fs_hash(filename, len));
+    if (inode_idx != -1) {
+        return inode_idx;
+    }
+
+    // If not found, create new file
+    if (free_inode_count == 0) {
+        printf("ERROR: Inode table full\n");
+        return -1;
+    }
+
+    // Initialize inode; data extents are allocated by the first write
+    inode_idx = free_inodes[--free_inode_count];
+    Inode *inode = &inode_table[inode_idx];
+    inode->state = INODE_LINKED;
+    inode->size = 0;
+    inode->nextents = 0;
+    inode->opens = 0;
+    inode->maps = 0;
+    fs_dirty_meta(inode_idx);
+
+    // Copy filename (with bounds check)
+    memcpy(inode_names[inode_idx], filename, len);
+    inode_names[inode_idx][len] = '\0';
+    inode->hash = fs_hash(filename, len);
+    dir_insert(inode_idx);
+    return inode_idx;
+}
+
+/**
+ * fs_free_inode - Release an inode and its data extents
+ */
+static void fs_free_inode(int inode_idx) REQUIRES(fs_lock) {
+    Inode *inode = &inode_table[inode_idx];
+    for (int i = 0; i < inode->nextents; i++) {
+        free_pages(EXTENT_ADDR(inode->extents[i]), 1ULL << EXTENT_ORDER(inode->extents[i]));
+    }
+    disk_free_extents(inode_idx);
+    inode->nextents = 0;
+    inode->state = INODE_FREE;
+    inode->size = 0;
+    fs_dirty_meta(inode_idx);
+    free_inodes[free_inode_count++] = inode_idx;
+}
+
+/**
+ * fs_get_fd - The calling process's open file descriptor fd, or NULL
+ */
+static FileDescriptor *fs_get_fd(int fd) {
+    FdTable *files = current_files();
+    if (files == NULL || fd < 0 || fd >= files->size || !files->fds[fd].in_use) {
+        return NULL;
+    }
+    return &files->fds[fd];
+}
+
+/**
+ * fd_alloc - Lowest free fd in files, growing the table if it is full
+ * The slot is not marked in use. Returns -1 if the table is at
+ * MAX_OPEN_FILES or memory ran out.
+ */
+static int fd_alloc(FdTable *files) {
+    for (int fd = 0; fd < files->size; fd++) {
+        if (!files->fds[fd].in_use) {
+            return fd;
+        }
+    }
+    if (files->size == MAX_OPEN_FILES) {
+        printf("ERROR: Too many open files\n");
+        return -1;
+    }
+
+    int size = files->size ? 2 * files->size : FD_TABLE_MIN;
+    FileDescriptor *fds = kmalloc(size * sizeof(FileDescriptor));
+    if (fds == NULL) {
+        return -1;
+    }
+    if (files->size) {
+        memcpy(fds, files->fds, files->size * sizeof(FileDescriptor));
+    }
+    memset(&fds[files->size], 0, (size - files->size) * sizeof(FileDescriptor));
+    kfree(files->fds);
+    int fd = files->size;
+    files->fds = fds;
+    files->size = size;
+    return fd;
+}
+
+/**
+ * fs_get_file - Like fs_get_fd(), for calls that need a file rather than a pipe
+ */
+static FileDescriptor *fs_get_file(int fd) {
+    FileDescriptor *desc = fs_get_fd(fd);
+    return (desc != NULL && desc->pipe == NULL) ? desc : NULL;
+}
+
+/**
+ * fs_open - Open or create a file
+ * flags: O_APPEND makes every write go to the end of the file, O_TRUNC
+ * empties an existing file, O_BLOCK makes fs_read() wait at end of file,
+ * O_SYNC makes every write return only once it is on disk (fs_sync()).
+ * The new descriptor starts at offset 0.
+ * Returns the lowest free file descriptor, or -1 on error
+ */
+int fs_open(const char *filename, int flags) {
+    FdTable *files = current_files();
+    int fd = files ? fd_alloc(files) : -1;
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Look the name up without the lock. If dir_seq hasn't moved by the
+    // time we hold it, the answer still stands; only a miss or a race with
+    // a create or unlink pays for the lookup under fs_lock.
+    uint32_t seq = seq_read_begin(&dir_seq);
+    int inode_idx = fs_find_inode(filename);
+    spin_lock(&fs_lock);
+    if (inode_idx == -1 || seq_read_retry(&dir_seq, seq)) {
+        inode_idx = fs_lookup_or_create(filename);
+    }
+    if (inode_idx == -1) {
+        spin_unlock(&fs_lock);
+        return -1;
+    }
+    Inode *inode = &inode_table[inode_idx];
+    inode->opens++;
+    spin_unlock(&fs_lock);
+
+    if (flags & O_TRUNC) {
+        // Keep the extents: the file will most likely be written again
+        rw_write_lock(&inode_locks[inode_idx]);
+        spin_lock(&fs_lock);
+        inode->size = 0;
+        disk_inodes[inode_idx].synced_size = 0;
+        fs_dirty_meta(inode_idx);
+        spin_unlock(&fs_lock);
+        rw_write_unlock(&inode_locks[inode_idx]);
+    }
+
+    FileDescriptor *desc = &files->fds[fd];
+    desc->inode_idx = inode_idx;
+    desc->flags = flags;
+    desc->offset = 0;
+    desc->in_use = 1;
+    desc->pipe = NULL;
+    return fd;
+}
+
+/**
+ * fs_put_inode - Free an unlinked inode once nothing refers to it (fs_lock held)
+ */
+static void fs_put_inode(int inode_idx) REQUIRES(fs_lock) {
+    Inode *inode = &inode_table[inode_idx];
+    if (inode->state == INODE_ORPHAN && inode->opens == 0 && inode->maps == 0) {
+        fs_free_inode(inode_idx);
+    }
+}
+
+/**
+ * fs_release - Drop an open descriptor's reference to its inode
+ */
+static void fs_release(FileDescriptor *desc) {
+    if (desc->pipe != NULL) {
+        pipe_release(desc->pipe, desc->flags & FD_PIPE_WRITE);
+        desc->in_use = 0;
+        return;
+    }
+    spin_lock(&fs_lock);
+    inode_table[desc->inode_idx].opens--;
+    fs_put_inode(desc->inode_idx);
+    spin_unlock(&fs_lock);
+    desc->in_use = 0;
+}
+
+/**
+ * fs_close - Close a file
+ * Returns 0 on success
+ */
+int fs_close(int fd) {
+    FileDescriptor *desc = fs_get_fd(fd);
+    if (desc == NULL) {
+        return -1;
+    }
+    fs_release(desc);
+    return 0;
+}
+
+/**
+ * fs_close_all - Close every descriptor in a process's table and free it (at exit)
+ */
+void fs_close_all(FdTable *files) {
+    for (int fd = 0; fd < files->size; fd++) {
+        if (files->fds[fd].in_use) {
+            fs_release(&files->fds[fd]);
+        }
+    }
+    kfree(files->fds);
+    files->fds = NULL;
+    files->size = 0;
+}
+
+/**
+ * fs_fork - Give a forked child copies of its parent's descriptors and mappings
+ * Each copied descriptor has its own offset from then on. The mappings'
+ * page table entries are copied by vm_fork(); this only takes the extra
+ * references on the inodes. files must be empty. Returns 0, or -1 if
+ * memory ran out (nothing is copied then).
+ */
+int fs_fork(FdTable *files, const FdTable *from, Vma *vmas, const Vma *vmas_from) {
+    if (from->size) {
+        files->fds = kmalloc(from->size * sizeof(FileDescriptor));
+        if (files->fds == NULL) {
+            return -1;
+        }
+        files->size = from->size;
+    }
+
+    FileDescriptor *fds = files->fds;
+    spin_lock(&fs_lock);
+    for (int fd = 0; fd < files->size; fd++) {
+        fds[fd] = from->fds[fd];
+        if (fds[fd].in_use && fds[fd].pipe != NULL) {
+            pipe_dup(fds[fd].pipe, fds[fd].flags & FD_PIPE_WRITE);
+        } else if (fds[fd].in_use) {
+            inode_table[fds[fd].inode_idx].opens++;
+        }
+    }
+    for (int i = 0; i < MAX_MAPPINGS; i++) {
+        vmas[i] = vmas_from[i];
+        if (vmas[i].start != 0) {
+            inode_table[vmas[i].inode_idx].maps++;
+        }
+    }
+    spin_unlock(&fs_lock);
+    return 0;
+}
+
+/**
+ * fs_capacity - Bytes the inode's extents can hold
+ */
+static uint64_t fs_capacity(const Inode *inode) {
+    uint64_t bytes = 0;
+    for (int i = 0; i < inode->nextents; i++) {
+        bytes += EXTENT_BYTES(inode->extents[i]);
+    }
+    return bytes;
+}
+
+/**
+ * fs_grow - Add extents until the inode can hold end bytes
+ * Each new extent is large enough for the rest of the request and at least
+ * 2^EXTENT_GROWTH times the previous one (up to the largest buddy block), so
+ * a file that grows in small steps still needs only a few extents. Extents are
+ * only zeroed if zero is set: a write fills what it covers itself (see
+ * fs_write_at()), while a mapping exposes whole pages. Returns the new
+ * capacity, which is short of end if memory or extent slots ran out.
+ */
+static uint64_t fs_grow(Inode *inode, uint64_t end, int zero) REQUIRES(fs_lock) {
+    uint64_t capacity = fs_capacity(inode);
+    while (capacity < end && inode->nextents < INODE_EXTENTS) {
+        uint64_t pages = (end - capacity + (1ULL << EXTENT_PAGE_SHIFT) - 1) >> EXTENT_PAGE_SHIFT;
+        uint64_t order = 0;
+        while ((1ULL << order) < pages && order < EXTENT_MAX_ORDER) {
+            order++;
+        }
+        if (inode->nextents > 0) {
+            uint64_t min_order = EXTENT_ORDER(inode->extents[inode->nextents - 1]) + EXTENT_GROWTH;
+            if (min_order > EXTENT_MAX_ORDER) {
+                min_order = EXTENT_MAX_ORDER;
+            }
+            if (order < min_order) {
+                order = min_order;
+            }
+        }
+
+        uint64_t addr = zero ? alloc_pages(1ULL << order) : alloc_pages_nozero(1ULL << order);
+        if (addr == 0) {
+            break;
+        }
+        inode->extents[inode->nextents++] = EXTENT(addr, order);
+        capacity += 1ULL << (EXTENT_PAGE_SHIFT + order);
+        fs_dirty_meta(inode - inode_table);
+    }
+    return capacity;
+}
+
+/**
+ * fs_copy - Copy count bytes between the calling process and a file, starting at offset
+ * One copyin()/copyout() per extent touched; buf is a user address.
+ * to_file selects the direction; a zero buf with to_file zero-fills the
+ * range. The range must lie within the inode's capacity. Returns 0, or -1
+ * if the user buffer is not mapped with the access needed.
+ */
+static int fs_copy(Inode *inode, uint64_t offset, uint64_t buf, uint64_t count, int to_file) {
+    for (int i = 0; i < inode->nextents && count > 0; i++) {
+        uint64_t extent_bytes = EXTENT_BYTES(inode->extents[i]);
+        if (offset >= extent_bytes) {
+            offset -= extent_bytes;
+            continue;
+        }
+
+        uint8_t *data = (uint8_t *)EXTENT_ADDR(inode->extents[i]) + offset;
+        uint64_t chunk = extent_bytes - offset;
+        if (chunk > count) {
+            chunk = count;
+        }
+        if (to_file && buf == 0) {
+            memset(data, 0, chunk);
+        } else if (to_file ? copyin(data, buf, chunk) : copyout(buf, data, chunk)) {
+            return -1;
+        }
+        if (buf) {
+            buf += chunk;
+        }
+        count -= chunk;
+        offset = 0;
+    }
+    return 0;
+}
+
+/**
+ * fs_read_at - Read up to count bytes at offset (inode lock held, shared is enough)
+ * Returns number of bytes read, 0 at or past the end of the file, or -1
+ * if buf is not writable
+ */
+static int fs_read_at(Inode *inode, char *buf, int count, uint64_t offset) {
+    if (offset >= inode->size) {
+        return 0;
+    }
+    uint64_t available = inode->size - offset;
+    int bytes_to_read = ((uint64_t)count < available) ? count : (int)available;
+    if (fs_copy(inode, offset, (uint64_t)buf, bytes_to_read, 0) != 0) {
+        return -1;
+    }
+    return bytes_to_read;
+}
+
+/**
+ * fs_write_at - Write count bytes at offset (inode lock held for writing)
+ * The file grows as needed, up to MAX_FILE_SIZE; a gap between the old end
+ * of the file and offset reads back as zeros. Only the bytes written are
+ * touched, so appending costs O(count). fs_lock is only taken around the
+ * changes to the extents and size, not the copy. Returns number of bytes
+ * written, which is short if memory ran out, or -1 if buf is not readable
+ * (the size is then left alone).
+ */
+static int fs_write_at(Inode *inode, const char *buf, int count, uint64_t offset) {
+    // Respect max file size
+    if (offset >= MAX_FILE_SIZE) {
+        return 0;
+    }
+    if ((uint64_t)count > MAX_FILE_SIZE - offset) {
+        count = (int)(MAX_FILE_SIZE - offset);
+    }
+
+    uint64_t end = offset + count;
+    uint64_t capacity = fs_capacity(inode);
+    if (capacity < end) {
+        spin_lock(&fs_lock);
+        capacity = fs_grow(inode, end, 0);
+        spin_unlock(&fs_lock);
+    }
+    if (capacity < end) {
+        printf("ERROR: No room to grow file to %d bytes\n", end);
+        if (capacity <= offset) {
+            return 0;
+        }
+        count = (int)(capacity - offset);
+        end = capacity;
+    }
+
+    if (fs_copy(inode, offset, (uint64_t)buf, count, 1) != 0) {
+        return -1;
+    }
+    if (offset > inode->size) {
+        fs_copy(inode, inode->size, 0, offset - inode->size, 1);
+    }
+    // The rest of a page the file just grew into may hold someone else's
+    // old data, and writeback and fs_mmap() work in whole pages
+    if (end > align_up(inode->size, PAGE_SIZE) && !is_aligned(end, PAGE_SIZE)) {
+        fs_copy(inode, end, 0, align_up(end, PAGE_SIZE) - end, 1);
+    }
+    // Marked dirty only now, so writeback that cleared the range while we
+    // copied still comes back for these bytes
+    int inode_idx = inode - inode_table;
+    int grew = end > inode->size;
+    spin_lock(&fs_lock);
+    fs_dirty_data(inode_idx, offset < inode->size ? offset : inode->size, end);
+    if (grew) {
+        inode->size = end;
+        fs_dirty_meta(inode_idx);
+    }
+    spin_unlock(&fs_lock);
+    if (grew) {
+        wq_wake_all(&fs_readers);
+    }
+    return count;
+}
+
+/**
+ * fs_read - Read from a file at the descriptor's offset, advancing it
+ * On a pipe's read end this is pipe_read(). Returns number of bytes read
+ */
+int fs_read(int fd, char *buf, int count) {
+    FileDescriptor *desc = fs_get_fd(fd);
+    if (desc == NULL || count < 0) {
+        return -1;
+    }
+    if (desc->pipe != NULL) {
+        return (desc->flags & FD_PIPE_WRITE) ? -1 : pipe_read(desc->pipe, (uint64_t)buf, count);
+    }
+
+    Inode *inode = &inode_table[desc->inode_idx];
+    // With O_BLOCK, wait at end of file until it grows or is unlinked.
+    // Size changes under fs_lock too, so checking under it loses no wakeup.
+    if ((desc->flags & O_BLOCK) && count > 0 &&
+        desc->offset >= __atomic_load_n(&inode->size, __ATOMIC_RELAXED)) {
+        spin_lock(&fs_lock);
+        while (desc->offset >= inode->size && inode->state == INODE_LINKED) {
+            wq_wait(&fs_readers, &fs_lock);
+        }
+        spin_unlock(&fs_lock);
+    }
+    rw_read_lock(&inode_locks[desc->inode_idx]);
+    int bytes = fs_read_at(inode, buf, count, desc->offset);
+    rw_read_unlock(&inode_locks[desc->inode_idx]);
+    if (bytes > 0) {
+        desc->offset += bytes;
+    }
+    return bytes;
+}
+
+/**
+ * fs_write - Write to a file at the descriptor's offset (or the end, with O_APPEND)
+ * On a pipe's write end this is pipe_write(). Returns number of bytes written
+ */
+int fs_write(int fd, const char *buf, int count) {
+    FileDescriptor *desc = fs_get_fd(fd);
+    if (desc == NULL || count < 0) {
+        return -1;
+    }
+    if (desc->pipe != NULL) {
+        return (desc->flags & FD_PIPE_WRITE) ? pipe_write(desc->pipe, (uint64_t)buf, count) : -1;
+    }
+
+    rw_write_lock(&inode_locks[desc->inode_idx]);
+    Inode *inode = &inode_table[desc->inode_idx];
+    uint64_t offset = (desc->flags & O_APPEND) ? inode->size : desc->offset;
+    int bytes = fs_write_at(inode, buf, count, offset);
+    rw_write_unlock(&inode_locks[desc->inode_idx]);
+    if (bytes >= 0) {
+        desc->offset = offset + bytes;
+    }
+    if (bytes > 0 && (desc->flags & O_SYNC) && fs_write_sync() != 0) {
+        return -1;
+    }
+    return bytes;
+}
+
+/**
+ * fs_pread - Read at an explicit offset without moving the descriptor's
+ * Returns number of bytes read
+ */
+int fs_pread(int fd, char *buf, int count, uint64_t offset) {
+    FileDescriptor *desc = fs_get_file(fd);
+    if (desc == NULL || count < 0) {
+        return -1;
+    }
+
+    rw_read_lock(&inode_locks[desc->inode_idx]);
+    int bytes = fs_read_at(&inode_table[desc->inode_idx], buf, count, offset);
+    rw_read_unlock(&inode_locks[desc->inode_idx]);
+    return bytes;
+}
+
+/**
+ * fs_pwrite - Write at an explicit offset without moving the descriptor's
+ * O_APPEND does not apply. Returns number of bytes written
+ */
+int fs_pwrite(int fd, const char *buf, int count, uint64_t offset) {
+    FileDescriptor *desc = fs_get_file(fd);
+    if (desc == NULL || count < 0) {
+        return -1;
+    }
+
+    rw_write_lock(&inode_locks[desc->inode_idx]);
+    int bytes = fs_write_at(&inode_table[desc->inode_idx], buf, count, offset);
+    rw_write_unlock(&inode_locks[desc->inode_idx]);
+    if (bytes > 0 && (desc->flags & O_SYNC) && fs_write_sync() != 0) {
+        return -1;
+    }
+    return bytes;
+}
+
+/**
+ * fs_lseek - Move a descriptor's offset
+ * whence is SEEK_SET, SEEK_CUR or SEEK_END. Seeking past the end is
+ * allowed; a later write there leaves a zero-filled gap.
+ * Returns the new offset, or -1 on error
+ */
+int64_t fs_lseek(int fd, int64_t offset, int whence) {
+    FileDescriptor *desc = fs_get_file(fd);
+    if (desc == NULL) {
+        return -1;
+    }
+
+    int64_t base;
+    switch (whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = (int64_t)desc->offset;
+            break;
+        case SEEK_END:
+            rw_read_lock(&inode_locks[desc->inode_idx]);
+            base = (int64_t)inode_table[desc->inode_idx].size;
+            rw_read_unlock(&inode_locks[desc->inode_idx]);
+            break;
+        default:
+            return -1;
+    }
+
+    if (base + offset < 0) {
+        return -1;
+    }
+    desc->offset = (uint64_t)(base + offset);
+    return (int64_t)desc->offset;
+}
+
+/**
+ * fs_map_extents - Map file bytes [offset, end) at va in pt (inode lock or fs_lock held)
+ * offset and end are page-aligned and within the inode's capacity. Each
+ * extent's piece is mapped on its own, so vm_map() can give the large ones
+ * megapages. Returns 0 or -1.
+ */
+static int fs_map_extents(Inode *inode, pagetable_t pt, uint64_t va, uint64_t offset,
+                          uint64_t end, uint64_t perm) {
+    for (int i = 0; i < inode->nextents && offset < end; i++) {
+        uint64_t extent_bytes = EXTENT_BYTES(inode->extents[i]);
+        if (offset < extent_bytes) {
+            uint64_t chunk = (end < extent_bytes ? end : extent_bytes) - offset;
+            if (vm_map(pt, va, EXTENT_ADDR(inode->extents[i]) + offset, chunk, perm) != 0) {
+                return -1;
+            }
+            va += chunk;
+            offset = extent_bytes;
+        }
+        offset -= extent_bytes;
+        end = end > extent_bytes ? end - extent_bytes : 0;
+    }
+    return 0;
+}
+
+/**
+ * fs_mmap - Map part of an open file into the calling process
+ * flags must include MAP_SHARED: every mapping of a file sees the same
+ * bytes, with no copying, since the process's page table points straight
+ * at the file's extents. prot is PROT_READ, optionally with PROT_WRITE.
+ * offset must be page-aligned. The file's capacity grows to cover the
+ * mapping if needed, but its size does not: the mapping reads zeros past
+ * the end, and stores there are not part of the file (a write that extends
+ * it overwrites or zero-fills them). The mapping pins the extents until
+ * fs_munmap().
+ * Returns the mapped address, or MAP_FAILED.
+ */
+uint64_t fs_mmap(uint64_t length, int prot, int flags, int fd, uint64_t offset) {
+    FileDescriptor *desc = fs_get_file(fd);
+    Vma *vmas = current_vmas();
+    if (desc == NULL || vmas == NULL || length == 0 || !(flags & MAP_SHARED) ||
+        !(prot & PROT_READ) || !is_aligned(offset, PAGE_SIZE) ||
+        offset >= MAX_FILE_SIZE || length > MAX_FILE_SIZE - offset) {
+        return MAP_FAILED;
+    }
+
+    int slot = 0;
+    while (slot < MAX_MAPPINGS && vmas[slot].start != 0) {
+        slot++;
+    }
+    if (slot == MAX_MAPPINGS) {
+        printf("ERROR: Too many mappings\n");
+        return MAP_FAILED;
+    }
+    uint64_t addr = vm_alloc_va(length);
+    if (addr == 0) {
+        return MAP_FAILED;
+    }
+
+    RwLock *lock = &inode_locks[desc->inode_idx];
+    rw_write_lock(lock);
+    spin_lock(&fs_lock);
+    Inode *inode = &inode_table[desc->inode_idx];
+    uint64_t end = align_up(offset + length, PAGE_SIZE);
+    uint64_t old_capacity = fs_capacity(inode);
+    if (fs_grow(inode, end, 1) < end) {
+        spin_unlock(&fs_lock);
+        rw_write_unlock(lock);
+        printf("ERROR: No room to map %d bytes of file\n", end);
+        return MAP_FAILED;
+    }
+    inode->maps++;
+    spin_unlock(&fs_lock);
+
+    // New extents came zeroed; the old ones may hold stale bytes past the
+    // end (from a nozero write extent, O_TRUNC or fs_load())
+    uint64_t stale_end = old_capacity < end ? old_capacity : end;
+    if (inode->size < stale_end) {
+        fs_copy(inode, inode->size, 0, stale_end - inode->size, 1);
+    }
+
+    // The write lock keeps the extents still while they are mapped
+    pagetable_t pt = current_pagetable();
+    uint64_t perm = PTE_U | PTE_R | ((prot & PROT_WRITE) ? PTE_W : 0);
+    if (fs_map_extents(inode, pt, addr, offset, end, perm) != 0) {
+        rw_write_unlock(lock);
+        vm_unmap(pt, addr, end - offset);
+        vm_flush_current();
+        spin_lock(&fs_lock);
+        inode->maps--;
+        spin_unlock(&fs_lock);
+        return MAP_FAILED;
+    }
+    rw_write_unlock(lock);
+    vm_flush_current();
+
+    vmas[slot].start = addr;
+    vmas[slot].length = length;
+    vmas[slot].inode_idx = desc->inode_idx;
+    vmas[slot].prot = prot;
+    return addr;
+}
+
+/**
+ * fs_unmap_vma - Remove a mapping from pt and drop its pin on the inode
+ * pt is NULL when the whole address space is about to go anyway.
+ */
+static void fs_unmap_vma(Vma *vma, pagetable_t pt) {
+    if (pt != NULL) {
+        vm_unmap(pt, vma->start, align_up(vma->length, PAGE_SIZE));
+        vm_flush_current();
+    }
+    spin_lock(&fs_lock);
+    inode_table[vma->inode_idx].maps--;
+    fs_put_inode(vma->inode_idx);
+    spin_unlock(&fs_lock);
+    vma->start = 0;
+}
+
+/**
+ * fs_munmap - Remove a mapping made by fs_mmap()
+ * addr and length must be exactly those of the mapping. Returns 0 on success
+ */
+int fs_munmap(uint64_t addr, uint64_t length) {
+    Vma *vmas = current_vmas();
+    for (int i = 0; vmas != NULL && i < MAX_MAPPINGS; i++) {
+        if (vmas[i].start == addr && addr != 0 && vmas[i].length == length) {
+            fs_unmap_vma(&vmas[i], current_pagetable());
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * fs_unmap_all - Drop every mapping of an exited process
+ * Its page table is freed separately, so only the pins are dropped.
+ */
+void fs_unmap_all(Vma *vmas) {
+    for (int i = 0; i < MAX_MAPPINGS; i++) {
+        if (vmas[i].start != 0) {
+            fs_unmap_vma(&vmas[i], NULL);
+        }
+    }
+}
+
+/**
+ * fs_unlink - Delete a file
+ * The name goes away at once; the data stays reachable through descriptors
+ * and mappings that are still open and is freed when the last one goes.
+ * Returns 0 on success
+ */
+int fs_unlink(const char *filename) {
+    spin_lock(&fs_lock);
+    int len = fs_name_len(filename);
+    int inode_idx = dir_lookup(filename, len, fs_hash(filename, len));
+    if (inode_idx == -1) {
+        spin_unlock(&fs_lock);
+        return -1;
+    }
+
+    dir_remove(inode_idx);
+    inode_table[inode_idx].state = INODE_ORPHAN;
+    fs_dirty_meta(inode_idx);
+    wq_wake_all(&fs_readers);
+    fs_put_inode(inode_idx);
+
+    spin_unlock(&fs_lock);
+    return 0;
+}
+
+/**
+ * fs_list - List all files in the filesystem
+ */
+void fs_list(void) {
+    spin_lock(&fs_lock);
+    printf("\n--- File List ---\n");
+    int count = 0;
+    for (int i = 0; i < MAX_INODES; i++) {
+        if (inode_table[i].state == INODE_LINKED) {
+            printf("[%d] %s (%d bytes)\n", i, inode_names[i], (int)inode_table[i].size);
+            count++;
+        }
+    }
+    if (count == 0) {
+        printf("(no files)\n");
+    }
+    printf("-----------------\n");
+    spin_unlock(&fs_lock);
+}
+
+// ============================================================================
+// Pipes - Single-Producer/Single-Consumer Page Rings
+// ============================================================================
+// A pipe is a ring of PIPE_PAGES pages addressed by two free-running byte
+// counters: the reader only ever stores head and the writer only tail, so
+// moving data takes no lock. A slot's page belongs to the writer while the
+// slot is free and to the reader while it holds data, and the release on
+// each counter hands it over. The lock and the *_waiting flags are only
+// for going to sleep: a side sets its flag before its last look at the
+// other counter, and the other side looks at the flag after publishing,
+// so one of them always sees the other.
+//
+// With PIPE_FLIP, whole pages at page-aligned addresses are not copied at
+// all. The writer's page goes into the ring as is and stays mapped in the
+// writer copy-on-write; the reader's page is replaced by the ring's. Only
+// pages private to the process (PTE_OWNED 4KB leaves) are flipped, anything
+// else is copied.
+
+#define PIPE_PAGES 16
+#define PIPE_SIZE  (PIPE_PAGES * PAGE_SIZE)
+
+/**
+ * Pipe - One pipe, from kmalloc()
+ * Each end is meant for one process at a time; a second process using
+ * the same end concurrently (after fork()) gets -1 rather than waiting.
+ */
+typedef struct Pipe {
+    uint64_t head;              // Bytes read so far, stored by the reader only
+    uint64_t tail;              // Bytes written so far, stored by the writer only
+    int flags;                  // PIPE_FLIP
+    int readers;                // Open read-end descriptors
+    int writers;                // Open write-end descriptors
+    int refs;                   // readers + writers; the last one frees the pipe
+    int reading;                // Read end busy, see pipe_read()
+    int writing;                // Write end busy
+    int reader_waiting;         // Reader is (about to be) asleep on rq
+    int writer_waiting;         // Writer is (about to be) asleep on wq
+    Spinlock lock;              // Orders sleeping against wakeups, nothing else
+    WaitQueue rq;
+    WaitQueue wq;
+    uint64_t pages[PIPE_PAGES];
+} Pipe;
+
+/**
+ * pipe_put_page - Drop the ring's reference to a page
+ */
+static void pipe_put_page(uint64_t page) {
+    if (page != 0 && page_unref(page)) {
+        free_page(page);
+    }
+}
+
+/**
+ * pipe_free - Free a pipe nothing refers to any more
+ */
+static void pipe_free(Pipe *pipe) {
+    for (int i = 0; i < PIPE_PAGES; i++) {
+        pipe_put_page(pipe->pages[i]);
+    }
+    kfree(pipe);
+}
+
+/**
+ * pipe_create - Make a pipe and give the calling process a descriptor for each end
+ * fds[0] gets the read end and fds[1] the write end; fds is a user
+ * address. flags is 0 or PIPE_FLIP. Returns 0, or -1 on error.
+ */
+int pipe_create(uint64_t fds, int flags) {
+    FdTable *files = current_files();
+    if (files == NULL || (flags & ~PIPE_FLIP)) {
+        return -1;
+    }
+    // Hold the first slot while looking for the second
+    int ends[2];
+    ends[0] = fd_alloc(files);
+    if (ends[0] < 0) {
+        return -1;
+    }
+    files->fds[ends[0]].in_use = 1;
+    ends[1] = fd_alloc(files);
+    files->fds[ends[0]].in_use = 0;
+    if (ends[1] < 0 || copyout(fds, ends, sizeof(ends)) != 0) {
+        return -1;
+    }
+
+    Pipe *pipe = kmalloc(sizeof(Pipe));
+    if (pipe == NULL) {
+        printf("ERROR: Out of memory for a pipe\n");
+        return -1;
+    }
+    memset(pipe, 0, sizeof(Pipe));
+    for (int i = 0; i < PIPE_PAGES; i++) {
+        // Only ever read back after the writer fills it, so need not be zeroed
+        pipe->pages[i] = alloc_page_nozero();
+        if (pipe->pages[i] == 0) {
+            printf("ERROR: Out of memory for a pipe\n");
+            pipe_free(pipe);
+            return -1;
+        }
+    }
+    pipe->flags = flags;
+    pipe->readers = 1;
+    pipe->writers = 1;
+    pipe->refs = 2;
+
+    for (int i = 0; i < 2; i++) {
+        FileDescriptor *desc = &files->fds[ends[i]];
+        desc->inode_idx = -1;
+        desc->flags = i ? FD_PIPE_WRITE : 0;
+        desc->offset = 0;
+        desc->pipe = pipe;
+        desc->in_use = 1;
+    }
+    return 0;
+}
+
+/**
+ * pipe_wake - Wake the other side if it said it might be asleep
+ * Called after publishing head or tail. The fence orders that store
+ * before the load of *waiting, pairing with the one in pipe_wait().
+ */
+static void pipe_wake(Pipe *pipe, int *waiting, WaitQueue *queue) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+        spin_lock(&pipe->lock);
+        wq_wake_all(queue);
+        spin_unlock(&pipe->lock);
+    }
+}
+
+/**
+ * pipe_wait - Sleep on queue until ready() or the other end has gone
+ * ready() only reads the other side's counter, so it can't tell whether
+ * the last wakeup was for us; it is simply checked again each time.
+ */
+static void pipe_wait(Pipe *pipe, int *waiting, WaitQueue *queue, int (*ready)(Pipe *pipe),
+                      int *others) {
+    spin_lock(&pipe->lock);
+    __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (!ready(pipe) && __atomic_load_n(others, __ATOMIC_ACQUIRE) > 0) {
+        wq_wait(queue, &pipe->lock);
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    spin_unlock(&pipe->lock);
+}
+
+static int pipe_readable(Pipe *pipe) {
+    return __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) != pipe->head;
+}
+
+static int pipe_writable(Pipe *pipe) {
+    return pipe->tail - __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) < PIPE_SIZE;
+}
+
+/**
+ * pipe_flip_page - The calling process's private 4KB page at va, or NULL
+ * need is the PTE bits the page must have besides PTE_OWNED | PTE_U.
+ */
+static pte_t *pipe_flip_page(uint64_t va, uint64_t need) {
+    pagetable_t pt = current_pagetable();
+    int level;
+    pte_t *pte = pt ? vm_lookup(pt, va, &level) : NULL;
+    uint64_t flags = PTE_OWNED | PTE_U | need;
+    if (pte == NULL || level != 0 || (*pte & flags) != flags) {
+        return NULL;
+    }
+    return pte;
+}
+
+/**
+ * pipe_give_page - Writer side of a flip: put the page at va into slot
+ * The page becomes copy-on-write for the writer, so its next store gets a
+ * copy and the ring's stays as it was. Returns 0, or -1 to copy instead.
+ */
+static int pipe_give_page(Pipe *pipe, int slot, uint64_t va) {
+    pte_t *pte = pipe_flip_page(va, PTE_R);
+    if (pte == NULL) {
+        return -1;
+    }
+    uint64_t page = PTE_PA(*pte);
+    page_ref(page);
+    if (*pte & PTE_W) {
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+    }
+    pipe_put_page(pipe->pages[slot]);
+    pipe->pages[slot] = page;
+    return 0;
+}
+
+/**
+ * pipe_take_page - Reader side of a flip: map slot's page at va
+ * va must be a page the process may write; its old page is dropped and
+ * the slot gets a fresh one. Returns 0, or -1 to copy instead.
+ */
+static int pipe_take_page(Pipe *pipe, int slot, uint64_t va) {
+    pte_t *pte = pipe_flip_page(va, PTE_R);
+    if (pte == NULL || !(*pte & (PTE_W | PTE_COW))) {
+        return -1;
+    }
+    uint64_t fresh = alloc_page_nozero();
+    if (fresh == 0) {
+        return -1;
+    }
+    uint64_t page = pipe->pages[slot];
+    uint64_t old = PTE_PA(*pte);
+    pipe->pages[slot] = fresh;
+    // Still shared if the writer has not stored to its copy since
+    uint64_t perm = PTE_FLAGS(*pte) & ~(PTE_W | PTE_COW);
+    *pte = PA_PTE(page) | perm | (page_shared(page) ? PTE_COW : PTE_W);
+    pipe_put_page(old);
+    return 0;
+}
+
+/**
+ * pipe_slot_page - The page behind slot, private to the ring (writer side)
+ * A page flipped in by the writer may still be mapped copy-on-write in
+ * it, so it is swapped for a fresh one before bytes are copied into it.
+ * Returns 0 if memory ran out.
+ */
+static uint64_t pipe_slot_page(Pipe *pipe, int slot) {
+    if (page_shared(pipe->pages[slot])) {
+        uint64_t fresh = alloc_page_nozero();
+        if (fresh == 0) {
+            return 0;
+        }
+        pipe_put_page(pipe->pages[slot]);
+        pipe->pages[slot] = fresh;
+    }
+    return pipe->pages[slot];
+}
+
+/**
+ * pipe_read - Read up to count bytes from a pipe into user address buf
+ * Waits until there is at least one byte, then returns what is there
+ * without waiting for more. Returns the number of bytes read, 0 once the
+ * pipe is empty and every write end is closed, or -1 on error.
+ */
+static int pipe_read(Pipe *pipe, uint64_t buf, int count) {
+    if (__atomic_exchange_n(&pipe->reading, 1, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    if (count > 0 && !pipe_readable(pipe)) {
+        pipe_wait(pipe, &pipe->reader_waiting, &pipe->rq, pipe_readable, &pipe->writers);
+    }
+
+    int done = 0;
+    int flipped = 0;
+    uint64_t tail = __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE);
+    while (done < count && pipe->head != tail) {
+        uint64_t head = pipe->head;
+        int slot = (head / PAGE_SIZE) % PIPE_PAGES;
+        uint64_t off = head % PAGE_SIZE;
+        uint64_t chunk = PAGE_SIZE - off;
+        if (chunk > tail - head) {
+            chunk = tail - head;
+        }
+        if (chunk > (uint64_t)(count - done)) {
+            chunk = count - done;
+        }
+
+        uint64_t va = buf + done;
+        if ((pipe->flags & PIPE_FLIP) && chunk == PAGE_SIZE && is_aligned(va, PAGE_SIZE) &&
+            pipe_take_page(pipe, slot, va) == 0) {
+            flipped = 1;
+        } else if (copyout(va, (const void *)(pipe->pages[slot] + off), chunk) != 0) {
+            if (done == 0) {
+                done = -1;
+            }
+            break;
+        }
+        done += chunk;
+        __atomic_store_n(&pipe->head, head + chunk, __ATOMIC_RELEASE);
+        pipe_wake(pipe, &pipe->writer_waiting, &pipe->wq);
+    }
+
+    if (flipped) {
+        vm_flush_current();
+    }
+    __atomic_store_n(&pipe->reading, 0, __ATOMIC_RELEASE);
+    return done;
+}
+
+/**
+ * pipe_write - Write count bytes from user address buf into a pipe
+ * Waits for room as often as needed. Returns count, fewer if the reader
+ * went away or memory ran out part way, or -1 if nothing was written.
+ */
+static int pipe_write(Pipe *pipe, uint64_t buf, int count) {
+    if (__atomic_exchange_n(&pipe->writing, 1, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    int done = 0;
+    int flipped = 0;
+    while (done < count) {
+        if (!pipe_writable(pipe)) {
+            pipe_wait(pipe, &pipe->writer_waiting, &pipe->wq, pipe_writable, &pipe->readers);
+        }
+        if (__atomic_load_n(&pipe->readers, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        }
+
+        uint64_t tail = pipe->tail;
+        uint64_t room = PIPE_SIZE - (tail - __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE));
+        int slot = (tail / PAGE_SIZE) % PIPE_PAGES;
+        uint64_t off = tail % PAGE_SIZE;
+        uint64_t chunk = PAGE_SIZE - off;
+        if (chunk > room) {
+            chunk = room;
+        }
+        if (chunk > (uint64_t)(count - done)) {
+            chunk = count - done;
+        }
+
+        uint64_t va = buf + done;
+        if ((pipe->flags & PIPE_FLIP) && chunk == PAGE_SIZE && is_aligned(va, PAGE_SIZE) &&
+            pipe_give_page(pipe, slot, va) == 0) {
+            flipped = 1;
+        } else {
+            uint64_t page = pipe_slot_page(pipe, slot);
+            if (page == 0 || copyin((void *)(page + off), va, chunk) != 0) {
+                break;
+            }
+        }
+        done += chunk;
+        __atomic_store_n(&pipe->tail, tail + chunk, __ATOMIC_RELEASE);
+        pipe_wake(pipe, &pipe->reader_waiting, &pipe->rq);
+    }
+
+    if (flipped) {
+        vm_flush_current();
+    }
+    __atomic_store_n(&pipe->writing, 0, __ATOMIC_RELEASE);
+    return (done == 0 && count > 0) ? -1 : done;
+}
+
+/**
+ * pipe_dup - Count one more descriptor for an end (fork)
+ */
+static void pipe_dup(Pipe *pipe, int write_end) {
+    __atomic_fetch_add(write_end ? &pipe->writers : &pipe->readers, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pipe->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * pipe_release - Drop a descriptor for an end
+ * Closing the last one of an end wakes the other side, which then sees
+ * end of file or a broken pipe. The last descriptor of all frees the pipe.
+ */
+static void pipe_release(Pipe *pipe, int write_end) {
+    if (write_end) {
+        if (__atomic_sub_fetch(&pipe->writers, 1, __ATOMIC_ACQ_REL) == 0) {
+            pipe_wake(pipe, &pipe->reader_waiting, &pipe->rq);
+        }
+    } else if (__atomic_sub_fetch(&pipe->readers, 1, __ATOMIC_ACQ_REL) == 0) {
+        pipe_wake(pipe, &pipe->writer_waiting, &pipe->wq);
+    }
+    if (__atomic_sub_fetch(&pipe->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pipe_free(pipe);
+    }
+}
+
+// ============================================================================
+// Block Device - virtio-blk over MMIO
+// ============================================================================
+// QEMU virt has eight virtio-mmio slots from VIRTIO_MMIO_BASE, one page
+// apart, on PLIC sources 1-8; vblk_init() takes the first block device
+// (virtio 1.0 "modern" register layout, so QEMU needs
+// -global virtio-mmio.force-legacy=false). There is one request queue of
+// VBLK_QUEUE_SIZE descriptors. Each request is a chain of a header, one
+// descriptor per data segment, and a status byte, so a request can move
+// physically scattered memory to or from one run of sectors.
+//
+// vblk_submit() queues a request and returns at once, and vblk_drain()
+// waits for everything queued so far: callers batch as many requests as
+// the queue holds before waiting once. Completions arrive as interrupts,
+// which waiting processes sleep through. With no process to put to sleep
+// (boot), the waiter polls the used ring instead.
+
+#define VIRTIO_MMIO_BASE   0x10001000
+#define VIRTIO_MMIO_SLOTS  8
+#define VIRTIO_MMIO_IRQ(n) (1 + (n))
+
+#define VIRTIO_REG(base, r) ((volatile uint32_t *)((base) + (r)))
+#define VIRTIO_MAGIC        0x000       // "virt"
+#define VIRTIO_VERSION      0x004       // 2 for the modern layout
+#define VIRTIO_DEVICE_ID    0x008       // 2 for a block device
+#define VIRTIO_DEV_FEATURES 0x010
+#define VIRTIO_DEV_FEAT_SEL 0x014
+#define VIRTIO_DRV_FEATURES 0x020
+#define VIRTIO_DRV_FEAT_SEL 0x024
+#define VIRTIO_QUEUE_SEL    0x030
+#define VIRTIO_QUEUE_MAX    0x034
+#define VIRTIO_QUEUE_NUM    0x038
+#define VIRTIO_QUEUE_READY  0x044
+#define VIRTIO_QUEUE_NOTIFY 0x050
+#define VIRTIO_INT_STATUS   0x060
+#define VIRTIO_INT_ACK      0x064
+#define VIRTIO_STATUS       0x070
+#define VIRTIO_QUEUE_DESC   0x080       // Low word, high word at +4
+#define VIRTIO_QUEUE_AVAIL  0x090
+#define VIRTIO_QUEUE_USED   0x0a0
+#define VIRTIO_BLK_CAPACITY 0x100       // Config space: size in sectors (64-bit)
+
+#define VIRTIO_MAGIC_VALUE  0x74726976
+#define VIRTIO_DEV_BLK      2
+
+#define VIRTIO_S_ACK         1
+#define VIRTIO_S_DRIVER      2
+#define VIRTIO_S_DRIVER_OK   4
+#define VIRTIO_S_FEATURES_OK 8
+
+#define VIRTIO_F_VERSION_1   (1ULL << 32)
+#define VIRTIO_BLK_F_FLUSH   (1ULL << 9)
+
+#define VRING_DESC_F_NEXT  1
+#define VRING_DESC_F_WRITE 2            // Device writes this buffer
+
+#define VIRTIO_BLK_T_IN    0
+#define VIRTIO_BLK_T_OUT   1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VBLK_SECTOR_SIZE  512
+#define VBLK_QUEUE_SIZE   64            // Descriptors; a power of two
+#define VBLK_MAX_SEGS     16            // Data segments per request
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VringDesc;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[VBLK_QUEUE_SIZE];
+} VringAvail;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    struct {
+        uint32_t id;
+        uint32_t len;
+    } ring[VBLK_QUEUE_SIZE];
+} VringUsed;
+
+/**
+ * VblkReq - An in-flight request, indexed by its first descriptor
+ */
+typedef struct {
+    uint32_t type;              // virtio_blk_req header, read by the device
+    uint32_t reserved;
+    uint64_t sector;
+    uint8_t status;             // Written by the device, 0 = OK
+    uint8_t busy;
+    uint16_t ndesc;
+} VblkReq;
+
+/**
+ * VblkSeg - One physically contiguous piece of a request's data
+ */
+typedef struct {
+    uint64_t addr;
+    uint32_t len;               // A multiple of VBLK_SECTOR_SIZE
+} VblkSeg;
+
+/**
+ * Block device state
+ * The descriptor table and both rings share one page from alloc_page().
+ */
+static struct {
+    uint64_t base;              // MMIO base, 0 if there is no disk
+    uint32_t irq;
+    int can_flush;              // Device accepted VIRTIO_BLK_F_FLUSH
+    uint64_t sectors;           // Capacity
+    VringDesc *desc;
+    VringAvail *avail;
+    VringUsed *used;
+    uint16_t free_head;         // Free descriptors, chained through next
+    uint16_t nfree;
+    uint16_t used_seen;         // used->idx we have processed up to
+    uint32_t inflight;          // Requests submitted and not yet complete
+    uint32_t errors;            // Failed requests since the last vblk_drain()
+    Spinlock lock;
+    WaitQueue waiters;          // Processes waiting for descriptors or completions
+    VblkReq reqs[VBLK_QUEUE_SIZE];
+} vblk;
+
+_Static_assert(sizeof(VringDesc) * VBLK_QUEUE_SIZE + sizeof(VringAvail) + 64 + sizeof(VringUsed) <= PAGE_SIZE,
+               "virtqueue must fit in one page");
+
+/**
+ * vblk_present - Is there a block device?
+ */
+int vblk_present(void) {
+    return vblk.base != 0;
+}
+
+/**
+ * vblk_irq - The device's PLIC source
+ */
+uint32_t vblk_irq(void) {
+    return vblk.irq;
+}
+
+/**
+ * vblk_init - Find and set up the first virtio-blk device
+ * Returns 0, or -1 if there is none (the file system then stays in RAM).
+ */
+int vblk_init(void) {
+    uint64_t base = 0;
+    int slot;
+    for (slot = 0; slot < VIRTIO_MMIO_SLOTS; slot++) {
+        uint64_t b = VIRTIO_MMIO_BASE + slot * PAGE_SIZE;
+        if (*VIRTIO_REG(b, VIRTIO_MAGIC) == VIRTIO_MAGIC_VALUE &&
+            *VIRTIO_REG(b, VIRTIO_DEVICE_ID) == VIRTIO_DEV_BLK) {
+            base = b;
+            break;
+        }
+    }
+    if (base == 0) {
+        return -1;
+    }
+    if (*VIRTIO_REG(base, VIRTIO_VERSION) != 2) {
+        printf("ERROR: virtio-blk at 0x%x is a legacy device (use virtio-mmio.force-legacy=false)\n", base);
+        return -1;
+    }
+
+    *VIRTIO_REG(base, VIRTIO_STATUS) = 0;
+    *VIRTIO_REG(base, VIRTIO_STATUS) = VIRTIO_S_ACK | VIRTIO_S_DRIVER;
+
+    *VIRTIO_REG(base, VIRTIO_DEV_FEAT_SEL) = 0;
+    uint64_t features = *VIRTIO_REG(base, VIRTIO_DEV_FEATURES);
+    *VIRTIO_REG(base, VIRTIO_DEV_FEAT_SEL) = 1;
+    features |= (uint64_t)*VIRTIO_REG(base, VIRTIO_DEV_FEATURES) << 32;
+    features &= VIRTIO_F_VERSION_1 | VIRTIO_BLK_F_FLUSH;
+    *VIRTIO_REG(base, VIRTIO_DRV_FEAT_SEL) = 0;
+    *VIRTIO_REG(base, VIRTIO_DRV_FEATURES) = (uint32_t)features;
+    *VIRTIO_REG(base, VIRTIO_DRV_FEAT_SEL) = 1;
+    *VIRTIO_REG(base, VIRTIO_DRV_FEATURES) = (uint32_t)(features >> 32);
+    *VIRTIO_REG(base, VIRTIO_STATUS) |= VIRTIO_S_FEATURES_OK;
+    if (!(*VIRTIO_REG(base, VIRTIO_STATUS) & VIRTIO_S_FEATURES_OK)) {
+        printf("ERROR: virtio-blk rejected our features\n");
+        return -1;
+    }
+
+    *VIRTIO_REG(base, VIRTIO_QUEUE_SEL) = 0;
+    if (*VIRTIO_REG(base, VIRTIO_QUEUE_MAX) < VBLK_QUEUE_SIZE) {
+        printf("ERROR: virtio-blk queue holds fewer than %d descriptors\n", VBLK_QUEUE_SIZE);
+        return -1;
+    }
+    uint64_t ring = alloc_page();
+    if (ring == 0) {
+        return -1;
+    }
+    vblk.desc = (VringDesc *)ring;
+    vblk.avail = (VringAvail *)(ring + sizeof(VringDesc) * VBLK_QUEUE_SIZE);
+    vblk.used = (VringUsed *)align_up((uint64_t)(vblk.avail + 1), 64);
+    *VIRTIO_REG(base, VIRTIO_QUEUE_NUM) = VBLK_QUEUE_SIZE;
+    uint64_t addrs[3] = { (uint64_t)vblk.desc, (uint64_t)vblk.avail, (uint64_t)vblk.used };
+    uint32_t regs[3] = { VIRTIO_QUEUE_DESC, VIRTIO_QUEUE_AVAIL, VIRTIO_QUEUE_USED };
+    for (int i = 0; i < 3; i++) {
+        *VIRTIO_REG(base, regs[i]) = (uint32_t)addrs[i];
+        *VIRTIO_REG(base, regs[i] + 4) = (uint32_t)(addrs[i] >> 32);
+    }
+    *VIRTIO_REG(base, VIRTIO_QUEUE_READY) = 1;
+
+    for (int i = 0; i < VBLK_QUEUE_SIZE; i++) {
+        vblk.desc[i].next = (i + 1) % VBLK_QUEUE_SIZE;
+    }
+    vblk.free_head = 0;
+    vblk.nfree = VBLK_QUEUE_SIZE;
+    vblk.can_flush = (features & VIRTIO_BLK_F_FLUSH) != 0;
+    vblk.sectors = *(volatile uint64_t *)(base + VIRTIO_BLK_CAPACITY);
+    vblk.irq = VIRTIO_MMIO_IRQ(slot);
+    vblk.base = base;
+    *VIRTIO_REG(base, VIRTIO_STATUS) |= VIRTIO_S_DRIVER_OK;
+
+    plic_enable(vblk.irq);
+    pr_debug("virtio-blk: %d MB at 0x%x, IRQ %d\n", vblk.sectors * VBLK_SECTOR_SIZE / (1024 * 1024),
+             base, vblk.irq);
+    return 0;
+}
+
+/**
+ * vblk_complete - Retire the requests the device has finished
+ * Called from the interrupt and by pollers. Wakes everyone waiting once
+ * anything completed.
+ */
+static void vblk_complete(void) {
+    spin_lock(&vblk.lock);
+    *VIRTIO_REG(vblk.base, VIRTIO_INT_ACK) = *VIRTIO_REG(vblk.base, VIRTIO_INT_STATUS) & 3;
+    __sync_synchronize();
+    int done = 0;
+    while (vblk.used_seen != __atomic_load_n(&vblk.used->idx, __ATOMIC_ACQUIRE)) {
+        uint16_t head = vblk.used->ring[vblk.used_seen % VBLK_QUEUE_SIZE].id;
+        VblkReq *req = &vblk.reqs[head];
+        if (req->status != 0) {
+            printf("ERROR: virtio-blk request at sector %d failed (status %d)\n", req->sector,
+                   req->status);
+            vblk.errors++;
+        }
+        // Put the chain back on the free list
+        uint16_t tail = head;
+        for (int i = 1; i < req->ndesc; i++) {
+            tail = vblk.desc[tail].next;
+        }
+        vblk.desc[tail].next = vblk.free_head;
+        vblk.free_head = head;
+        vblk.nfree += req->ndesc;
+        req->busy = 0;
+        vblk.inflight--;
+        vblk.used_seen++;
+        done = 1;
+    }
+    if (done) {
+        wq_wake_all(&vblk.waiters);
+    }
+    spin_unlock(&vblk.lock);
+}
+
+/**
+ * vblk_interrupt - PLIC source vblk.irq
+ */
+void vblk_interrupt(void) {
+    vblk_complete();
+}
+
+/**
+ * vblk_wait - Sleep (or, with no process, poll) until the device completes something
+ * Called and returns with vblk.lock held.
+ */
+static void vblk_wait(void) {
+    if (current_process() != NULL) {
+        wq_wait(&vblk.waiters, &vblk.lock);
+    } else {
+        spin_unlock(&vblk.lock);
+        vblk_complete();
+        spin_lock(&vblk.lock);
+    }
+}
+
+/**
+ * vblk_submit - Queue a request for sector and the segments after it
+ * type is VIRTIO_BLK_T_IN (disk to memory), VIRTIO_BLK_T_OUT or
+ * VIRTIO_BLK_T_FLUSH (no segments). Waits only if the queue is full; the
+ * result is known after vblk_drain(). Returns 0 or -1.
+ */
+static int vblk_submit(uint32_t type, uint64_t sector, const VblkSeg *segs, int nsegs) {
+    uint64_t bytes = 0;
+    for (int i = 0; i < nsegs; i++) {
+        bytes += segs[i].len;
+    }
+    if (vblk.base == 0 || nsegs > VBLK_MAX_SEGS ||
+        sector + bytes / VBLK_SECTOR_SIZE > vblk.sectors) {
+        return -1;
+    }
+
+    int ndesc = nsegs + 2;
+    spin_lock(&vblk.lock);
+    while (vblk.nfree < ndesc) {
+        vblk_wait();
+    }
+    uint16_t head = vblk.free_head;
+    VblkReq *req = &vblk.reqs[head];
+    req->type = type;
+    req->reserved = 0;
+    req->sector = sector;
+    req->status = 0xff;
+    req->busy = 1;
+    req->ndesc = ndesc;
+
+    uint16_t d = head;
+    for (int i = 0; i < ndesc; i++) {
+        VringDesc *desc = &vblk.desc[d];
+        if (i == 0) {
+            desc->addr = (uint64_t)req;
+            desc->len = 16;
+            desc->flags = 0;
+        } else if (i == ndesc - 1) {
+            desc->addr = (uint64_t)&req->status;
+            desc->len = 1;
+            desc->flags = VRING_DESC_F_WRITE;
+        } else {
+            desc->addr = segs[i - 1].addr;
+            desc->len = segs[i - 1].len;
+            desc->flags = type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0;
+        }
+        if (i < ndesc - 1) {
+            desc->flags |= VRING_DESC_F_NEXT;
+            d = desc->next;
+        }
+    }
+    vblk.free_head = vblk.desc[d].next;
+    vblk.nfree -= ndesc;
+    vblk.inflight++;
+
+    vblk.avail->ring[vblk.avail->idx % VBLK_QUEUE_SIZE] = head;
+    __sync_synchronize();
+    vblk.avail->idx++;
+    __sync_synchronize();
+    *VIRTIO_REG(vblk.base, VIRTIO_QUEUE_NOTIFY) = 0;
+    spin_unlock(&vblk.lock);
+    return 0;
+}
+
+/**
+ * vblk_drain - Wait for every submitted request to complete
+ * Returns the number that failed since the last drain.
+ */
+static int vblk_drain(void) {
+    spin_lock(&vblk.lock);
+    while (vblk.inflight > 0) {
+        vblk_wait();
+    }
+    int errors = vblk.errors;
+    vblk.errors = 0;
+    spin_unlock(&vblk.lock);
+    return errors;
+}
+
+/**
+ * vblk_flush - Make everything written so far durable, returns 0 or -1
+ */
+static int vblk_flush(void) {
+    if (vblk.can_flush && vblk_submit(VIRTIO_BLK_T_FLUSH, 0, NULL, 0) != 0) {
+        return -1;
+    }
+    return vblk_drain() ? -1 : 0;
+}
+
+// ============================================================================
+// Persistence - File System Snapshot and Writeback
+// ============================================================================
+// With a disk, the RAM-FS is backed by a snapshot on it, in 4KB blocks:
+//
+//   0                 SnapSuper
+//   SNAP_INODES ...   inode_table, inode_names, disk_inodes (INODE_BLOCKS each)
+//   SNAP_BITMAP ...   disk_bitmap, one bit per block
+//   SNAP_JOURNAL ...  metadata journal, JOURNAL_BLOCKS
+//   SNAP_DATA ...     file extents, each stored whole and aligned to its size
+//
+// fs_write() only marks what changed (fs_dirty_data() / fs_dirty_meta()).
+// fs_sync() (SYS_SYNC), run every so often by the writeback process in
+// user.c and after every O_SYNC write, writes the changed file pages
+// first, then commits every table block changed since the last sync as
+// one transaction appended to the journal: the blocks, a flush, then a
+// JournalHeader naming where they belong. All the opens, writes and
+// unlinks since the last sync share that one sequential write, and
+// callers that arrive while a sync runs share the next one.
+//
+// The table blocks behind the journal (SNAP_INODES up to SNAP_JOURNAL)
+// are only written in place at a checkpoint, when the journal is too full
+// for another transaction: then every block journaled since the last one
+// is written home and the superblock records the last sequence number
+// they include, which empties the journal. fs_load() reads the tables,
+// replays the transactions after that number in order, then allocates
+// every file's extents and reads them in one batch.
+//
+// Table blocks are copied under fs_lock, so a transaction is a consistent
+// picture; file pages are written from the live extents, before the
+// transaction that makes them reachable (like ext3's ordered mode). Since
+// writes go on while the pages are written, each inode's copy is cut back
+// to the size and extents fs_collect_inode() saw (meta_clamp_inodes()). A
+// crash leaves the tables as of the last complete transaction; data
+// overwritten in place may be newer than them.
+
+#define SNAP_MAGIC         0x534f5346   // "FSOS"
+#define SNAP_VERSION       2
+#define JOURNAL_MAGIC      0x4a534f46   // "FOSJ"
+#define DISK_BLOCK_SECTORS (PAGE_SIZE / VBLK_SECTOR_SIZE)
+#define DISK_MAX_BLOCKS    (256 * 1024)             // 1GB; more is left unused
+#define DISK_BITMAP_BLOCKS (DISK_MAX_BLOCKS / 8 / PAGE_SIZE)
+// Two full transactions, and at least 2MB so small ones batch up
+#define JOURNAL_BLOCKS     (2 * (1 + META_BLOCKS) > 512 ? 2 * (1 + META_BLOCKS) : 512)
+
+#define SNAP_SUPER   0
+#define SNAP_INODES  1
+#define SNAP_NAMES   (SNAP_INODES + INODE_BLOCKS)
+#define SNAP_DISK    (SNAP_NAMES + INODE_BLOCKS)
+#define SNAP_BITMAP  (SNAP_DISK + INODE_BLOCKS)
+#define SNAP_JOURNAL (SNAP_BITMAP + DISK_BITMAP_BLOCKS)
+#define SNAP_DATA    (SNAP_JOURNAL + JOURNAL_BLOCKS)
+
+#define META_BLOCKS    (SNAP_JOURNAL - SNAP_INODES)     // Table blocks a transaction may hold
+#define WRITEBACK_REQS 32               // Requests per fs_sync() batch
+
+/**
+ * SnapSuper - Block 0 of the disk
+ * The layout fields must match this kernel's, or the disk is reformatted.
+ * Only written at a checkpoint.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_inodes;
+    uint32_t inode_extents;
+    uint32_t nblocks;           // Disk blocks in use by the file system
+    uint32_t data_start;
+    uint32_t journal_blocks;
+    uint32_t fs_id;             // Picked at format; journal entries must match
+    uint64_t checkpoint_seq;    // Last transaction the tables in place include
+} SnapSuper;
+
+/**
+ * JournalHeader - Commit record of one transaction
+ * Written to the journal block before the transaction's count table
+ * blocks, after they are on disk, so a valid header means a complete
+ * transaction. checksum covers everything after it up to targets[count].
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t seq;               // checkpoint_seq + 1, + 2, ... from journal block 0
+    uint32_t fs_id;
+    uint32_t count;
+    uint32_t targets[META_BLOCKS];      // Home block of each logged block
+} JournalHeader;
+
+_Static_assert(sizeof(JournalHeader) <= PAGE_SIZE,
+               "JournalHeader must fit in one block (MAX_INODES at most 16384)");
+
+/**
+ * WbReq - One merged request being built, see wb_add()
+ */
+typedef struct {
+    uint64_t block;
+    uint64_t blocks;
+    int nsegs;
+    VblkSeg segs[VBLK_MAX_SEGS];
+} WbReq;
+
+static uint64_t disk_bitmap[DISK_MAX_BLOCKS / 64] GUARDED_BY(fs_lock);
+static uint32_t bitmap_dirty GUARDED_BY(fs_lock);  // Bit b: block b of disk_bitmap changed
+static uint64_t disk_nblocks;           // 0 until fs_load() finds a usable disk
+
+static uint32_t journal_fs_id;
+static uint64_t journal_seq;            // Last committed transaction
+static uint64_t journal_head;           // Next free journal block
+static uint64_t journal_logged[(SNAP_JOURNAL + 63) / 64];  // Home blocks journaled since the checkpoint
+static int journal_force_checkpoint;    // Freshly formatted: the superblock is not ours yet
+
+static WbReq wb_reqs[WRITEBACK_REQS];   // Owned by whoever has sync_busy (or fs_load())
+static int wb_nreqs;
+static int sync_busy GUARDED_BY(fs_lock);          // An fs_sync() is running
+static uint64_t sync_started GUARDED_BY(fs_lock);  // fs_sync() rounds begun and finished
+static uint64_t sync_done GUARDED_BY(fs_lock);
+static int sync_result GUARDED_BY(fs_lock);        // What the last finished round returned
+static WaitQueue sync_waiters;
+static uint64_t meta_pages[META_BLOCKS];
+static uint32_t meta_blocks[META_BLOCKS];
+
+_Static_assert(DISK_BITMAP_BLOCKS <= 32, "bitmap_dirty has a bit per bitmap block");
+
+static int disk_block_used(uint64_t block) {
+    return (disk_bitmap[block / 64] >> (block % 64)) & 1;
+}
+
+/**
+ * disk_mark - Mark count blocks from block used or free (fs_lock held)
+ */
+static void disk_mark(uint64_t block, uint64_t count, int used) REQUIRES(fs_lock) {
+    for (uint64_t b = block; b < block + count; b++) {
+        if (used) {
+            disk_bitmap[b / 64] |= 1ULL << (b % 64);
+        } else {
+            disk_bitmap[b / 64] &= ~(1ULL << (b % 64));
+        }
+        bitmap_dirty |= 1U << (b / (8 * PAGE_SIZE));
+    }
+}
+
+/**
+ * disk_alloc - Find 2^order free blocks aligned to their size (fs_lock held)
+ * Returns the first block, or 0 if the disk is full.
+ */
+static uint32_t disk_alloc(uint64_t order) REQUIRES(fs_lock) {
+    uint64_t count = 1ULL << order;
+    for (uint64_t block = align_up(SNAP_DATA, count); block + count <= disk_nblocks; block += count) {
+        uint64_t i = 0;
+        while (i < count && !disk_block_used(block + i)) {
+            i++;
+        }
+        if (i == count) {
+            disk_mark(block, count, 1);
+            return (uint32_t)block;
+        }
+    }
+    return 0;
+}
+
+/**
+ * disk_free_extents - Release an inode's disk blocks (fs_lock held)
+ */
+static void disk_free_extents(int inode_idx) REQUIRES(fs_lock) {
+    Inode *inode = &inode_table[inode_idx];
+    DiskInode *disk = &disk_inodes[inode_idx];
+    for (int i = 0; i < inode->nextents; i++) {
+        if (disk->blocks[i] != 0) {
+            disk_mark(disk->blocks[i], 1ULL << EXTENT_ORDER(inode->extents[i]), 0);
+            disk->blocks[i] = 0;
+        }
+    }
+    disk->dirty_start = 0;
+    disk->dirty_end = 0;
+    disk->synced_size = 0;
+    disk->synced_extents = 0;
+}
+
+/**
+ * wb_add - Add blocks [block, block + len / PAGE_SIZE) <-> memory at addr to the batch
+ * Merged into the last request when the blocks follow on, with the
+ * memory as a new segment unless it follows on too. Returns 0, or -1 if
+ * the batch is full.
+ */
+static int wb_add(uint64_t block, uint64_t addr, uint64_t len) {
+    WbReq *last = wb_nreqs ? &wb_reqs[wb_nreqs - 1] : NULL;
+    if (last && last->block + last->blocks == block) {
+        VblkSeg *seg = &last->segs[last->nsegs - 1];
+        if (seg->addr + seg->len == addr) {
+            seg->len += len;
+            last->blocks += len / PAGE_SIZE;
+            return 0;
+        }
+        if (last->nsegs < VBLK_MAX_SEGS) {
+            last->segs[last->nsegs].addr = addr;
+            last->segs[last->nsegs].len = len;
+            last->nsegs++;
+            last->blocks += len / PAGE_SIZE;
+            return 0;
+        }
+    }
+    if (wb_nreqs == WRITEBACK_REQS) {
+        return -1;
+    }
+    WbReq *req = &wb_reqs[wb_nreqs++];
+    req->block = block;
+    req->blocks = len / PAGE_SIZE;
+    req->segs[0].addr = addr;
+    req->segs[0].len = len;
+    req->nsegs = 1;
+    return 0;
+}
+
+/**
+ * wb_run - Submit the batch as type (VIRTIO_BLK_T_IN or _OUT) and wait for it
+ * Returns the number of requests that failed.
+ */
+static int wb_run(uint32_t type) {
+    int errors = 0;
+    for (int i = 0; i < wb_nreqs; i++) {
+        if (vblk_submit(type, wb_reqs[i].block * DISK_BLOCK_SECTORS, wb_reqs[i].segs,
+                        wb_reqs[i].nsegs) != 0) {
+            errors++;
+        }
+    }
+    wb_nreqs = 0;
+    return errors + vblk_drain();
+}
+
+/**
+ * wb_add_run - wb_add(), running the batch first if it is full
+ */
+static int wb_add_run(uint32_t type, uint64_t block, uint64_t addr, uint64_t len) {
+    int errors = 0;
+    if (wb_add(block, addr, len) != 0) {
+        errors = wb_run(type);
+        wb_add(block, addr, len);
+    }
+    return errors;
+}
+
+/**
+ * fs_collect_inode - Add an inode's changed pages to the writeback batch (fs_lock held)
+ * Extents get their disk blocks here, the first time they are written.
+ * A file mapped with fs_mmap() is written whole, since stores through the
+ * mapping are not tracked. Returns the number of pages added.
+ */
+static uint64_t fs_collect_inode(int inode_idx) REQUIRES(fs_lock) {
+    Inode *inode = &inode_table[inode_idx];
+    DiskInode *disk = &disk_inodes[inode_idx];
+    uint64_t start = disk->dirty_start & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t end = disk->dirty_end < inode->size ? disk->dirty_end : inode->size;
+    if (inode->maps > 0) {
+        start = 0;
+        end = inode->size;
+    }
+    end = align_up(end, PAGE_SIZE);
+    disk->dirty_start = 0;
+    disk->dirty_end = 0;
+
+    disk->synced_size = inode->size;
+    disk->synced_extents = inode->nextents;
+
+    uint64_t pages = 0;
+    uint64_t base = 0;          // File offset of extent i
+    for (int i = 0; i < inode->nextents && base < end; i++) {
+        uint64_t extent_bytes = EXTENT_BYTES(inode->extents[i]);
+        if (base + extent_bytes > start) {
+            if (disk->blocks[i] == 0) {
+                disk->blocks[i] = disk_alloc(EXTENT_ORDER(inode->extents[i]));
+                if (disk->blocks[i] == 0) {
+                    printf("ERROR: Disk full, %s is only partly saved\n", inode_names[inode_idx]);
+                    if (disk->synced_size > base) {
+                        disk->synced_size = base;
+                    }
+                    disk->synced_extents = i;
+                    break;
+                }
+                fs_dirty_meta(inode_idx);
+            }
+            uint64_t from = start > base ? start - base : 0;
+            uint64_t to = end - base < extent_bytes ? end - base : extent_bytes;
+            wb_add(disk->blocks[i] + from / PAGE_SIZE, EXTENT_ADDR(inode->extents[i]) + from, to - from);
+            pages += (to - from) / PAGE_SIZE;
+        }
+        base += extent_bytes;
+    }
+    return pages;
+}
+
+/**
+ * meta_block_addr - The table memory a block between SNAP_INODES and SNAP_JOURNAL holds
+ * Returns 0 for any other block.
+ */
+static uint64_t meta_block_addr(uint64_t block) {
+    if (block >= SNAP_INODES && block < SNAP_NAMES) {
+        return (uint64_t)inode_table + (block - SNAP_INODES) * PAGE_SIZE;
+    } else if (block >= SNAP_NAMES && block < SNAP_DISK) {
+        return (uint64_t)inode_names + (block - SNAP_NAMES) * PAGE_SIZE;
+    } else if (block >= SNAP_DISK && block < SNAP_BITMAP) {
+        return (uint64_t)disk_inodes + (block - SNAP_DISK) * PAGE_SIZE;
+    } else if (block >= SNAP_BITMAP && block < SNAP_JOURNAL) {
+        return (uint64_t)disk_bitmap + (block - SNAP_BITMAP) * PAGE_SIZE;
+    }
+    return 0;
+}
+
+/**
+ * meta_block_dirty - Has a table block changed since it was last copied? (fs_lock held)
+ * The three inode tables share one bit per block index.
+ */
+static int meta_block_dirty(uint64_t block) REQUIRES(fs_lock) {
+    if (block >= SNAP_BITMAP) {
+        return (bitmap_dirty >> (block - SNAP_BITMAP)) & 1;
+    }
+    uint64_t b = (block - SNAP_INODES) % INODE_BLOCKS;
+    return (meta_dirty[b / 64] >> (b % 64)) & 1;
+}
+
+static void meta_block_set_dirty(uint64_t block, int dirty) REQUIRES(fs_lock) {
+    if (block >= SNAP_BITMAP) {
+        uint32_t bit = 1U << (block - SNAP_BITMAP);
+        bitmap_dirty = dirty ? bitmap_dirty | bit : bitmap_dirty & ~bit;
+        return;
+    }
+    uint64_t b = (block - SNAP_INODES) % INODE_BLOCKS;
+    if (dirty) {
+        meta_dirty[b / 64] |= 1ULL << (b % 64);
+    } else {
+        meta_dirty[b / 64] &= ~(1ULL << (b % 64));
+    }
+}
+
+/**
+ * meta_clamp_inodes - Cut a copied inode_table block back to data on disk (fs_lock held)
+ * fs_sync() writes file pages with fs_lock dropped, so a write may have
+ * grown a file after fs_collect_inode() saw it. The copy keeps the size
+ * and extents whose data was written, so a crash can never expose blocks
+ * the new size covers that still hold old contents. first is the index of
+ * the block's first inode. Returns 1 if any inode was cut.
+ */
+static int meta_clamp_inodes(Inode *copy, int first) REQUIRES(fs_lock) {
+    int clamped = 0;
+    for (int i = 0; i < (int)INODES_PER_BLOCK; i++) {
+        const DiskInode *disk = &disk_inodes[first + i];
+        if (copy[i].size > disk->synced_size) {
+            copy[i].size = disk->synced_size;
+            clamped = 1;
+        }
+        if (copy[i].nextents > disk->synced_extents) {
+            copy[i].nextents = disk->synced_extents;
+            clamped = 1;
+        }
+    }
+    return clamped;
+}
+
+static int journal_logged_test(uint64_t block) {
+    return (journal_logged[block / 64] >> (block % 64)) & 1;
+}
+
+/**
+ * journal_checksum - fs_hash() of a header from seq up to targets[count]
+ */
+static uint32_t journal_checksum(const JournalHeader *hdr) {
+    const char *start = (const char *)&hdr->seq;
+    return fs_hash(start, (int)((const char *)&hdr->targets[hdr->count] - start));
+}
+
+/**
+ * snap_write_super - Write the superblock for a checkpoint at journal_seq, then flush
+ * Returns the number of failed requests.
+ */
+static int snap_write_super(void) {
+    SnapSuper *super = (SnapSuper *)alloc_page();
+    if (super == NULL) {
+        return 1;
+    }
+    super->magic = SNAP_MAGIC;
+    super->version = SNAP_VERSION;
+    super->max_inodes = MAX_INODES;
+    super->inode_extents = INODE_EXTENTS;
+    super->nblocks = (uint32_t)disk_nblocks;
+    super->data_start = SNAP_DATA;
+    super->journal_blocks = JOURNAL_BLOCKS;
+    super->fs_id = journal_fs_id;
+    super->checkpoint_seq = journal_seq;
+    wb_add(SNAP_SUPER, (uint64_t)super, PAGE_SIZE);
+    int errors = wb_run(VIRTIO_BLK_T_OUT);
+    free_page((uint64_t)super);
+    if (errors == 0 && vblk_flush() != 0) {
+        errors++;
+    }
+    return errors;
+}
+
+/**
+ * journal_commit - Append meta_pages[0 .. n) as transaction journal_seq + 1
+ * The blocks go down and are flushed before the header that makes them
+ * count. Returns the number of failed requests.
+ */
+static int journal_commit(int n) {
+    uint64_t start = SNAP_JOURNAL + journal_head;
+    int errors = 0;
+    for (int i = 0; i < n; i++) {
+        errors += wb_add_run(VIRTIO_BLK_T_OUT, start + 1 + i, meta_pages[i], PAGE_SIZE);
+    }
+    errors += wb_run(VIRTIO_BLK_T_OUT);
+    if (errors == 0 && vblk_flush() != 0) {
+        errors++;
+    }
+    if (errors != 0) {
+        return errors;
+    }
+
+    JournalHeader *hdr = (JournalHeader *)alloc_page();
+    if (hdr == NULL) {
+        return 1;
+    }
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->seq = journal_seq + 1;
+    hdr->fs_id = journal_fs_id;
+    hdr->count = n;
+    for (int i = 0; i < n; i++) {
+        hdr->targets[i] = meta_blocks[i];
+    }
+    hdr->checksum = journal_checksum(hdr);
+    wb_add(start, (uint64_t)hdr, PAGE_SIZE);
+    errors = wb_run(VIRTIO_BLK_T_OUT);
+    free_page((uint64_t)hdr);
+    if (errors == 0 && vblk_flush() != 0) {
+        errors++;
+    }
+    if (errors == 0) {
+        journal_seq++;
+        journal_head += 1 + n;
+        for (int i = 0; i < n; i++) {
+            journal_logged[meta_blocks[i] / 64] |= 1ULL << (meta_blocks[i] % 64);
+        }
+    }
+    return errors;
+}
+
+/**
+ * fs_commit_meta - Commit every changed table block as one transaction
+ * Copies them under fs_lock, then journals the copies. If the journal
+ * would be too full for the next transaction, checkpoints straight after:
+ * writes every block journaled since the last checkpoint home, from the
+ * same copies, and empties the journal. Returns the number of failed
+ * requests; blocks that did not make it into the journal stay dirty.
+ */
+static int fs_commit_meta(void) {
+    int n = 0;                  // Blocks in the transaction, meta_blocks[0 .. n)
+    spin_lock(&fs_lock);
+    for (uint64_t block = SNAP_INODES; block < SNAP_JOURNAL; block++) {
+        if (meta_block_dirty(block)) {
+            meta_blocks[n++] = block;
+        }
+    }
+    int checkpoint = journal_force_checkpoint ||
+                     journal_head + (1 + n) + (1 + META_BLOCKS) > JOURNAL_BLOCKS;
+    if (n == 0 && !checkpoint) {
+        spin_unlock(&fs_lock);
+        return 0;
+    }
+    // A checkpoint also needs the journaled blocks that have not changed since
+    int total = n;
+    for (uint64_t block = SNAP_INODES; checkpoint && block < SNAP_JOURNAL; block++) {
+        if (journal_logged_test(block) && !meta_block_dirty(block)) {
+            meta_blocks[total++] = block;
+        }
+    }
+    for (int i = 0; i < total; i++) {
+        meta_pages[i] = alloc_page_nozero();
+        if (meta_pages[i] == 0) {
+            // Leave everything dirty for next time
+            spin_unlock(&fs_lock);
+            printf("ERROR: Out of memory to sync the file system tables\n");
+            while (i-- > 0) {
+                free_page(meta_pages[i]);
+            }
+            return 1;
+        }
+        memcpy((void *)meta_pages[i], (const void *)meta_block_addr(meta_blocks[i]), PAGE_SIZE);
+    }
+    for (int i = 0; i < n; i++) {
+        meta_block_set_dirty(meta_blocks[i], 0);
+    }
+    // Inodes cut back to their written data are committed again next time
+    for (int i = 0; i < total; i++) {
+        if (meta_blocks[i] < SNAP_NAMES &&
+            meta_clamp_inodes((Inode *)meta_pages[i], (meta_blocks[i] - SNAP_INODES) * INODES_PER_BLOCK)) {
+            meta_block_set_dirty(meta_blocks[i], 1);
+        }
+    }
+    spin_unlock(&fs_lock);
+
+    // Only a checkpoint that failed before can leave the journal too full;
+    // then the blocks go straight home
+    int errors = 0;
+    int committed = n == 0;
+    if (n > 0 && journal_head + 1 + n <= JOURNAL_BLOCKS) {
+        errors = journal_commit(n);
+        committed = errors == 0;
+    }
+    if (checkpoint && errors == 0) {
+        for (int i = 0; i < total; i++) {
+            errors += wb_add_run(VIRTIO_BLK_T_OUT, meta_blocks[i], meta_pages[i], PAGE_SIZE);
+        }
+        errors += wb_run(VIRTIO_BLK_T_OUT);
+        if (errors == 0 && vblk_flush() != 0) {
+            errors++;
+        }
+        if (errors == 0) {
+            errors = snap_write_super();
+        }
+        if (errors == 0) {
+            committed = 1;
+            journal_head = 0;
+            memset(journal_logged, 0, sizeof(journal_logged));
+            journal_force_checkpoint = 0;
+        }
+    }
+    for (int i = 0; i < total; i++) {
+        free_page(meta_pages[i]);
+    }
+    if (!committed) {
+        spin_lock(&fs_lock);
+        for (int i = 0; i < n; i++) {
+            meta_block_set_dirty(meta_blocks[i], 1);
+        }
+        spin_unlock(&fs_lock);
+    }
+    return errors;
+}
+
+/**
+ * fs_sync - Write everything changed so far to disk (SYS_SYNC)
+ * One round runs at a time. A caller that finds one running waits for the
+ * next, which starts after its changes, and shares it with everyone else
+ * who arrived meanwhile. Returns the number of file pages that round
+ * wrote, or -1 if there is no disk or some request failed.
+ */
+int fs_sync(void) {
+    if (disk_nblocks == 0) {
+        return -1;
+    }
+    spin_lock(&fs_lock);
+    uint64_t round = sync_started + 1;
+    while (sync_busy && sync_done < round) {
+        wq_wait(&sync_waiters, &fs_lock);
+    }
+    if (sync_done >= round) {
+        int result = sync_result;
+        spin_unlock(&fs_lock);
+        return result;
+    }
+    sync_busy = 1;
+    sync_started++;
+    spin_unlock(&fs_lock);
+
+    uint64_t pages = 0;
+    int errors = 0;
+    int next = 0;
+    while (next < MAX_INODES) {
+        spin_lock(&fs_lock);
+        // Every inode adds at most one request per extent
+        while (next < MAX_INODES && wb_nreqs + INODE_EXTENTS <= WRITEBACK_REQS) {
+            Inode *inode = &inode_table[next];
+            DiskInode *disk = &disk_inodes[next];
+            if (inode->state == INODE_LINKED && (disk->dirty_end > disk->dirty_start || inode->maps)) {
+                pages += fs_collect_inode(next);
+            }
+            next++;
+        }
+        spin_unlock(&fs_lock);
+        // The device only reads the extents: if a file goes away meanwhile,
+        // the blocks written to are free on disk too
+        errors += wb_run(VIRTIO_BLK_T_OUT);
+    }
+    // File pages reach the disk before the metadata that points at them
+    if (errors == 0 && vblk_flush() != 0) {
+        errors++;
+    }
+    if (errors == 0) {
+        errors = fs_commit_meta();
+    }
+
+    int result = errors ? -1 : (int)pages;
+    spin_lock(&fs_lock);
+    sync_busy = 0;
+    sync_done = sync_started;
+    sync_result = result;
+    wq_wake_all(&sync_waiters);
+    spin_unlock(&fs_lock);
+    return result;
+}
+
+/**
+ * fs_write_sync - Make an O_SYNC write durable
+ * Returns 0, or -1 if the sync failed. Without a disk there is nothing to do.
+ */
+static int fs_write_sync(void) {
+    return (disk_nblocks == 0 || fs_sync() >= 0) ? 0 : -1;
+}
+
+/**
+ * fs_format - Start an empty file system on the disk
+ * Nothing is written until the first fs_sync(), which journals every
+ * table and checkpoints at once, writing the superblock.
+ */
+static void fs_format(void) NO_LOCK_ANALYSIS {
+    memset(disk_inodes, 0, sizeof(disk_inodes));
+    memset(disk_bitmap, 0, sizeof(disk_bitmap));
+    disk_mark(0, SNAP_DATA, 1);
+    bitmap_dirty = (1U << DISK_BITMAP_BLOCKS) - 1;
+    memset(meta_dirty, 0xff, sizeof(meta_dirty));
+    // A new id, so the journal of whatever was here before never replays
+    journal_fs_id = (uint32_t)read_csr(mcycle) ^ (journal_fs_id + 1);
+    journal_seq = 0;
+    journal_head = 0;
+    memset(journal_logged, 0, sizeof(journal_logged));
+    journal_force_checkpoint = 1;
+}
+
+/**
+ * journal_replay - Apply the committed transactions after checkpoint_seq to the tables
+ * Reads them in order from the start of the journal, straight into the
+ * table memory, and stops at the first header that is not the next
+ * transaction. Returns the number replayed, or -1 if a read failed.
+ */
+static int journal_replay(void) {
+    JournalHeader *hdr = (JournalHeader *)alloc_page();
+    if (hdr == NULL) {
+        return -1;
+    }
+    int txns = 0;
+    while (journal_head + 1 < JOURNAL_BLOCKS) {
+        wb_add(SNAP_JOURNAL + journal_head, (uint64_t)hdr, PAGE_SIZE);
+        if (wb_run(VIRTIO_BLK_T_IN) != 0) {
+            txns = -1;
+            break;
+        }
+        if (hdr->magic != JOURNAL_MAGIC || hdr->fs_id != journal_fs_id || hdr->seq != journal_seq + 1 ||
+            hdr->count > META_BLOCKS || journal_head + 1 + hdr->count > JOURNAL_BLOCKS ||
+            hdr->checksum != journal_checksum(hdr)) {
+            break;
+        }
+        uint32_t i = 0;
+        while (i < hdr->count && meta_block_addr(hdr->targets[i]) != 0) {
+            i++;
+        }
+        if (i < hdr->count) {
+            break;
+        }
+        int errors = 0;
+        for (i = 0; i < hdr->count; i++) {
+            errors += wb_add_run(VIRTIO_BLK_T_IN, SNAP_JOURNAL + journal_head + 1 + i,
+                                 meta_block_addr(hdr->targets[i]), PAGE_SIZE);
+            journal_logged[hdr->targets[i] / 64] |= 1ULL << (hdr->targets[i] % 64);
+        }
+        // Later transactions overwrite the same blocks: one at a time
+        errors += wb_run(VIRTIO_BLK_T_IN);
+        if (errors != 0) {
+            txns = -1;
+            break;
+        }
+        journal_seq++;
+        journal_head += 1 + hdr->count;
+        txns++;
+    }
+    free_page((uint64_t)hdr);
+    return txns;
+}
+
+/**
+ * fs_load_inode - Bring one inode of a loaded snapshot back to life
+ * Gives it fresh memory extents and queues the reads of its data. Files
+ * that memory can't hold all of are cut short. Returns 1 if it is a file.
+ */
+static int fs_load_inode(int inode_idx) NO_LOCK_ANALYSIS {
+    Inode *inode = &inode_table[inode_idx];
+    DiskInode *disk = &disk_inodes[inode_idx];
+    disk->dirty_start = 0;
+    disk->dirty_end = 0;
+    disk->synced_size = 0;
+    disk->synced_extents = 0;
+    inode->opens = 0;
+    inode->maps = 0;
+    if (inode->state == INODE_ORPHAN && inode->nextents <= INODE_EXTENTS) {
+        disk_free_extents(inode_idx);
+        fs_dirty_meta(inode_idx);
+    }
+    if (inode->state != INODE_LINKED || inode->nextents > INODE_EXTENTS) {
+        if (inode->state != INODE_FREE) {
+            fs_dirty_meta(inode_idx);
+        }
+        inode->state = INODE_FREE;
+        inode->nextents = 0;
+        inode->size = 0;
+        return 0;
+    }
+
+    uint64_t capacity = 0;
+    for (int i = 0; i < inode->nextents; i++) {
+        uint64_t order = EXTENT_ORDER(inode->extents[i]);
+        uint64_t addr = alloc_pages_nozero(1ULL << order);
+        if (addr == 0) {
+            printf("ERROR: Out of memory loading %s, cut to %d bytes\n", inode_names[inode_idx], capacity);
+            for (int j = i; j < inode->nextents; j++) {
+                if (disk->blocks[j] != 0) {
+                    disk_mark(disk->blocks[j], 1ULL << EXTENT_ORDER(inode->extents[j]), 0);
+                    disk->blocks[j] = 0;
+                }
+            }
+            inode->nextents = i;
+            fs_dirty_meta(inode_idx);
+            break;
+        }
+        inode->extents[i] = EXTENT(addr, order);
+        capacity += EXTENT_BYTES(inode->extents[i]);
+    }
+    if (inode->size > capacity) {
+        inode->size = capacity;
+        fs_dirty_meta(inode_idx);
+    }
+    disk->synced_size = inode->size;
+    disk->synced_extents = inode->nextents;
+
+    uint64_t end = align_up(inode->size, PAGE_SIZE);
+    uint64_t base = 0;
+    for (int i = 0; i < inode->nextents && base < end; i++) {
+        uint64_t extent_bytes = EXTENT_BYTES(inode->extents[i]);
+        uint64_t len = end - base < extent_bytes ? end - base : extent_bytes;
+        if (disk->blocks[i] != 0) {
+            wb_add_run(VIRTIO_BLK_T_IN, disk->blocks[i], EXTENT_ADDR(inode->extents[i]), len);
+        } else {
+            memset((void *)EXTENT_ADDR(inode->extents[i]), 0, len);
+        }
+        base += extent_bytes;
+    }
+
+    inode_names[inode_idx][MAX_FILENAME - 1] = '\0';
+    dir_insert(inode_idx);
+    return 1;
+}
+
+/**
+ * fs_load - Find the disk and load the snapshot on it, or format it
+ * Called once at boot, after fs_init() and before any process exists, so
+ * every wait polls and nothing else can touch the tables.
+ * Returns 0, or -1 if there is no usable disk and files stay RAM-only.
+ */
+int fs_load(void) NO_LOCK_ANALYSIS {
+    if (!vblk_present()) {
+        printf("WARNING: No disk, files are lost at reset\n");
+        return -1;
+    }
+    uint64_t nblocks = vblk.sectors / DISK_BLOCK_SECTORS;
+    if (nblocks > DISK_MAX_BLOCKS) {
+        nblocks = DISK_MAX_BLOCKS;
+    }
+    if (nblocks <= SNAP_DATA) {
+        printf("ERROR: Disk is too small for a file system (%d blocks)\n", nblocks);
+        return -1;
+    }
+
+    SnapSuper *super = (SnapSuper *)alloc_page();
+    if (super == NULL) {
+        return -1;
+    }
+    wb_add(SNAP_SUPER, (uint64_t)super, PAGE_SIZE);
+    int errors = wb_run(VIRTIO_BLK_T_IN);
+    int valid = errors == 0 && super->magic == SNAP_MAGIC && super->version == SNAP_VERSION &&
+                super->max_inodes == MAX_INODES && super->inode_extents == INODE_EXTENTS &&
+                super->data_start == SNAP_DATA && super->nblocks == nblocks &&
+                super->journal_blocks == JOURNAL_BLOCKS;
+    journal_fs_id = super->fs_id;
+    journal_seq = super->checkpoint_seq;
+    free_page((uint64_t)super);
+    disk_nblocks = nblocks;
+    if (!valid) {
+        // Also taken when the layout changed (e.g. another CONFIG_MAX_INODES),
+        // so whatever the disk held is gone
+        printf("WARNING: No file system on the disk, formatting it (%d blocks)\n", nblocks);
+        fs_format();
+        return 0;
+    }
+
+    // The tables are read straight into place, one request each
+    wb_add(SNAP_INODES, (uint64_t)inode_table, sizeof(inode_table));
+    wb_add(SNAP_NAMES, (uint64_t)inode_names, sizeof(inode_names));
+    wb_add(SNAP_DISK, (uint64_t)disk_inodes, sizeof(disk_inodes));
+    wb_add(SNAP_BITMAP, (uint64_t)disk_bitmap, sizeof(disk_bitmap));
+    int txns = wb_run(VIRTIO_BLK_T_IN) == 0 ? journal_replay() : -1;
+    if (txns < 0) {
+        printf("ERROR: Could not read the file system tables, formatting\n");
+        fs_init();
+        fs_format();
+        return 0;
+    }
+
+    uint64_t start = read_csr(mcycle);
+    int files = 0;
+    uint64_t bytes = 0;
+    free_inode_count = 0;
+    // Push in reverse, so low indices are handed out first again
+    for (int i = MAX_INODES - 1; i >= 0; i--) {
+        if (fs_load_inode(i)) {
+            files++;
+            bytes += inode_table[i].size;
+        } else {
+            free_inodes[free_inode_count++] = i;
+        }
+    }
+    errors = wb_run(VIRTIO_BLK_T_IN);
+    pr_debug("File system: loaded %d files (%d KB) from disk in %u cycles, %d journal entries replayed%s\n",
+             files, bytes / 1024, read_csr(mcycle) - start, txns, errors ? ", with read errors" : "");
+    return 0;
+}
+
+#else // !CONFIG_FS
+
+// Built without the file system: no descriptor can be opened, so every
+// file syscall fails and processes have nothing to inherit or close
+void fs_init(void) {}
+int fs_load(void) { return 0; }
+int fs_sync(void) { return -1; }
+int fs_open(const char *filename, int flags) { (void)filename; (void)flags; return -1; }
+int fs_close(int fd) { (void)fd; return -1; }
+int fs_read(int fd, char *buf, int count) { (void)fd; (void)buf; (void)count; return -1; }
+int fs_write(int fd, const char *buf, int count) { (void)fd; (void)buf; (void)count; return -1; }
+int fs_pread(int fd, char *buf, int count, uint64_t offset) {
+    (void)fd; (void)buf; (void)count; (void)offset;
+    return -1;
+}
+int fs_pwrite(int fd, const char *buf, int count, uint64_t offset) {
+    (void)fd; (void)buf; (void)count; (void)offset;
+    return -1;
+}
+int64_t fs_lseek(int fd, int64_t offset, int whence) { (void)fd; (void)offset; (void)whence; return -1; }
+uint64_t fs_mmap(uint64_t length, int prot, int flags, int fd, uint64_t offset) {
+    (void)length; (void)prot; (void)flags; (void)fd; (void)offset;
+    return MAP_FAILED;
+}
+int fs_munmap(uint64_t addr, uint64_t length) { (void)addr; (void)length; return -1; }
+int fs_unlink(const char *filename) { (void)filename; return -1; }
+void fs_list(void) { printf("(no file system in this build)\n"); }
+int pipe_create(uint64_t fds, int flags) { (void)fds; (void)flags; return -1; }
+void fs_close_all(FdTable *files) { (void)files; }
+void fs_unmap_all(Vma *vmas) { (void)vmas; }
+int fs_fork(FdTable *files, const FdTable *from, Vma *vmas, const Vma *vmas_from) {
+    (void)files; (void)from; (void)vmas; (void)vmas_from;
+    return 0;
+}
+int vblk_init(void) { return -1; }
+int vblk_present(void) { return 0; }
+uint32_t vblk_irq(void) { return 0; }
+void vblk_interrupt(void) {}
+
+#endif // CONFIG_FS
+
+// ============================================================================
+// Harts - Per-hart State and Spinlocks
+// ============================================================================
+
+#define MSTATUS_MIE (1ULL << 3)
+
+struct process;
+
+#define RT_PRIO_LEVELS (RT_PRIO_MAX + 1)
+#define RANK_FAIR      RT_PRIO_LEVELS   // Rank of every SCHED_FAIR process
+#define RANK_IDLE      (RT_PRIO_LEVELS + 1) // Rank of an idle hart; also "no limit"
+
+/**
+ * ProcList - Doubly linked FIFO of processes through Process.next/prev
+ */
+typedef struct {
+    struct process *head;
+    struct process *tail;
+} ProcList;
+
+/**
+ * RunQueue - Processes that are ready to run on a hart
+ * One FIFO per real-time priority plus a bitmap of the non-empty ones, so
+ * the most urgent process is found in O(1), and one FIFO for the fair-share
+ * class, which only runs when no real-time process is queued. Other harts
+ * take the lock to steal work.
+ */
+typedef struct {
+    Spinlock lock;
+    uint32_t rt_bitmap;                 // Bit p set while rt[p] is non-empty
+    ProcList rt[RT_PRIO_LEVELS];
+    ProcList fair;
+    uint64_t count;
+} RunQueue;
+
+/**
+ * SchedStats - Dispatch latency of one scheduling class, in mtime ticks
+ * Measured from the moment a process is queued until a hart switches to it.
+ */
+typedef struct {
+    uint64_t dispatches;
+    uint64_t total_ticks;
+    uint64_t max_ticks;
+} SchedStats;
+
+/**
+ * Hart - Per-hart bookkeeping
+ * Each hart keeps a pointer to its own entry in tp, and in mscratch for the
+ * trap entry code, which cannot trust tp when it comes from U-mode. The
+ * trap_* fields are used by boot.S and must stay first, at the offsets
+ * given there. Padded to a cache line so harts never share one.
+ */
+typedef struct {
+    uint64_t trap_ksp;          // Kernel stack top of the process last returned to U-mode
+    uint64_t trap_sp;           // Scratch for boot.S: interrupted sp
+    uint64_t trap_t0;           // Scratch for boot.S: interrupted t0
+    uint64_t id;                // mhartid
+    int noff;                   // Nesting depth of push_off()
+    int intena;                 // Were interrupts enabled before the outermost push_off()?
+    int online;                 // Set once the hart has called hart_init()
+    volatile int cur_rank;      // Rank of current (RANK_IDLE if none), see sched_kick()
+    struct process *current;    // Process running on this hart (NULL in the scheduler loop)
+    struct process *prev;       // Process we just switched away from, see sched_finish_switch()
+    uint64_t idle_sp;           // Saved sp of this hart's scheduler loop
+    uint64_t asid_gen;          // ASID generation of this hart's TLB, see vm_activate()
+    struct process *fp_owner;   // Whose FP registers are loaded here, see fpu_trap()
+    struct process *vec_owner;  // Whose vector registers are loaded here
+    RunQueue rq;                // Processes waiting to run here
+    SchedStats sched_stats[SCHED_NCLASSES];
+} __attribute__((aligned(64))) Hart;
+
+_Static_assert(offsetof(Hart, trap_ksp) == 0 && offsetof(Hart, trap_sp) == 8 &&
+               offsetof(Hart, trap_t0) == 16, "Hart trap_* offsets are hard-coded in boot.S");
+
+static Hart harts[MAX_HARTS];
+
+/**
+ * hart_init - Point tp and mscratch at the calling hart's Hart entry
+ * Must run first on every hart (after clear_bss on the boot hart).
+ * Nothing else in the kernel uses tp; the trap entry code in boot.S
+ * reloads it from mscratch and only puts it back for U-mode.
+ */
+void hart_init(uint64_t hartid) {
+    Hart *h = &harts[hartid];
+    h->id = hartid;
+    h->cur_rank = RANK_IDLE;
+    h->online = 1;
+    write_csr(mscratch, (uint64_t)h);
+    asm volatile("mv tp, %0" : : "r"(h));
+}
+
+/**
+ * this_hart - Per-hart state of the calling hart
+ * A process can migrate between harts whenever it gives up the CPU, so the
+ * result must not be kept across a call to yield().
+ */
+Hart *this_hart(void) {
+    Hart *h;
+    asm volatile("mv %0, tp" : "=r"(h));
+    return h;
+}
+
+/**
+ * hart_id - ID of the calling hart
+ */
+uint64_t hart_id(void) {
+    return this_hart()->id;
+}
+
+/**
+ * push_off / pop_off - Nestable "disable interrupts on this hart"
+ * pop_off() only re-enables interrupts once the outermost push_off() is undone,
+ * and only if they were enabled to begin with.
+ */
+void push_off(void) {
+    uint64_t mstatus = read_csr(mstatus);
+    clr_csr(mstatus, MSTATUS_MIE);
+
+    Hart *h = this_hart();
+    if (h->noff == 0) {
+        h->intena = (mstatus & MSTATUS_MIE) != 0;
+    }
+    h->noff++;
+}
+
+void pop_off(void) {
+    Hart *h = this_hart();
+    if (h->noff < 1) {
+        panic("pop_off without push_off");
+    }
+    h->noff--;
+    if (h->noff == 0 && h->intena) {
+        set_csr(mstatus, MSTATUS_MIE);
+    }
+}
+
+/**
+ * spin_lock / spin_unlock - Test-and-set spinlock (amoswap.w.aq / .rl)
+ * Interrupts stay off on this hart while the lock is held, so an interrupt
+ * handler can never spin on a lock its own hart already holds.
+ */
+void spin_lock(Spinlock *lock) NO_LOCK_ANALYSIS {
+    push_off();
+    while (__sync_lock_test_and_set(&lock->locked, 1) != 0) {
+    }
+    __sync_synchronize();
+}
+
+void spin_unlock(Spinlock *lock) NO_LOCK_ANALYSIS {
+    __sync_synchronize();
+    __sync_lock_release(&lock->locked);
+    pop_off();
+}
+
+#define RW_WRITER  0x80000000U  // RwLock.state: held for writing
+#define RW_PENDING 0x40000000U  // A writer is waiting; keeps new readers out
+
+/**
+ * rw_read_lock - Take an RwLock for reading
+ * Readers only wait for a writer, never for each other. A waiting writer
+ * holds new readers back, so a steady stream of them can't starve it.
+ */
+void rw_read_lock(RwLock *lock) NO_LOCK_ANALYSIS {
+    push_off();
+    while (1) {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if (!(state & (RW_WRITER | RW_PENDING)) &&
+            __atomic_compare_exchange_n(&lock->state, &state, state + 1, 0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+void rw_read_unlock(RwLock *lock) NO_LOCK_ANALYSIS {
+    __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+    pop_off();
+}
+
+/**
+ * rw_write_lock - Take an RwLock for writing, once every reader is out
+ */
+void rw_write_lock(RwLock *lock) NO_LOCK_ANALYSIS {
+    push_off();
+    while (1) {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if ((state & ~RW_PENDING) == 0) {
+            if (__atomic_compare_exchange_n(&lock->state, &state, RW_WRITER, 0, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                return;
+            }
+        } else if (!(state & RW_PENDING)) {
+            __atomic_fetch_or(&lock->state, RW_PENDING, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void rw_write_unlock(RwLock *lock) NO_LOCK_ANALYSIS {
+    // Other writers still waiting set RW_PENDING again on their next look
+    __atomic_store_n(&lock->state, 0, __ATOMIC_RELEASE);
+    pop_off();
+}
+
+/**
+ * seq_read_begin - Start a lock-free read of data guarded by a Seqcount
+ * Waits out a write in progress. The reader must check seq_read_retry()
+ * before trusting what it read, and must cope with torn data until then
+ * (bounded loops, indices range-checked).
+ */
+uint32_t seq_read_begin(const Seqcount *sc) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&sc->seq, __ATOMIC_ACQUIRE)) & 1) {
+    }
+    return seq;
+}
+
+/**
+ * seq_read_retry - Did a writer get in since seq_read_begin() returned start?
+ */
+int seq_read_retry(const Seqcount *sc, uint32_t start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sc->seq, __ATOMIC_RELAXED) != start;
+}
+
+/**
+ * seq_write_begin - Start changing Seqcount-guarded data
+ * Writers must already exclude each other with a lock of their own.
+ */
+void seq_write_begin(Seqcount *sc) {
+    __atomic_store_n(&sc->seq, sc->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void seq_write_end(Seqcount *sc) {
+    __atomic_store_n(&sc->seq, sc->seq + 1, __ATOMIC_RELEASE);
+}
+
+// ============================================================================
+// Device Tree - Flattened Device Tree (FDT) parsing
+// ============================================================================
+// QEMU passes the address of the DTB in a1 when it jumps to _start.
+// We only need a handful of properties, so this is a minimal read-only walker
+// over the structure block rather than a full libfdt.
+
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_NOP        4
+#define FDT_END        9
+#define FDT_MAX_DEPTH  16
+
+static const uint8_t *fdt_base = NULL;
+
+/**
+ * fdt_be32 - Read a big-endian 32-bit value (the DTB is always big-endian)
+ */
+static uint32_t fdt_be32(const void *p) {
+    const uint8_t *b = (const uint8_t *)p;
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+/**
+ * fdt_init - Validate and remember the device tree blob
+ * Returns 0 on success, -1 if there is no valid DTB at dtb_addr
+ */
+int fdt_init(uint64_t dtb_addr) {
+    if (dtb_addr == 0 || fdt_be32((const void *)dtb_addr) != FDT_MAGIC) {
+        fdt_base = NULL;
+        return -1;
+    }
+    fdt_base = (const uint8_t *)dtb_addr;
+    return 0;
+}
+
+/**
+ * fdt_totalsize - Size in bytes of the DTB (0 if none)
+ */
+uint64_t fdt_totalsize(void) {
+    return fdt_base ? fdt_be32(fdt_base + 4) : 0;
+}
+
+/**
+ * fdt_name_match - Match a node name against one path component
+ * "memory" matches both "memory" and "memory@80000000"
+ */
+static int fdt_name_match(const char *name, const char *comp, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] != comp[i]) {
+            return 0;
+        }
+    }
+    return name[len] == '\0' || name[len] == '@';
+}
+
+/**
+ * fdt_getprop - Look up a property by node path, e.g. ("/memory", "reg")
+ * Unit addresses may be left out of the path. Returns a pointer to the raw
+ * (big-endian) property value and stores its length in *lenp, or NULL.
+ */
+const void *fdt_getprop(const char *path, const char *prop, uint32_t *lenp) {
+    if (fdt_base == NULL || path[0] != '/') {
+        return NULL;
+    }
+
+    const uint8_t *p = fdt_base + fdt_be32(fdt_base + 8);              // off_dt_struct
+    const char *strings = (const char *)fdt_base + fdt_be32(fdt_base + 12); // off_dt_strings
+
+    // rest[d] = part of the path still to be matched below depth d
+    const char *rest[FDT_MAX_DEPTH + 1];
+    int depth = 0;      // Depth of the node we are inside (root = 1)
+    int matched = 0;    // Deepest node on the current chain that matches the path
+
+    while (1) {
+        uint32_t token = fdt_be32(p);
+        p += 4;
+
+        if (token == FDT_BEGIN_NODE) {
+            const char *name = (const char *)p;
+            p += align_up(strlen(name) + 1, 4);
+            depth++;
+            if (depth > FDT_MAX_DEPTH) {
+                return NULL;
+            }
+
+            if (depth == 1) {
+                matched = 1;
+                rest[1] = path + 1;
+            } else if (matched == depth - 1 && *rest[matched] != '\0') {
+                // Compare the next path component with this node's name
+                const char *comp = rest[matched];
+                size_t len = 0;
+                while (comp[len] != '\0' && comp[len] != '/') {
+                    len++;
+                }
+                if (fdt_name_match(name, comp, len)) {
+                    matched = depth;
+                    rest[depth] = comp[len] == '/' ? comp + len + 1 : comp + len;
+                }
+            }
+        } else if (token == FDT_END_NODE) {
+            if (matched == depth) {
+                // Leaving the node we were looking for: it doesn't have the property
+                if (*rest[depth] == '\0') {
+                    return NULL;
+                }
+                matched--;
+            }
+            depth--;
+        } else if (token == FDT_PROP) {
+            uint32_t len = fdt_be32(p);
+            uint32_t nameoff = fdt_be32(p + 4);
+            const uint8_t *value = p + 8;
+            p = value + align_up(len, 4);
+
+            if (matched == depth && *rest[depth] == '\0' && strcmp(strings + nameoff, prop) == 0) {
+                if (lenp) {
+                    *lenp = len;
+                }
+                return value;
+            }
+        } else if (token == FDT_NOP) {
+            continue;
+        } else {
+            // FDT_END or a corrupt token
+            return NULL;
+        }
+    }
+}
+
+/**
+ * fdt_read_cells - Read a 1- or 2-cell big-endian number from a property
+ */
+uint64_t fdt_read_cells(const void *p, int cells) {
+    uint64_t value = 0;
+    for (int i = 0; i < cells; i++) {
+        value = (value << 32) | fdt_be32((const uint8_t *)p + 4 * i);
+    }
+    return value;
+}
+
+/**
+ * fdt_memory - Find the first RAM bank described by the /memory node
+ * Returns 0 on success, -1 if the device tree doesn't describe memory
+ */
+int fdt_memory(uint64_t *base, uint64_t *size) {
+    uint32_t len;
+    int addr_cells = 2;
+    int size_cells = 1;
+
+    const void *cells = fdt_getprop("/", "#address-cells", &len);
+    if (cells) {
+        addr_cells = fdt_be32(cells);
+    }
+    cells = fdt_getprop("/", "#size-cells", &len);
+    if (cells) {
+        size_cells = fdt_be32(cells);
+    }
+
+    const uint8_t *reg = fdt_getprop("/memory", "reg", &len);
+    if (reg == NULL || len < (uint32_t)(4 * (addr_cells + size_cells))) {
+        return -1;
+    }
+
+    *base = fdt_read_cells(reg, addr_cells);
+    *size = fdt_read_cells(reg + 4 * addr_cells, size_cells);
+    return 0;
+}
+
+// ============================================================================
+// Memory Management - Page Allocator
+// ============================================================================
+
+#define KERNEL_BASE 0x80000000
+#define RAM_SIZE ((uint64_t)CONFIG_RAM_SIZE_MB * 1024 * 1024)  // Used if the DTB has no /memory node
+
+/**
+ * Free block header - Stored in the first bytes of every free buddy block.
+ * Blocks are doubly linked so a buddy can be unlinked in O(1) when merging.
+ */
+typedef struct page {
+    struct page *next;
+    struct page *prev;
+    uint64_t order;             // Block size is BLOCK_SIZE(order)
+} Page;
+
+/**
+ * Buddy allocator state
+ *
+ * Free memory is kept as power-of-two blocks of 2^order pages, one free list
+ * per order. A block of order k is naturally aligned to BLOCK_SIZE(k), so
+ * its buddy is found by flipping a single address bit.
+ *
+ * Memory is still handed out lazily: everything at or above next_unused (the
+ * "wilderness") has never been touched and is only carved into blocks when
+ * the free lists can't satisfy a request, so pages_init() stays cheap.
+ * page_bitmap has one bit per managed page, set if that page is the head
+ * of a free block sitting on one of the free lists. page_refs counts the
+ * extra sharers of each allocated page, see page_ref().
+ */
+#define MAX_ORDER 10            // Largest block: 2^10 pages = 4MB
+
+static Page *free_area[MAX_ORDER + 1];
+uint64_t free_area_count[MAX_ORDER + 1];  // Free blocks per order
+static uint64_t *page_bitmap = NULL;
+static uint32_t *page_refs = NULL;
+static uint64_t mem_start = 0;      // First page managed by the allocator
+static uint64_t mem_end = 0;        // One past the last managed page
+static uint64_t next_unused = 0;    // Start of the never-used wilderness
+static uint64_t total_pages = 0;
+
+#define BLOCK_SIZE(order) ((uint64_t)PAGE_SIZE << (order))
+#define PAGE_INDEX(addr) (((addr) - mem_start) / PAGE_SIZE)
+#define BITMAP_WORD(idx) page_bitmap[(idx) / 64]
+#define BITMAP_BIT(idx)  (1ULL << ((idx) % 64))
+
+/**
+ * pages_init - Initialize the page allocator
+ * Discovers RAM from the device tree, reserves a page bitmap and the
+ * sharer counts right after the kernel image and sets up the bump pointer.
+ * Nothing else is touched, so this runs in O(RAM / 32K) time (the cost of
+ * zeroing the bitmap); the counts are zeroed as buddy_carve() reaches them.
+ */
+void pages_init(void) {
+    // Calculate the end of the kernel image
+    extern uint8_t __kernel_end;
+    uint64_t kernel_end = (uint64_t)&__kernel_end;
+
+    // Ask the device tree how much RAM we have
+    uint64_t ram_base = KERNEL_BASE;
+    uint64_t ram_size = RAM_SIZE;
+    if (fdt_memory(&ram_base, &ram_size) != 0) {
+        printf("WARNING: No /memory node in device tree, assuming %d MB\n", CONFIG_RAM_SIZE_MB);
+        ram_base = KERNEL_BASE;
+        ram_size = RAM_SIZE;
+    }
+    uint64_t ram_end = ram_base + ram_size;
+
+    // QEMU places the DTB near the top of RAM; keep the allocator below it
+    uint64_t dtb = (uint64_t)fdt_base;
+    if (dtb > kernel_end && dtb < ram_end) {
+        ram_end = dtb;
+    }
+    ram_end &= ~(uint64_t)(PAGE_SIZE - 1);
+
+    // Align kernel_end up to the next page boundary
+    uint64_t free_mem_start = align_up(kernel_end, PAGE_SIZE);
+
+    // Reserve the bitmap (1 bit per page) at the start of free memory
+    uint64_t max_pages = (ram_end - free_mem_start) / PAGE_SIZE;
+    uint64_t bitmap_bytes = align_up(align_up(max_pages, 64) / 8, PAGE_SIZE);
+    page_bitmap = (uint64_t *)free_mem_start;
+    memset(page_bitmap, 0, bitmap_bytes);
+
+    // Then one sharer count per page
+    uint64_t refs_bytes = align_up(max_pages * sizeof(uint32_t), PAGE_SIZE);
+    page_refs = (uint32_t *)(free_mem_start + bitmap_bytes);
+
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        free_area[order] = NULL;
+        free_area_count[order] = 0;
+    }
+
+    mem_start = free_mem_start + bitmap_bytes + refs_bytes;
+    mem_end = ram_end;
+    next_unused = mem_start;
+    total_pages = (mem_end - mem_start) / PAGE_SIZE;
+
+    pr_debug("\n--- Memory Manager Initialized ---\n");
+    pr_debug("Kernel end:    0x%x\n", kernel_end);
+    pr_debug("RAM:           0x%x - 0x%x (%d MB)\n", ram_base, ram_base + ram_size, ram_size / (1024 * 1024));
+    pr_debug("Page bitmap:   0x%x (%d bytes)\n", (uint64_t)page_bitmap, bitmap_bytes);
+    pr_debug("Page refs:     0x%x (%d bytes)\n", (uint64_t)page_refs, refs_bytes);
+    pr_debug("Free mem:      0x%x - 0x%x\n", mem_start, mem_end);
+    pr_debug("Total pages:   %d\n", total_pages);
+}
+
+/**
+ * free_area_push - Put a free block on the list for its order
+ */
+static void free_area_push(Page *block, uint64_t order) {
+    block->order = order;
+    block->prev = NULL;
+    block->next = free_area[order];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    free_area[order] = block;
+    free_area_count[order]++;
+
+    uint64_t idx = PAGE_INDEX((uint64_t)block);
+    BITMAP_WORD(idx) |= BITMAP_BIT(idx);
+}
+
+/**
+ * free_area_remove - Unlink a free block from the list for its order
+ */
+static void free_area_remove(Page *block, uint64_t order) {
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        free_area[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    free_area_count[order]--;
+
+    uint64_t idx = PAGE_INDEX((uint64_t)block);
+    BITMAP_WORD(idx) &= ~BITMAP_BIT(idx);
+}
+
+/**
+ * buddy_carve - Turn the start of the wilderness into a free block
+ * Carves the largest naturally aligned block that fits.
+ * Returns 0 once the wilderness is used up.
+ */
+static int buddy_carve(void) {
+    if (next_unused >= mem_end) {
+        return 0;
+    }
+
+    uint64_t pfn = next_unused / PAGE_SIZE;
+    uint64_t remaining = (mem_end - next_unused) / PAGE_SIZE;
+    uint64_t order = MAX_ORDER;
+    while (order > 0 && ((pfn & ((1ULL << order) - 1)) != 0 || (1ULL << order) > remaining)) {
+        order--;
+    }
+
+    memset(&page_refs[PAGE_INDEX(next_unused)], 0, (1ULL << order) * sizeof(uint32_t));
+    free_area_push((Page *)next_unused, order);
+    next_unused += BLOCK_SIZE(order);
+    return 1;
+}
+
+/**
+ * buddy_alloc - Allocate a block of 2^order contiguous pages
+ * Returns the physical address of the block (not zeroed), or 0 on failure
+ */
+static uint64_t buddy_alloc(uint64_t order) {
+    uint64_t o;
+
+    // Find the smallest non-empty list that can satisfy the request,
+    // pulling in more of the wilderness if nothing fits yet
+    while (1) {
+        for (o = order; o <= MAX_ORDER && free_area[o] == NULL; o++) {
+        }
+        if (o <= MAX_ORDER) {
+            break;
+        }
+        if (!buddy_carve()) {
+            return 0;
+        }
+    }
+
+    Page *block = free_area[o];
+    free_area_remove(block, o);
+
+    // Split off upper halves until the block has the requested size
+    while (o > order) {
+        o--;
+        free_area_push((Page *)((uint64_t)block + BLOCK_SIZE(o)), o);
+    }
+
+    return (uint64_t)block;
+}
+
+/**
+ * buddy_free - Return a block of 2^order pages, merging it with free buddies
+ */
+static void buddy_free(uint64_t addr, uint64_t order) {
+    while (order < MAX_ORDER) {
+        uint64_t size = BLOCK_SIZE(order);
+        uint64_t buddy = addr ^ size;
+
+        // The buddy must be inside carved memory and be a free block of the same order
+        if (buddy < mem_start || buddy + size > next_unused) {
+            break;
+        }
+        uint64_t idx = PAGE_INDEX(buddy);
+        if (!(BITMAP_WORD(idx) & BITMAP_BIT(idx)) || ((Page *)buddy)->order != order) {
+            break;
+        }
+
+        free_area_remove((Page *)buddy, order);
+        addr &= ~size;
+        order++;
+    }
+
+    free_area_push((Page *)addr, order);
+}
+
+/**
+ * pages_to_order - Smallest order whose block holds at least count pages
+ */
+static uint64_t pages_to_order(uint64_t count) {
+    uint64_t order = 0;
+    while ((1ULL << order) < count) {
+        order++;
+    }
+    return order;
+}
+
+/**
+ * Page pools
+ *
+ * Single pages freed by free_page() are parked on the dirty pool instead of
+ * going straight back to the buddy allocator. When the scheduler has nothing
+ * to run, pages_idle_zero() clears dirty pages (or fresh ones from the buddy
+ * allocator) and moves them to the zeroed pool, so alloc_page() can usually
+ * hand out a zero-filled page without clearing 4KB on the caller's time.
+ *
+ * Pooled pages keep their bit set in page_bitmap (so double frees are still
+ * caught) and carry order = PAGE_POOLED, which stops buddy_free() from ever
+ * merging with them.
+ */
+#define PAGE_POOLED       (~0ULL)
+#define ZERO_POOL_TARGET  64    // Pages kept pre-zeroed
+#define DIRTY_POOL_MAX    256   // Beyond this, freed pages go back to the buddy allocator
+#define IDLE_ZERO_BATCH   8     // Pages zeroed per call to pages_idle_zero()
+
+static Page *zeroed_pool = NULL;
+static Page *dirty_pool = NULL;
+static uint64_t zeroed_pool_count = 0;
+static uint64_t dirty_pool_count = 0;
+
+/**
+ * page_pool_push - Park a page on a pool list
+ */
+static void page_pool_push(Page **pool, uint64_t *count, Page *page) {
+    page->next = *pool;
+    page->order = PAGE_POOLED;
+    *pool = page;
+    (*count)++;
+
+    uint64_t idx = PAGE_INDEX((uint64_t)page);
+    BITMAP_WORD(idx) |= BITMAP_BIT(idx);
+}
+
+/**
+ * page_pool_pop - Take a page off a pool list (NULL if empty)
+ */
+static Page *page_pool_pop(Page **pool, uint64_t *count) {
+    Page *page = *pool;
+    if (page == NULL) {
+        return NULL;
+    }
+    *pool = page->next;
+    (*count)--;
+
+    uint64_t idx = PAGE_INDEX((uint64_t)page);
+    BITMAP_WORD(idx) &= ~BITMAP_BIT(idx);
+    return page;
+}
+
+// ----------------------------------------------------------------------------
+// Per-hart page caches
+// ----------------------------------------------------------------------------
+// Everything above (buddy lists, pools, bitmap) is shared between harts and
+// protected by page_lock. On top of it every hart keeps two small magazines
+// of single pages, one zero-filled and one dirty. alloc_page()/free_page()
+// normally only touch the local magazines; the shared state is visited once
+// per MAG_BATCH pages to refill an empty magazine or drain a full one.
+//
+// Pages sitting in a magazine count as allocated in page_bitmap, so a double
+// free of such a page is only noticed once the magazine drains.
+
+#define MAG_SIZE  32    // Pages per magazine
+#define MAG_BATCH 16    // Pages moved per refill or drain
+
+typedef struct {
+    uint64_t count;
+    uint64_t pages[MAG_SIZE];
+} Magazine;
+
+typedef struct {
+    Magazine zeroed;    // Fully zero-filled pages
+    Magazine dirty;     // Pages with stale contents
+} __attribute__((aligned(64))) PageCache;
+
+static PageCache page_cache[MAX_HARTS];
+static Spinlock page_lock;
+
+/**
+ * this_page_cache - The calling hart's magazines
+ * Only valid while interrupts are off (see push_off)
+ */
+static PageCache *this_page_cache(void) {
+    return &page_cache[hart_id()];
+}
+
+/**
+ * page_return_locked - Hand a single page back to the shared allocator
+ * Called with page_lock held.
+ */
+static void page_return_locked(uint64_t addr) {
+    uint64_t idx = PAGE_INDEX(addr);
+    if (BITMAP_WORD(idx) & BITMAP_BIT(idx)) {
+        printf("ERROR: Double free of page 0x%x.\n", addr);
+        return;
+    }
+
+    if (dirty_pool_count < DIRTY_POOL_MAX) {
+        // Keep single pages around for alloc_page(); idle time will zero them
+        page_pool_push(&dirty_pool, &dirty_pool_count, (Page *)addr);
+    } else {
+        buddy_free(addr, 0);
+    }
+}
+
+/**
+ * mag_refill - Move up to MAG_BATCH pages from the shared allocator into a magazine
+ * The zeroed magazine only takes pages from the zeroed pool; the dirty one
+ * takes dirty pages first and then fresh pages from the buddy allocator.
+ * Called with interrupts off.
+ */
+static void mag_refill(Magazine *mag, int zeroed) {
+    spin_lock(&page_lock);
+    while (mag->count < MAG_BATCH) {
+        Page *page;
+        if (zeroed) {
+            page = page_pool_pop(&zeroed_pool, &zeroed_pool_count);
+            if (page != NULL) {
+                // Only the pool header was written since the page was cleared
+                memset(page, 0, sizeof(Page));
+            }
+        } else {
+            page = page_pool_pop(&dirty_pool, &dirty_pool_count);
+            if (page == NULL) {
+                page = (Page *)buddy_alloc(0);
+            }
+        }
+        if (page == NULL) {
+            break;
+        }
+        mag->pages[mag->count++] = (uint64_t)page;
+    }
+    spin_unlock(&page_lock);
+}
+
+/**
+ * mag_drain - Give MAG_BATCH pages from a full magazine back to the shared allocator
+ * Called with interrupts off.
+ */
+static void mag_drain(Magazine *mag) {
+    spin_lock(&page_lock);
+    while (mag->count > MAG_SIZE - MAG_BATCH) {
+        page_return_locked(mag->pages[--mag->count]);
+    }
+    spin_unlock(&page_lock);
+}
+
+/**
+ * pages_idle_zero - Refill the zeroed pages, a small batch at a time
+ * Called by the scheduler when there is nothing else to run. Zeroes this
+ * hart's own dirty pages first, then tops up the shared zeroed pool.
+ * Returns the number of pages zeroed (0 once everything is full).
+ */
+int pages_idle_zero(void) {
+    int zeroed = 0;
+
+    push_off();
+    PageCache *pc = this_page_cache();
+    while (zeroed < IDLE_ZERO_BATCH && pc->dirty.count > 0 && pc->zeroed.count < MAG_SIZE) {
+        uint64_t addr = pc->dirty.pages[--pc->dirty.count];
+        memset((void *)addr, 0, PAGE_SIZE);
+        pc->zeroed.pages[pc->zeroed.count++] = addr;
+        zeroed++;
+    }
+    pop_off();
+
+    while (zeroed < IDLE_ZERO_BATCH) {
+        Page *page = NULL;
+        spin_lock(&page_lock);
+        if (zeroed_pool_count < ZERO_POOL_TARGET) {
+            page = page_pool_pop(&dirty_pool, &dirty_pool_count);
+            if (page == NULL) {
+                page = (Page *)buddy_alloc(0);
+            }
+        }
+        spin_unlock(&page_lock);
+        if (page == NULL) {
+            break;
+        }
+
+        // Clear the page without holding the lock
+        memset(page, 0, PAGE_SIZE);
+
+        spin_lock(&page_lock);
+        page_pool_push(&zeroed_pool, &zeroed_pool_count, page);
+        spin_unlock(&page_lock);
+        zeroed++;
+    }
+
+    return zeroed;
+}
+
+/**
+ * free_page_count - Total number of free pages (free lists, pools, magazines
+ * and wilderness). Not synchronized; only meant for reporting.
+ */
+uint64_t free_page_count(void) {
+    uint64_t count = (mem_end - next_unused) / PAGE_SIZE + zeroed_pool_count + dirty_pool_count;
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        count += free_area_count[order] << order;
+    }
+    for (int hart = 0; hart < MAX_HARTS; hart++) {
+        count += page_cache[hart].zeroed.count + page_cache[hart].dirty.count;
+    }
+    return count;
+}
+
+/**
+ * alloc_pages_nozero - Allocate count physically contiguous pages, contents undefined
+ * For callers that overwrite (or never read) the memory before using it.
+ * The request is rounded up to a power of two. Returns the physical address
+ * of the run, or 0 on failure.
+ */
+uint64_t alloc_pages_nozero(uint64_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    if (count == 1) {
+        return alloc_page_nozero();
+    }
+
+    uint64_t order = pages_to_order(count);
+    if (order > MAX_ORDER) {
+        printf("ERROR: alloc_pages(%d) exceeds the largest block (%d pages).\n", count, 1 << MAX_ORDER);
+        return 0;
+    }
+
+    spin_lock(&page_lock);
+    uint64_t addr = buddy_alloc(order);
+    spin_unlock(&page_lock);
+    if (addr == 0) {
+        printf("ERROR: Out of memory! No free block of %d pages.\n", 1 << order);
+        return 0;
+    }
+    return addr;
+}
+
+/**
+ * alloc_pages - Allocate count physically contiguous pages
+ * The request is rounded up to a power of two. Returns the physical address
+ * of the zero-filled run, or 0 on failure.
+ */
+uint64_t alloc_pages(uint64_t count) {
+    if (count == 1) {
+        return alloc_page();
+    }
+
+    uint64_t addr = alloc_pages_nozero(count);
+    if (addr != 0) {
+        // Zero-fill the block
+        memset((void *)addr, 0, BLOCK_SIZE(pages_to_order(count)));
+    }
+    return addr;
+}
+
+/**
+ * free_pages - Return a run obtained from alloc_pages(count)
+ * count must match the value passed to alloc_pages.
+ */
+void free_pages(uint64_t addr, uint64_t count) {
+    if (addr == 0) {
+        printf("ERROR: Attempted to free NULL page.\n");
+        return;
+    }
+
+    uint64_t order = pages_to_order(count);
+    if (order > MAX_ORDER || addr < mem_start || addr + BLOCK_SIZE(order) > next_unused ||
+        !is_aligned(addr, BLOCK_SIZE(order))) {
+        printf("ERROR: free_pages(0x%x, %d) is not an allocated block.\n", addr, count);
+        return;
+    }
+    KSTAT_ADD(pages_freed, 1ULL << order);
+
+    if (order == 0) {
+        // Single pages go to this hart's dirty magazine
+        push_off();
+        Magazine *mag = &this_page_cache()->dirty;
+        if (mag->count == MAG_SIZE) {
+            mag_drain(mag);
+        }
+        mag->pages[mag->count++] = addr;
+        pop_off();
+        return;
+    }
+
+    spin_lock(&page_lock);
+    uint64_t idx = PAGE_INDEX(addr);
+    if (BITMAP_WORD(idx) & BITMAP_BIT(idx)) {
+        printf("ERROR: Double free of page 0x%x.\n", addr);
+    } else {
+        buddy_free(addr, order);
+    }
+    spin_unlock(&page_lock);
+}
+
+/**
+ * alloc_page_nozero - Allocate a single 4KB page with undefined contents
+ * For callers that overwrite the page anyway (stacks, file data).
+ * Prefers dirty pages so pre-zeroed ones are left for alloc_page().
+ * Returns the physical address of the page, or 0 on failure
+ */
+uint64_t alloc_page_nozero(void) {
+    uint64_t addr = 0;
+
+    push_off();
+    PageCache *pc = this_page_cache();
+    int hit = pc->dirty.count > 0 || pc->zeroed.count > 0;
+    if (pc->dirty.count == 0) {
+        mag_refill(&pc->dirty, 0);
+    }
+    if (pc->dirty.count == 0 && pc->zeroed.count == 0) {
+        mag_refill(&pc->zeroed, 1);
+    }
+    if (pc->dirty.count > 0) {
+        addr = pc->dirty.pages[--pc->dirty.count];
+    } else if (pc->zeroed.count > 0) {
+        addr = pc->zeroed.pages[--pc->zeroed.count];
+    }
+    KSTAT_ADD(page_hits, hit);
+    KSTAT_ADD(page_misses, !hit);
+    pop_off();
+
+    if (addr == 0) {
+        printf("ERROR: Out of memory! No free pages.\n");
+    }
+    return addr;
+}
+
+/**
+ * alloc_page - Allocate a single zero-filled 4KB page
+ * Served from pre-zeroed pages when possible.
+ * Returns the physical address of the allocated page, or 0 on failure
+ */
+uint64_t alloc_page(void) {
+    uint64_t addr = 0;
+
+    push_off();
+    PageCache *pc = this_page_cache();
+    int hit = pc->zeroed.count > 0;
+    if (!hit && zeroed_pool_count > 0) {
+        mag_refill(&pc->zeroed, 1);
+    }
+    if (pc->zeroed.count > 0) {
+        addr = pc->zeroed.pages[--pc->zeroed.count];
+        // Otherwise alloc_page_nozero() below counts it
+        KSTAT_ADD(page_hits, hit);
+        KSTAT_ADD(page_misses, !hit);
+    }
+    pop_off();
+
+    if (addr != 0) {
+        return addr;
+    }
+
+    addr = alloc_page_nozero();
+    if (addr != 0) {
+        memset((void *)addr, 0, PAGE_SIZE);
+    }
+    return addr;
+}
+
+/**
+ * free_page - Return a page to the allocator
+ * Takes the physical address of the page to free
+ */
+void free_page(uint64_t page_addr) {
+    free_pages(page_addr, 1);
+}
+
+/**
+ * page_ref / page_unref - Share a single allocated page between owners
+ * A page starts with one owner and no count to maintain; page_refs only
+ * holds the sharers beyond the first, so it is 0 for every free page and
+ * every unshared one. page_unref() drops the caller's reference and
+ * returns 1 if it was the only one: the caller still owns the page then
+ * and must free (or keep using) it itself.
+ */
+void page_ref(uint64_t addr) {
+    __atomic_fetch_add(&page_refs[PAGE_INDEX(addr)], 1, __ATOMIC_RELAXED);
+}
+
+int page_unref(uint64_t addr) {
+    uint32_t *ref = &page_refs[PAGE_INDEX(addr)];
+    uint32_t old = __atomic_load_n(ref, __ATOMIC_ACQUIRE);
+    while (old != 0) {
+        if (__atomic_compare_exchange_n(ref, &old, old - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * page_shared - Does the page have more than one owner?
+ */
+int page_shared(uint64_t addr) {
+    return __atomic_load_n(&page_refs[PAGE_INDEX(addr)], __ATOMIC_ACQUIRE) != 0;
+}
+
+/**
+ * mem_test - Simple test to verify page allocator is working
+ */
+void mem_test(void) {
+    printf("\n--- Testing Page Allocator ---\n");
+
+    // Allocate a page
+    uint64_t page1 = alloc_page();
+    if (page1 == 0) {
+        printf("FAIL: Could not allocate first page\n");
+        return;
+    }
+    printf("Allocated page 1: 0x%x\n", page1);
+    printf("Free pages now: %d\n", free_page_count());
+
+    // Write a test value
+    uint64_t *test_ptr = (uint64_t *)page1;
+    *test_ptr = 0xDEADBEEF;
+
+    // Allocate another page
+    uint64_t page2 = alloc_page();
+    if (page2 == 0) {
+        printf("FAIL: Could not allocate second page\n");
+        return;
+    }
+    printf("Allocated page 2: 0x%x\n", page2);
+    printf("Free pages now: %d\n", free_page_count());
+
+    // Verify first page still has our value
+    if (*test_ptr == 0xDEADBEEF) {
+        printf("PASS: Page 1 still contains our test value\n");
+    } else {
+        printf("FAIL: Page 1 value was corrupted\n");
+    }
+
+    // Allocate a contiguous run and check it is naturally aligned
+    uint64_t run = alloc_pages(8);
+    if (run == 0 || !is_aligned(run, 8 * PAGE_SIZE)) {
+        printf("FAIL: alloc_pages(8) returned 0x%x\n", run);
+    } else {
+        printf("PASS: alloc_pages(8) returned aligned run at 0x%x\n", run);
+        free_pages(run, 8);
+    }
+
+    // Free the pages
+    free_page(page2);
+    printf("Freed page 2, free pages now: %d\n", free_page_count());
+
+    free_page(page1);
+    printf("Freed page 1, free pages now: %d\n", free_page_count());
+
+    // Everything should have merged back into larger blocks
+    printf("Free blocks per order:");
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        printf(" %d", free_area_count[order]);
+    }
+    printf("\n");
+}
+
+// ============================================================================
+// Memory Management - Slab Allocator
+// ============================================================================
+// Small kernel objects come from caches of equal-sized objects carved out
+// of single pages. A slab page keeps its header in its last bytes, so its
+// objects start at the page base (a power-of-two size is then naturally
+// aligned) and kmem_cache_free() finds the header by rounding the address
+// down. Each cache keeps the slabs that still have a free object on a
+// list, so both alloc and free are O(1). A slab that becomes empty goes
+// back to the page allocator, unless it is the cache's last partial one.
+// kmalloc() serves sizes up to KMALLOC_MAX from power-of-two caches.
+
+/**
+ * Slab - Header at the end of a slab page
+ */
+typedef struct Slab {
+    struct KmemCache *cache;
+    void *free;                 // Free objects, linked through their first word
+    uint32_t inuse;             // Objects handed out
+    struct Slab *next;          // Partial list links, while free != NULL
+    struct Slab *prev;
+} Slab;
+
+/**
+ * KmemCache - A cache of objects of one size, see KMEM_CACHE()
+ * Caches are static; one shows up in kmem_print() once it has grown.
+ */
+typedef struct KmemCache {
+    const char *name;
+    uint32_t size;              // Object size, a multiple of 8
+    uint32_t per_slab;          // Objects per slab page
+    Spinlock lock;
+    Slab *partial;              // Slabs with at least one free object
+    uint64_t slabs;             // Pages held
+    uint64_t active;            // Objects handed out
+    int listed;                 // On kmem_caches yet?
+    struct KmemCache *all_next;
+} KmemCache;
+
+#define SLAB_SPACE     (PAGE_SIZE - sizeof(Slab))
+#define SLAB_OF(obj)   ((Slab *)(((uint64_t)(obj) & ~(uint64_t)(PAGE_SIZE - 1)) + SLAB_SPACE))
+#define KMEM_CACHE(cache_name, objsize) \
+    { .name = (cache_name), .size = align_up(objsize, 8), .per_slab = SLAB_SPACE / align_up(objsize, 8) }
+
+#define KMALLOC_MIN    16
+#define KMALLOC_MAX    1024
+#define KMALLOC_CACHES 7                // KMALLOC_MIN << 0 ... KMALLOC_MAX
+
+static KmemCache kmalloc_caches[KMALLOC_CACHES] = {
+    KMEM_CACHE("kmalloc-16", 16),   KMEM_CACHE("kmalloc-32", 32),
+    KMEM_CACHE("kmalloc-64", 64),   KMEM_CACHE("kmalloc-128", 128),
+    KMEM_CACHE("kmalloc-256", 256), KMEM_CACHE("kmalloc-512", 512),
+    KMEM_CACHE("kmalloc-1024", 1024),
+};
+
+_Static_assert((KMALLOC_MIN << (KMALLOC_CACHES - 1)) == KMALLOC_MAX, "kmalloc_caches sizes");
+_Static_assert(KMALLOC_MAX <= SLAB_SPACE, "KMALLOC_MAX objects must fit in a slab");
+_Static_assert(MAX_OPEN_FILES * sizeof(FileDescriptor) <= KMALLOC_MAX, "fd tables come from kmalloc()");
+
+static KmemCache *kmem_caches;          // Every cache that has had a slab
+static Spinlock kmem_caches_lock;
+
+/**
+ * slab_link / slab_unlink - Put a slab on / take it off its cache's partial list
+ */
+static void slab_link(KmemCache *cache, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial) {
+        cache->partial->prev = slab;
+    }
+    cache->partial = slab;
+}
+
+static void slab_unlink(KmemCache *cache, Slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        cache->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * slab_create - Carve a fresh page into free objects of cache's size
+ */
+static Slab *slab_create(KmemCache *cache) {
+    uint64_t page = alloc_page_nozero();
+    if (page == 0) {
+        return NULL;
+    }
+    Slab *slab = SLAB_OF(page);
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = NULL;
+    for (uint64_t i = cache->per_slab; i-- > 0;) {
+        void **obj = (void **)(page + i * cache->size);
+        *obj = slab->free;
+        slab->free = obj;
+    }
+    return slab;
+}
+
+/**
+ * kmem_cache_alloc - Take an object from cache, contents undefined
+ * Returns NULL if a new slab was needed and memory ran out.
+ */
+void *kmem_cache_alloc(KmemCache *cache) {
+    spin_lock(&cache->lock);
+    Slab *slab = cache->partial;
+    if (slab == NULL) {
+        spin_unlock(&cache->lock);
+        slab = slab_create(cache);
+        if (slab == NULL) {
+            printf("ERROR: Out of memory for a %s slab\n", cache->name);
+            return NULL;
+        }
+        spin_lock(&cache->lock);
+        slab_link(cache, slab);
+        cache->slabs++;
+        if (!cache->listed) {
+            cache->listed = 1;
+            spin_lock(&kmem_caches_lock);
+            cache->all_next = kmem_caches;
+            kmem_caches = cache;
+            spin_unlock(&kmem_caches_lock);
+        }
+    }
+
+    void **obj = slab->free;
+    slab->free = *obj;
+    slab->inuse++;
+    if (slab->free == NULL) {
+        slab_unlink(cache, slab);
+    }
+    cache->active++;
+    spin_unlock(&cache->lock);
+    return obj;
+}
+
+/**
+ * kmem_cache_free - Give an object back to the cache it came from
+ */
+void kmem_cache_free(KmemCache *cache, void *obj) {
+    Slab *slab = SLAB_OF(obj);
+    if (slab->cache != cache) {
+        printf("ERROR: kmem_cache_free of 0x%x to %s, which it is not from\n", (uint64_t)obj, cache->name);
+        return;
+    }
+
+    spin_lock(&cache->lock);
+    if (slab->free == NULL) {
+        slab_link(cache, slab);
+    }
+    *(void **)obj = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+    cache->active--;
+    // Keep the last partial slab, so one object coming and going doesn't
+    // take a page from the allocator every time
+    int release = slab->inuse == 0 && (cache->partial != slab || slab->next != NULL);
+    if (release) {
+        slab_unlink(cache, slab);
+        cache->slabs--;
+    }
+    spin_unlock(&cache->lock);
+
+    if (release) {
+        free_page((uint64_t)obj & ~(uint64_t)(PAGE_SIZE - 1));
+    }
+}
+
+/**
+ * kmalloc - Allocate size bytes (at most KMALLOC_MAX), contents undefined
+ * The object is aligned to its size rounded up to a power of two.
+ * Returns NULL if size is too large or memory ran out.
+ */
+void *kmalloc(size_t size) {
+    if (size > KMALLOC_MAX) {
+        printf("ERROR: kmalloc(%d) exceeds KMALLOC_MAX\n", size);
+        return NULL;
+    }
+    int idx = 0;
+    while ((size_t)(KMALLOC_MIN << idx) < size) {
+        idx++;
+    }
+    return kmem_cache_alloc(&kmalloc_caches[idx]);
+}
+
+/**
+ * kfree - Free an object from kmalloc() (NULL is ignored)
+ */
+void kfree(void *obj) {
+    if (obj != NULL) {
+        kmem_cache_free(SLAB_OF(obj)->cache, obj);
+    }
+}
+
+/**
+ * kmem_print - One line per cache: objects in use and pages held
+ */
+void kmem_print(void) {
+    spin_lock(&kmem_caches_lock);
+    for (KmemCache *cache = kmem_caches; cache; cache = cache->all_next) {
+        printf("Slab %s: %u objects of %u bytes in use, %u pages\n", cache->name, cache->active,
+               cache->size, cache->slabs);
+    }
+    spin_unlock(&kmem_caches_lock);
+}
+
+// ============================================================================
+// Timer - CLINT machine timer and software interrupts
+// ============================================================================
+// Each hart has a 64-bit mtimecmp register in the CLINT; the machine timer
+// interrupt (MTI) is pending while mtime >= mtimecmp. Every hart re-arms its
+// own mtimecmp one time slice ahead and charges the tick to the running
+// process when it fires. Writing 1 to a hart's msip register raises its
+// machine software interrupt (MSI), which the scheduler uses to make another
+// hart (or this one, once interrupts are back on) reschedule early.
+
+#define CLINT_BASE          0x02000000
+#define CLINT_MTIMECMP(h)   ((volatile uint64_t *)(CLINT_BASE + 0x4000 + 8 * (h)))
+#define CLINT_MTIME         ((volatile uint64_t *)(CLINT_BASE + 0xBFF8))
+#define CLINT_MSIP(h)       ((volatile uint32_t *)(CLINT_BASE + 4 * (h)))
+#define MIE_MSIE            (1ULL << 3)
+#define MIE_MTIE            (1ULL << 7)
+#define DEFAULT_TIMEBASE_HZ 10000000    // QEMU virt, used if the DTB doesn't say
+
+#define TIME_SLICE_MS CONFIG_TIME_SLICE_MS
+
+static uint64_t timebase_hz = DEFAULT_TIMEBASE_HZ;
+static uint64_t time_slice_ticks = 0;
+
+/**
+ * timer_set_slice_ms - Change the preemption time slice (takes effect on the next tick)
+ */
+void timer_set_slice_ms(uint64_t ms) {
+    time_slice_ticks = timebase_hz / 1000 * ms;
+    if (time_slice_ticks == 0) {
+        time_slice_ticks = 1;
+    }
+}
+
+/**
+ * timer_init - Read the timer frequency and arm the boot hart's timer
+ */
+void timer_init(void) {
+    uint32_t len;
+    const void *freq = fdt_getprop("/cpus", "timebase-frequency", &len);
+    if (freq != NULL && len >= 4) {
+        timebase_hz = fdt_read_cells(freq, len >= 8 ? 2 : 1);
+    }
+    timer_set_slice_ms(TIME_SLICE_MS);
+    timer_init_hart();
+    pr_debug("Timer: %d Hz, %d ms time slice\n", timebase_hz, TIME_SLICE_MS);
+}
+
+/**
+ * timer_init_hart - Schedule the first tick and enable MTI and MSI on the calling hart
+ * The kernel runs with mstatus.MIE clear, so the interrupts are only taken
+ * while a hart runs a process in U-mode, where M-mode interrupts are always
+ * enabled.
+ */
+void timer_init_hart(void) {
+    *CLINT_MTIMECMP(hart_id()) = *CLINT_MTIME + time_slice_ticks;
+    set_csr(mie, MIE_MTIE | MIE_MSIE);
+}
+
+/**
+ * timer_interrupt - Machine timer interrupt: re-arm and charge the tick
+ * Called from trap_handler, which has saved the whole register state in a
+ * TrapFrame on the process's stack. Once the running process has used up its
+ * slice, sched_preempt() switches away exactly as if the process had called
+ * yield(), with the trap frame below the switch frame.
+ */
+void timer_interrupt(void) {
+    KSTAT_BEGIN(t);
+    *CLINT_MTIMECMP(hart_id()) = *CLINT_MTIME + time_slice_ticks;
+    sleep_wake_expired();
+    if (sched_tick()) {
+        sched_preempt();
+    }
+    KSTAT_END(KSTAT_IRQ(IRQ_M_TIMER), t);
+}
+
+/**
+ * ipi_send - Raise the machine software interrupt on a hart
+ */
+void ipi_send(uint64_t hartid) {
+    *CLINT_MSIP(hartid) = 1;
+}
+
+/**
+ * ipi_interrupt - Machine software interrupt: someone wants us to reschedule
+ */
+void ipi_interrupt(void) {
+    KSTAT_BEGIN(t);
+    *CLINT_MSIP(hart_id()) = 0;
+    sched_preempt();
+    KSTAT_END(KSTAT_IRQ(IRQ_M_SOFT), t);
+}
+
+#define MIP_MSIP (1ULL << 3)
+#define MIP_MTIP (1ULL << 7)
+#define MIP_MEIP (1ULL << 11)
+
+/**
+ * hart_idle - Wait in wfi until an interrupt is pending, then handle it
+ * The kernel keeps mstatus.MIE clear, so wfi returns with the interrupt
+ * still pending instead of taking it, and we call its handler by hand.
+ * With no process current none of them preempts anything; they re-arm
+ * the timer, wake sleepers and drain the UART, and an IPI means a process
+ * was queued for us.
+ */
+void hart_idle(void) {
+    asm volatile("wfi");
+    uint64_t mip = read_csr(mip);
+    if (mip & MIP_MTIP) {
+        timer_interrupt();
+    }
+    if (mip & MIP_MSIP) {
+        ipi_interrupt();
+    }
+    if (mip & MIP_MEIP) {
+        external_interrupt();
+    }
+}
+
+// ============================================================================
+// Process Management - Preemptive Multitasking
+// ============================================================================
+
+/**
+ * Process states
+ * Only READY processes are ever on a run queue; BLOCKED, SLEEPING and EXITED
+ * processes are not linked anywhere the scheduler looks.
+ */
+typedef enum {
+    PROC_READY,         // On a run queue
+    PROC_RUNNING,       // Running on some hart
+    PROC_BLOCKED,       // Waiting for sched_wakeup()
+    PROC_SLEEPING,      // Waiting for a timer
+    PROC_EXITED,        // Finished, reaped after its last switch
+} ProcState;
+
+/**
+ * Process Control Block (PCB)
+ * Each process has its own address space, a one-page kernel stack its traps
+ * and context switches run on, and scheduling state. PCBs are allocated on
+ * demand by process_create().
+ */
+typedef struct process {
+    uint64_t sp;                // Saved kernel stack pointer
+    uint64_t stack_addr;        // Base address of the process's kernel stack
+    int id;                     // Process ID
+    volatile int state;         // ProcState
+    volatile int on_cpu;        // Set from switch-in until its context is fully saved
+    int sched_class;            // SCHED_RT or SCHED_FAIR, fixed at creation
+    volatile int prio;          // RT priority or fair weight, see sched_setprio()
+    int rq_prio;                // prio of the list it is queued on (under rq->lock)
+    int slice_left;             // Ticks left before the timer preempts it
+    uint64_t ready_since;       // mtime when it was last queued
+    RunQueue *rq;               // Queue it is on, NULL unless READY
+    FdTable files;              // Open files, indexed by fd
+    Vma vmas[MAX_MAPPINGS];     // File mappings, see fs_mmap()
+    pagetable_t pagetable;      // Its Sv39 address space
+    uint64_t asid;              // ASID, valid while asid_gen is current
+    uint64_t asid_gen;
+    int last_hart;              // Hart it last ran on (-1 before it first runs)
+    uint64_t mmap_next;         // Next free address for vm_alloc_va()
+    Ring *ring;                 // Submission ring from SYS_RING_SETUP, or NULL
+    uint64_t ring_va;           // Where the ring is mapped in the process
+    uint32_t ring_entries;      // Kernel's copy of ring->entries
+    struct FpState *fpstate;    // Saved FP/vector registers, NULL until first used
+    int fp_hart;                // Hart holding its FP registers (-1 if none)
+    int vec_hart;               // Hart holding its vector registers (-1 if none)
+    uint64_t wake_at;           // mtime to wake at while SLEEPING
+    struct process *wait_next;  // Wait queue or sleep list link, see wq_wait()
+    struct process *next;       // Run queue links
+    struct process *prev;
+    struct process *all_next;   // Process table links
+    struct process *all_prev;
+} Process;
+
+#define RT_SLICE_TICKS 1        // Round-robin slice between equal RT priorities
+
+/**
+ * Process table
+ * All live processes are on a doubly linked list; PCBs come from pcb_cache.
+ */
+static Process *process_table = NULL;
+static KmemCache pcb_cache = KMEM_CACHE("process", sizeof(Process));
+static uint64_t process_count = 0;
+static int next_pid = 0;
+static Spinlock process_table_lock;
+
+/**
+ * switch_context - Context switch assembly function
+ * Implemented in boot.S
+ */
+extern void switch_context(uint64_t *current_sp_ptr, uint64_t *next_sp_ptr);
+
+/**
+ * process_trampoline - First code a new process runs (boot.S)
+ * Calls sched_process_start() and then returns to U-mode through the
+ * TrapFrame setup_process_stack() left at the top of the kernel stack.
+ */
+extern void process_trampoline(void);
+
+/**
+ * boot_release - Set by the boot hart once secondary harts may enter C (boot.S)
+ */
+extern volatile uint32_t boot_release;
+
+/**
+ * current_process - Process running on the calling hart (NULL if idle)
+ */
+Process *current_process(void) {
+    return this_hart()->current;
+}
+
+/**
+ * current_pid - ID of the process running on the calling hart (-1 if idle)
+ */
+int current_pid(void) {
+    Process *cur = current_process();
+    return cur ? cur->id : -1;
+}
+
+/**
+ * current_pagetable - Address space of the calling process (NULL if idle)
+ */
+pagetable_t current_pagetable(void) {
+    Process *cur = current_process();
+    return cur ? cur->pagetable : NULL;
+}
+
+/**
+ * current_files - File descriptor table of the calling process (NULL if idle)
+ */
+FdTable *current_files(void) {
+    Process *cur = current_process();
+    return cur ? &cur->files : NULL;
+}
+
+/**
+ * current_vmas - Mapping table of the calling process (NULL if idle)
+ */
+Vma *current_vmas(void) {
+    Process *cur = current_process();
+    return cur ? cur->vmas : NULL;
+}
+
+/**
+ * pcb_alloc - Get a zeroed PCB
+ */
+static Process *pcb_alloc(void) {
+    Process *proc = kmem_cache_alloc(&pcb_cache);
+    if (proc != NULL) {
+        memset(proc, 0, sizeof(Process));
+    }
+    return proc;
+}
+
+/**
+ * pcb_free - Return a PCB to pcb_cache
+ */
+static void pcb_free(Process *proc) {
+    kmem_cache_free(&pcb_cache, proc);
+}
+
+/**
+ * ASID allocation
+ * ASIDs are handed out in generations. Within one generation every process
+ * gets its own ASID and none is reused, so TLB entries of different
+ * processes never alias and a switch needs no flush. When they run out a
+ * new generation starts: each hart flushes its TLB once before running a
+ * process of the new generation, and older processes pick up a new ASID
+ * the next time they are switched in.
+ */
+static Spinlock asid_lock;
+static uint64_t asid_next = 1;
+static uint64_t asid_generation = 1;
+
+/**
+ * vm_asid_flush - Drop this hart's TLB entries for one ASID (all if there are no ASIDs)
+ */
+static void vm_asid_flush(uint64_t asid) {
+    if (asid_max == 0) {
+        asm volatile("sfence.vma zero, zero" : : : "memory");
+    } else {
+        asm volatile("sfence.vma zero, %0" : : "r"(asid) : "memory");
+    }
+}
+
+/**
+ * vm_activate - Load next's address space into satp before switching to it
+ * Only satp changes; the kernel itself runs untranslated. A process that
+ * last ran on another hart may have changed its page table there, so its
+ * entries in this hart's TLB are dropped.
+ */
+static void vm_activate(Hart *h, Process *next) {
+    if (asid_max != 0 && next->asid_gen != h->asid_gen) {
+        spin_lock(&asid_lock);
+        if (next->asid_gen != asid_generation) {
+            if (asid_next > asid_max) {
+                asid_generation++;
+                asid_next = 1;
+            }
+            next->asid = asid_next++;
+            next->asid_gen = asid_generation;
+        }
+        if (h->asid_gen != asid_generation) {
+            asm volatile("sfence.vma zero, zero" : : : "memory");
+            h->asid_gen = asid_generation;
+        }
+        spin_unlock(&asid_lock);
+    }
+
+    write_csr(satp, SATP_SV39 | next->asid << SATP_ASID_SHIFT | (uint64_t)next->pagetable >> 12);
+    if (asid_max == 0 || next->last_hart != (int)h->id) {
+        vm_asid_flush(next->asid);
+    }
+    next->last_hart = (int)h->id;
+}
+
+/**
+ * vm_flush_current - Make page table changes of the calling process take effect
+ * Other harts' TLBs may keep stale entries for it; vm_activate() drops
+ * them when the process next runs there.
+ */
+void vm_flush_current(void) {
+    vm_asid_flush(current_process()->asid);
+}
+
+/**
+ * vm_alloc_va - Reserve length bytes of the calling process's address space
+ * Addresses come from a bump pointer above USER_MMAP_BASE and are not
+ * reused. Ranges of 2MB or more start on a 2MB boundary, so vm_map() can
+ * use megapages. Returns the address, or 0 if there is no process or the
+ * space is used up.
+ */
+uint64_t vm_alloc_va(uint64_t length) {
+    Process *cur = current_process();
+    if (cur == NULL || cur->pagetable == NULL) {
+        return 0;
+    }
+    uint64_t align = length >= LEVEL_SIZE(1) ? LEVEL_SIZE(1) : PAGE_SIZE;
+    uint64_t va = align_up(cur->mmap_next, align);
+    uint64_t limit = USER_STACK_TOP - USER_STACK_PAGES * PAGE_SIZE - PAGE_SIZE;
+    if (length > limit || va > limit - length) {
+        printf("ERROR: Out of address space for %d bytes\n", length);
+        return 0;
+    }
+    cur->mmap_next = va + align_up(length, PAGE_SIZE);
+    return va;
+}
+
+// User image sections from kernel.ld, each page-aligned
+extern uint8_t __user_text_start[], __user_text_end[];
+extern uint8_t __user_rodata_start[], __user_rodata_end[];
+extern uint8_t __user_data_start[], __user_data_end[];
+
+/**
+ * process_map_image - Build a new process's address space
+ * The user image is mapped where it was linked, since user.c is not built
+ * position-independent. Text and rodata are shared by every process; data
+ * and bss get private copies of the pristine image in the kernel, and the
+ * stack starts out zeroed. Returns 0, or -1 if memory ran out (the caller
+ * frees what was mapped with vm_destroy()).
+ */
+static int process_map_image(Process *proc) {
+    pagetable_t pt = proc->pagetable;
+    uint64_t text = (uint64_t)__user_text_start;
+    uint64_t rodata = (uint64_t)__user_rodata_start;
+    if (vm_map(pt, text, text, (uint64_t)__user_text_end - text, PTE_U | PTE_R | PTE_X) != 0 ||
+        vm_map(pt, rodata, rodata, (uint64_t)__user_rodata_end - rodata, PTE_U | PTE_R) != 0) {
+        return -1;
+    }
+
+    for (uint64_t va = (uint64_t)__user_data_start; va < (uint64_t)__user_data_end; va += PAGE_SIZE) {
+        uint64_t page = alloc_page_nozero();
+        if (page == 0) {
+            return -1;
+        }
+        memcpy((void *)page, (const void *)va, PAGE_SIZE);
+        if (vm_map(pt, va, page, PAGE_SIZE, PTE_U | PTE_R | PTE_W | PTE_OWNED) != 0) {
+            free_page(page);
+            return -1;
+        }
+    }
+
+    for (uint64_t i = 1; i <= USER_STACK_PAGES; i++) {
+        uint64_t page = alloc_page();
+        if (page == 0) {
+            return -1;
+        }
+        if (vm_map(pt, USER_STACK_TOP - i * PAGE_SIZE, page, PAGE_SIZE,
+                   PTE_U | PTE_R | PTE_W | PTE_OWNED) != 0) {
+            free_page(page);
+            return -1;
+        }
+    }
+    proc->mmap_next = USER_MMAP_BASE;
+    return 0;
+}
+
+// Lazy FP and vector state
+// A process runs with mstatus.FS and VS Off until it first touches the
+// unit, which traps as an illegal instruction: fpu_trap() then loads its
+// registers and turns the unit on for it. The registers stay loaded after
+// it is switched out (the hart remembers it as fp_owner / vec_owner), so
+// it only reloads if some other process or hart used them in between. At
+// a switch only state the hardware has marked Dirty is saved, so for
+// integer-only processes switch_context() stays as cheap as before.
+// The kernel never uses FP, but memcpy_rvv/memset_rvv do use the vector
+// registers; vec_kernel_begin() gets the process's out of the way first.
+
+#define MSTATUS_FS        (3ULL << 13)
+#define MSTATUS_FS_INIT   (1ULL << 13)
+#define MSTATUS_FS_CLEAN  (2ULL << 13)
+#define MSTATUS_FS_DIRTY  (3ULL << 13)
+#define MSTATUS_VS        (3ULL << 9)
+#define MSTATUS_VS_CLEAN  (2ULL << 9)
+#define MSTATUS_VS_DIRTY  (3ULL << 9)
+#define MISA_D            (1ULL << ('D' - 'A'))
+
+/**
+ * FpState - A process's FP and vector registers while they are not loaded
+ * The offsets are hard-coded in fp_save() / vec_save() in boot.S. v holds
+ * v0-v31 back to back, 32 * vlenb bytes.
+ */
+typedef struct FpState {
+    uint64_t f[32];
+    uint64_t fcsr;
+    uint64_t vl;
+    uint64_t vtype;
+    uint64_t vstart;
+    uint64_t vcsr;
+    uint64_t reserved[3];
+    uint8_t v[];
+} FpState;
+
+_Static_assert(offsetof(FpState, fcsr) == 256 && offsetof(FpState, vl) == 264 &&
+               offsetof(FpState, v) == 320, "FpState offsets are hard-coded in boot.S");
+
+extern void fp_save(FpState *st);
+extern void fp_restore(FpState *st);
+extern void vec_save(FpState *st);
+extern void vec_restore(FpState *st);
+
+static TrapFrame *process_trap_frame(Process *proc);
+
+static int have_fp;
+static int have_vector;
+static uint64_t fpstate_bytes;  // Size of one FpState
+
+/**
+ * fpstate_alloc / fpstate_free - A save area, contents undefined
+ * From kmalloc() while it fits (always, without the vector unit or with
+ * VLEN up to 128), whole pages otherwise.
+ */
+static FpState *fpstate_alloc(void) {
+    if (fpstate_bytes <= KMALLOC_MAX) {
+        return kmalloc(fpstate_bytes);
+    }
+    return (FpState *)alloc_pages_nozero((fpstate_bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
+static void fpstate_free(FpState *st) {
+    if (fpstate_bytes <= KMALLOC_MAX) {
+        kfree(st);
+    } else {
+        free_pages((uint64_t)st, (fpstate_bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+    }
+}
+
+/**
+ * fpu_init - Size the per-process save area for the FP and vector units present
+ */
+void fpu_init(void) {
+    uint64_t misa = read_csr(misa);
+    have_fp = (misa & MISA_D) != 0;
+    have_vector = (misa & MISA_V) != 0;
+
+    uint64_t bytes = sizeof(FpState);
+    if (have_vector) {
+        set_csr(mstatus, MSTATUS_VS_INIT);
+        bytes += 32 * read_csr(0xc22);  // vlenb
+    }
+    fpstate_bytes = bytes;
+    pr_debug("FP/vector state: %d bytes per process (FP %s, vector %s), switched lazily\n",
+             bytes, have_fp ? "yes" : "no", have_vector ? "yes" : "no");
+}
+
+/**
+ * fpu_trap - Illegal instruction from U-mode: maybe the first FP/vector use
+ * Loads the calling process's registers (all zero the first time) and
+ * turns the unit on in its frame, so the instruction is retried. FP is
+ * turned on first; a vector instruction traps once more for VS. Returns 0
+ * if it did either, -1 if the instruction is really illegal.
+ */
+int fpu_trap(TrapFrame *frame) {
+    Process *cur = current_process();
+    Hart *h = this_hart();
+    int fp = have_fp && (frame->mstatus & MSTATUS_FS) == 0;
+    int vec = have_vector && (frame->mstatus & MSTATUS_VS) == 0;
+    if (cur == NULL || (!fp && !vec)) {
+        return -1;
+    }
+    if (cur->fpstate == NULL) {
+        cur->fpstate = fpstate_alloc();
+        if (cur->fpstate == NULL) {
+            return -1;
+        }
+        memset(cur->fpstate, 0, fpstate_bytes);
+    }
+
+    if (fp) {
+        set_csr(mstatus, MSTATUS_FS_INIT);
+        fp_restore(cur->fpstate);
+        h->fp_owner = cur;
+        cur->fp_hart = (int)h->id;
+        frame->mstatus = (frame->mstatus & ~MSTATUS_FS) | MSTATUS_FS_CLEAN;
+    } else {
+        set_csr(mstatus, MSTATUS_VS_INIT);
+        vec_restore(cur->fpstate);
+        h->vec_owner = cur;
+        cur->vec_hart = (int)h->id;
+        frame->mstatus = (frame->mstatus & ~MSTATUS_VS) | MSTATUS_VS_CLEAN;
+    }
+    return 0;
+}
+
+/**
+ * fpu_save - Save whatever the calling hart's process has changed since it was loaded
+ * The registers stay loaded; the frame is marked Clean to match.
+ */
+static void fpu_save(Process *cur) {
+    TrapFrame *frame = process_trap_frame(cur);
+    if ((frame->mstatus & MSTATUS_FS) == MSTATUS_FS_DIRTY) {
+        set_csr(mstatus, MSTATUS_FS_INIT);
+        fp_save(cur->fpstate);
+        frame->mstatus = (frame->mstatus & ~MSTATUS_FS) | MSTATUS_FS_CLEAN;
+    }
+    if ((frame->mstatus & MSTATUS_VS) == MSTATUS_VS_DIRTY) {
+        set_csr(mstatus, MSTATUS_VS_INIT);
+        vec_save(cur->fpstate);
+        frame->mstatus = (frame->mstatus & ~MSTATUS_VS) | MSTATUS_VS_CLEAN;
+    }
+}
+
+/**
+ * fpu_switch_out - Save cur's dirty FP/vector state before switching away
+ * An exited process's registers are simply abandoned.
+ */
+static void fpu_switch_out(Hart *h, Process *cur) {
+    if (cur->state != PROC_EXITED) {
+        fpu_save(cur);
+        return;
+    }
+    if (h->fp_owner == cur) {
+        h->fp_owner = NULL;
+    }
+    if (h->vec_owner == cur) {
+        h->vec_owner = NULL;
+    }
+}
+
+/**
+ * fpu_switch_in - Turn off the units whose registers on h are not next's
+ * next then traps on first use and fpu_trap() reloads them. A new PCB may
+ * reuse an old owner's address, but starts with both units off anyway.
+ */
+static void fpu_switch_in(Hart *h, Process *next) {
+    TrapFrame *frame = process_trap_frame(next);
+    if (h->fp_owner != next || next->fp_hart != (int)h->id) {
+        frame->mstatus &= ~MSTATUS_FS;
+    }
+    if (h->vec_owner != next || next->vec_hart != (int)h->id) {
+        frame->mstatus &= ~MSTATUS_VS;
+    }
+}
+
+/**
+ * fpu_fork - Give a forked child a copy of cur's FP/vector state
+ * The child starts with both units off and loads the copy on first use.
+ * Returns 0, or -1 if memory ran out.
+ */
+static int fpu_fork(Process *cur, Process *child) {
+    if (cur->fpstate == NULL) {
+        return 0;
+    }
+    fpu_save(cur);
+    child->fpstate = fpstate_alloc();
+    if (child->fpstate == NULL) {
+        return -1;
+    }
+    memcpy(child->fpstate, cur->fpstate, fpstate_bytes);
+    return 0;
+}
+
+/**
+ * vec_kernel_begin - Make the vector registers safe for the kernel to use
+ * Called by memcpy/memset before the RVV routines run. If this hart holds
+ * the calling process's vector state, that is saved (when dirty) and the
+ * process will reload it on its next vector instruction. A process that
+ * is not running here has nothing unsaved, so it just loses ownership.
+ */
+void vec_kernel_begin(void) {
+    set_csr(mstatus, MSTATUS_VS_INIT);
+    Hart *h = this_hart();
+    Process *owner = h->vec_owner;
+    if (owner == NULL) {
+        return;
+    }
+    h->vec_owner = NULL;
+    if (owner == h->current) {
+        TrapFrame *frame = process_trap_frame(owner);
+        if ((frame->mstatus & MSTATUS_VS) == MSTATUS_VS_DIRTY) {
+            vec_save(owner->fpstate);
+        }
+        frame->mstatus &= ~MSTATUS_VS;
+    }
+}
+
+/**
+ * sched_rank - How urgent a process is: 0 is most urgent, RANK_FAIR least
+ */
+static int sched_rank(Process *proc) {
+    return proc->sched_class == SCHED_RT ? proc->prio : RANK_FAIR;
+}
+
+/**
+ * sched_prio_valid - Is prio in range for the given class?
+ */
+static int sched_prio_valid(int sched_class, int prio) {
+    if (sched_class == SCHED_RT) {
+        return prio >= 0 && prio <= RT_PRIO_MAX;
+    }
+    if (sched_class == SCHED_FAIR) {
+        return prio >= 1 && prio <= FAIR_WEIGHT_MAX;
+    }
+    return 0;
+}
+
+/**
+ * sched_slice - Ticks a process may run once dispatched
+ */
+static int sched_slice(Process *proc) {
+    return proc->sched_class == SCHED_RT ? RT_SLICE_TICKS : proc->prio;
+}
+
+/**
+ * lowest_bit - Index of the lowest set bit of a non-zero word
+ * De Bruijn multiply: we link without libgcc, so no __builtin_ctz.
+ */
+static int lowest_bit(uint32_t x) {
+    static const uint8_t debruijn[32] = {
+        0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+        31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9,
+    };
+    return debruijn[((x & -x) * 0x077CB531U) >> 27];
+}
+
+/**
+ * runqueue_rank - Rank of the most urgent process queued (RANK_IDLE if empty)
+ * Callers that don't hold the lock only get a hint.
+ */
+static int runqueue_rank(RunQueue *rq) {
+    uint32_t bitmap = rq->rt_bitmap;
+    if (bitmap) {
+        return lowest_bit(bitmap);
+    }
+    return rq->fair.head ? RANK_FAIR : RANK_IDLE;
+}
+
+/**
+ * runqueue_list - The list a process is (or is about to be) queued on
+ */
+static ProcList *runqueue_list(RunQueue *rq, Process *proc) {
+    return proc->sched_class == SCHED_RT ? &rq->rt[proc->rq_prio] : &rq->fair;
+}
+
+/**
+ * runqueue_insert_locked - Append a process to the list for its priority
+ */
+static void runqueue_insert_locked(RunQueue *rq, Process *proc) {
+    proc->rq_prio = proc->prio;
+    ProcList *list = runqueue_list(rq, proc);
+    proc->next = NULL;
+    proc->prev = list->tail;
+    if (list->tail) {
+        list->tail->next = proc;
+    } else {
+        list->head = proc;
+    }
+    list->tail = proc;
+    if (proc->sched_class == SCHED_RT) {
+        rq->rt_bitmap |= 1U << proc->rq_prio;
+    }
+    proc->rq = rq;
+    rq->count++;
+}
+
+/**
+ * runqueue_remove_locked - Unlink a queued process
+ */
+static void runqueue_remove_locked(RunQueue *rq, Process *proc) {
+    ProcList *list = runqueue_list(rq, proc);
+    if (proc->prev) {
+        proc->prev->next = proc->next;
+    } else {
+        list->head = proc->next;
+    }
+    if (proc->next) {
+        proc->next->prev = proc->prev;
+    } else {
+        list->tail = proc->prev;
+    }
+    if (list->head == NULL && proc->sched_class == SCHED_RT) {
+        rq->rt_bitmap &= ~(1U << proc->rq_prio);
+    }
+    proc->next = NULL;
+    proc->prev = NULL;
+    proc->rq = NULL;
+    rq->count--;
+}
+
+/**
+ * runqueue_push - Queue a process behind others of the same priority
+ */
+void runqueue_push(RunQueue *rq, Process *proc) {
+    proc->ready_since = *CLINT_MTIME;
+    spin_lock(&rq->lock);
+    runqueue_insert_locked(rq, proc);
+    spin_unlock(&rq->lock);
+}
+
+/**
+ * runqueue_pop - Remove the most urgent queued process
+ * Returns NULL if the queue is empty or its best is less urgent than max_rank.
+ */
+Process *runqueue_pop(RunQueue *rq, int max_rank) {
+    spin_lock(&rq->lock);
+    Process *proc = NULL;
+    int rank = runqueue_rank(rq);
+    if (rank != RANK_IDLE && rank <= max_rank) {
+        proc = rank == RANK_FAIR ? rq->fair.head : rq->rt[rank].head;
+        runqueue_remove_locked(rq, proc);
+    }
+    spin_unlock(&rq->lock);
+    return proc;
+}
+
+/**
+ * sched_kick - Ask a hart to reschedule because a process of this rank got queued
+ * Picks the hart running the least urgent work (idle harts first); nothing
+ * happens if every hart is already busy with something at least as urgent.
+ */
+static void sched_kick(int rank) {
+    Hart *target = NULL;
+    for (int i = 0; i < MAX_HARTS; i++) {
+        Hart *h = &harts[i];
+        if (h->online && h->cur_rank > rank &&
+            (target == NULL || h->cur_rank > target->cur_rank)) {
+            target = h;
+        }
+    }
+    if (target) {
+        ipi_send(target->id);
+    }
+}
+
+/**
+ * sched_enqueue - Queue a newly runnable process on the calling hart
+ */
+static void sched_enqueue(Process *proc) {
+    runqueue_push(&this_hart()->rq, proc);
+    sched_kick(sched_rank(proc));
+}
+
+/**
+ * sched_pick_next - Choose the next process for this hart, no less urgent than max_rank
+ * A real-time process queued on another hart beats fair-share work queued
+ * here, so unless we have real-time work of our own, look for that first.
+ * Otherwise take the best of the local queue and, if that is empty, steal
+ * from the first other hart (scanning upwards from our own ID) that has work.
+ */
+static Process *sched_pick_next(Hart *h, int max_rank) {
+    Process *next;
+    if (runqueue_rank(&h->rq) >= RANK_FAIR && max_rank >= RANK_FAIR) {
+        for (int i = 1; i < MAX_HARTS; i++) {
+            Hart *victim = &harts[(h->id + i) % MAX_HARTS];
+            // Unlocked peek so we don't take every other hart's lock
+            if (victim->rq.rt_bitmap) {
+                next = runqueue_pop(&victim->rq, RANK_FAIR - 1);
+                if (next) {
+                    return next;
+                }
+            }
+        }
+    }
+
+    next = runqueue_pop(&h->rq, max_rank);
+    if (next) {
+        return next;
+    }
+
+    for (int i = 1; i < MAX_HARTS; i++) {
+        Hart *victim = &harts[(h->id + i) % MAX_HARTS];
+        // Unlocked peek so idle harts don't hammer empty queues' locks
+        if (victim->rq.count > 0) {
+            next = runqueue_pop(&victim->rq, max_rank);
+            if (next) {
+                return next;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * sched_dispatch - Load next's address space and account for switching this hart to it
+ */
+static void sched_dispatch(Hart *h, Process *next) {
+    vm_activate(h, next);
+    fpu_switch_in(h, next);
+    next->on_cpu = 1;
+    next->state = PROC_RUNNING;
+    next->slice_left = sched_slice(next);
+    h->cur_rank = sched_rank(next);
+
+    SchedStats *st = &h->sched_stats[next->sched_class];
+    uint64_t latency = *CLINT_MTIME - next->ready_since;
+    st->dispatches++;
+    st->total_ticks += latency;
+    if (latency > st->max_ticks) {
+        st->max_ticks = latency;
+    }
+}
+
+static uint64_t ring_pages(uint32_t entries);
+static void ring_release(Process *proc);
+
+/**
+ * process_reap - Free an exited process (its stack is no longer in use)
+ */
+static void process_reap(Process *proc) {
+    spin_lock(&process_table_lock);
+    if (proc->all_prev) {
+        proc->all_prev->all_next = proc->all_next;
+    } else {
+        process_table = proc->all_next;
+    }
+    if (proc->all_next) {
+        proc->all_next->all_prev = proc->all_prev;
+    }
+    process_count--;
+    spin_unlock(&process_table_lock);
+
+    fs_unmap_all(proc->vmas);
+    fs_close_all(&proc->files);
+    ring_release(proc);
+    vm_destroy(proc->pagetable);
+    if (proc->fpstate) {
+        fpstate_free(proc->fpstate);
+    }
+    free_page(proc->stack_addr);
+    pcb_free(proc);
+}
+
+/**
+ * sched_finish_switch - Deal with the process we just switched away from
+ * This can only happen once switch_context() has saved its registers,
+ * otherwise another hart could steal it and resume a half-saved context.
+ * So it runs on the far side of the switch, in whatever context resumed.
+ *
+ * A process that was still RUNNING (it yielded or was preempted) goes back
+ * on this hart's queue, an EXITED one is freed. BLOCKED/SLEEPING processes
+ * are left alone; whoever wakes them queues them once on_cpu drops.
+ */
+void sched_finish_switch(void) {
+    Hart *h = this_hart();
+    Process *prev = h->prev;
+    h->prev = NULL;
+    if (prev == NULL) {
+        return;
+    }
+
+    if (prev->state == PROC_EXITED) {
+        process_reap(prev);
+        return;
+    }
+
+    __sync_synchronize();
+    prev->on_cpu = 0;
+
+    if (prev->state == PROC_RUNNING) {
+        prev->state = PROC_READY;
+        runqueue_push(&h->rq, prev);
+    }
+}
+
+/**
+ * sched_switch - Switch from cur to the next ready process
+ * If nothing at least as urgent is ready, a still-RUNNING cur simply keeps
+ * the CPU with a fresh slice (returns 0);
+ * otherwise the hart drops into its scheduler loop. Must be called inside
+ * exactly one push_off(). Returns 1 once cur has been switched back in.
+ */
+static int sched_switch(Process *cur) {
+    Hart *h = this_hart();
+    if (h->noff != 1) {
+        panic("sched_switch with a lock held");
+    }
+
+    // A process that can keep running only gives way to one at least as urgent
+    int max_rank = cur->state == PROC_RUNNING ? sched_rank(cur) : RANK_IDLE;
+    Process *next = sched_pick_next(h, max_rank);
+    uint64_t *next_sp;
+    if (next) {
+        sched_dispatch(h, next);
+        next_sp = &next->sp;
+    } else if (cur->state == PROC_RUNNING) {
+        cur->slice_left = sched_slice(cur);
+        h->cur_rank = sched_rank(cur);
+        return 0;
+    } else {
+        h->cur_rank = RANK_IDLE;
+        next_sp = &h->idle_sp;
+    }
+
+    fpu_switch_out(h, cur);
+    int intena = h->intena;
+    h->prev = cur;
+    h->current = next;
+    switch_context(&cur->sp, next_sp);
+
+    // We may have been resumed on a different hart
+    h = this_hart();
+    h->intena = intena;
+    sched_finish_switch();
+    return 1;
+}
+
+/**
+ * sched_process_start - Called by process_trampoline the first time a process runs
+ * The process leaves the kernel through a trap return, which must run with
+ * interrupts off like every other; mret turns them on in U-mode.
+ */
+void sched_process_start(void) {
+    sched_finish_switch();
+    this_hart()->intena = 0;
+    pop_off();
+}
+
+/**
+ * sched_wakeup - Make a BLOCKED or SLEEPING process ready again
+ * The caller must have taken proc off whatever it was waiting on. If proc is
+ * still in the middle of switching out on another hart, wait for that to
+ * finish before queueing it.
+ */
+void sched_wakeup(Process *proc) {
+    if (!__sync_bool_compare_and_swap(&proc->state, PROC_BLOCKED, PROC_READY) &&
+        !__sync_bool_compare_and_swap(&proc->state, PROC_SLEEPING, PROC_READY)) {
+        return;
+    }
+    while (proc->on_cpu) {
+    }
+    sched_enqueue(proc);
+}
+
+/**
+ * process_block - Give up the CPU until someone calls sched_wakeup()
+ * The caller has set its state to PROC_BLOCKED or PROC_SLEEPING while
+ * holding the lock its waker takes, and has dropped that lock since. If
+ * the waker already got in, the state is READY again and we are queued as
+ * soon as the switch completes.
+ */
+void process_block(void) {
+    push_off();
+    sched_switch(current_process());
+    pop_off();
+}
+
+// Wait queues and sleeping
+// A BLOCKED process is on one wait queue and a SLEEPING one on the sleep
+// list, linked through wait_next either way; neither is on a run queue.
+
+/**
+ * wq_wait - Block the calling process on wq until wq_wake_all()
+ * Called with lk held: the lock protecting the condition being waited
+ * for, which wakers must also hold while changing it. lk is dropped while
+ * blocked and held again on return. Wakeups can be spurious, so callers
+ * re-check their condition in a loop.
+ */
+void wq_wait(WaitQueue *wq, Spinlock *lk) {
+    Process *cur = current_process();
+    spin_lock(&wq->lock);
+    cur->wait_next = NULL;
+    if (wq->tail) {
+        wq->tail->wait_next = cur;
+    } else {
+        wq->head = cur;
+    }
+    wq->tail = cur;
+    cur->state = PROC_BLOCKED;
+    spin_unlock(&wq->lock);
+
+    spin_unlock(lk);
+    process_block();
+    spin_lock(lk);
+}
+
+/**
+ * wq_wake_all - Make every process waiting on wq ready
+ * The caller holds the lock the waiters passed to wq_wait(), so the
+ * unlocked peek can't miss one.
+ */
+void wq_wake_all(WaitQueue *wq) {
+    if (wq->head == NULL) {
+        return;
+    }
+    spin_lock(&wq->lock);
+    Process *proc = wq->head;
+    wq->head = NULL;
+    wq->tail = NULL;
+    spin_unlock(&wq->lock);
+
+    while (proc) {
+        // Once woken it may run and reuse wait_next
+        Process *next = proc->wait_next;
+        sched_wakeup(proc);
+        proc = next;
+    }
+}
+
+static Spinlock sleep_lock;
+static Process *sleep_list;     // SLEEPING processes, earliest wake_at first
+
+/**
+ * process_sleep - Sleep for at least ticks timer ticks (SYS_SLEEP)
+ * A tick is one time slice (TIME_SLICE_MS); sleepers are woken from the
+ * timer interrupt, so they can oversleep by up to a tick. ticks = 0 just
+ * yields. Returns 0, or -1 outside a process.
+ */
+int process_sleep(uint64_t ticks) {
+    Process *cur = current_process();
+    if (cur == NULL) {
+        return -1;
+    }
+    if (ticks == 0) {
+        yield();
+        return 0;
+    }
+
+    cur->wake_at = *CLINT_MTIME + ticks * time_slice_ticks;
+    spin_lock(&sleep_lock);
+    Process **link = &sleep_list;
+    while (*link && (*link)->wake_at <= cur->wake_at) {
+        link = &(*link)->wait_next;
+    }
+    cur->wait_next = *link;
+    *link = cur;
+    cur->state = PROC_SLEEPING;
+    spin_unlock(&sleep_lock);
+
+    process_block();
+    return 0;
+}
 
 /**
- * FileDescriptor - Open file handle
- * One per open file, references an inode and tracks position
+ * sleep_wake_expired - Wake every sleeper whose time has come
+ * Called from the timer interrupt on every hart.
  */
-typedef struct {
-    int inode_idx;              // Index into inode table (-1 = unused)
-    uint64_t offset;            // Current read/write position
-    int in_use;                 // Is this fd open?
-} FileDescriptor;
+void sleep_wake_expired(void) {
+    // Unlocked peek so every tick doesn't take the lock
+    if (sleep_list == NULL) {
+        return;
+    }
+    uint64_t now = *CLINT_MTIME;
+    spin_lock(&sleep_lock);
+    Process *expired = NULL;
+    Process **tail = &expired;
+    while (sleep_list && sleep_list->wake_at <= now) {
+        *tail = sleep_list;
+        tail = &sleep_list->wait_next;
+        sleep_list = sleep_list->wait_next;
+    }
+    *tail = NULL;
+    spin_unlock(&sleep_lock);
+
+    while (expired) {
+        Process *next = expired->wait_next;
+        sched_wakeup(expired);
+        expired = next;
+    }
+}
 
 /**
- * Filesystem state
+ * process_exit - Terminate the calling process
+ * Its stack and PCB are freed by sched_finish_switch() once we are off it.
  */
-static Inode inode_table[MAX_INODES];
-static int fs_initialized = 0;
+void process_exit(void) {
+    push_off();
+    Process *cur = current_process();
+    cur->state = PROC_EXITED;
+    sched_switch(cur);
+    panic("exited process was resumed");
+}
 
 /**
- * fs_init - Initialize the file system
+ * scheduler_idle - Background work for when no other process is ready
+ * Returns nonzero if there may be more to do, 0 once the hart can sleep.
  */
-void fs_init(void) {
-    for (int i = 0; i < MAX_INODES; i++) {
-        inode_table[i].in_use = 0;
-        inode_table[i].size = 0;
-        inode_table[i].data_addr = 0;
+int scheduler_idle(void) {
+    console_poll();
+    int zeroed = pages_idle_zero();
+#ifdef BENCH
+    // The benchmark processes have all exited
+    if (process_count == 0) {
+        printf("BENCH done\n");
+        poweroff();
     }
-    fs_initialized = 1;
+#endif
+    return zeroed;
 }
 
 /**
- * fs_find_inode - Find inode by filename
- * Returns inode index or -1 if not found
+ * yield - Voluntarily give up the CPU to the next process
+ * The current process goes to the back of this hart's run queue.
  */
-int fs_find_inode(const char *filename) {
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (inode_table[i].in_use && strcmp(inode_table[i].filename, filename) == 0) {
-            return i;
-        }
+void yield(void) {
+    KSTAT_BEGIN(t);
+    push_off();
+    Process *cur = current_process();
+    if (cur == NULL) {
+        panic("yield outside a process");
     }
-    return -1;
+
+    if (!sched_switch(cur)) {
+        // Nobody else to run: use the time for background work
+        pop_off();
+        scheduler_idle();
+    } else {
+        pop_off();
+    }
+    KSTAT_END(KSTAT_YIELD, t);
 }
 
 /**
- * fs_open - Open or create a file
- * Returns file descriptor index (0-7) or -1 on error
+ * sched_tick - Charge a timer tick to the running process
+ * Returns 1 once it has used up its slice and should be preempted.
  */
-int fs_open(const char *filename) {
-    if (!fs_initialized) fs_init();
-
-    // Find existing file
-    int inode_idx = fs_find_inode(filename);
-
-    // If not found, create new file
-    if (inode_idx == -1) {
-        // Find free inode
-        for (int i = 0; i < MAX_INODES; i++) {
-            if (!inode_table[i].in_use) {
-                inode_idx = i;
-                // Allocate memory for file data
-                uint64_t page = alloc_page();
-                if (page == 0) {
-                    printf("ERROR: Cannot allocate page for file\n");
-                    return -1;
-                }
+int sched_tick(void) {
+    Process *cur = current_process();
+    return cur != NULL && --cur->slice_left <= 0;
+}
 
-                // Initialize inode
-                inode_table[i].in_use = 1;
-                inode_table[i].size = 0;
-                inode_table[i].data_addr = page;
+/**
+ * sched_preempt - Involuntary yield from the timer or a reschedule IPI
+ * Unlike yield(), does no idle-time work if cur keeps the CPU.
+ */
+void sched_preempt(void) {
+    push_off();
+    Process *cur = current_process();
+    if (cur != NULL) {
+        sched_switch(cur);
+    }
+    pop_off();
+}
 
-                // Copy filename (with bounds check)
-                int len = strlen(filename);
-                if (len >= MAX_FILENAME) len = MAX_FILENAME - 1;
-                for (int j = 0; j < len; j++) {
-                    inode_table[i].filename[j] = filename[j];
-                }
-                inode_table[i].filename[len] = '\0';
+/**
+ * scheduler_loop - Per-hart idle context
+ * Every hart ends up here after boot, on its boot stack. It runs whatever
+ * it can find locally or steal from other harts, does background work
+ * while there is nothing to run, and waits in wfi once that is done too.
+ */
+void scheduler_loop(void) {
+    while (1) {
+        push_off();
+        Hart *h = this_hart();
+        Process *next = sched_pick_next(h, RANK_IDLE);
+        if (next) {
+            sched_dispatch(h, next);
+            h->prev = NULL;
+            h->current = next;
+            switch_context(&h->idle_sp, &next->sp);
 
-                break;
-            }
+            // A process on this hart had nothing to switch to but us
+            h = this_hart();
+            h->current = NULL;
+            h->cur_rank = RANK_IDLE;
+            sched_finish_switch();
         }
-    }
+        pop_off();
 
-    if (inode_idx == -1) {
-        printf("ERROR: Inode table full\n");
-        return -1;
+        // Nothing to run or do: sleep until an interrupt might change that
+        if (next == NULL && scheduler_idle() == 0) {
+            hart_idle();
+        }
     }
+}
 
-    // Return file descriptor (simplified: just return inode index)
-    return inode_idx;
+/**
+ * process_trap_frame - The TrapFrame at the top of a process's kernel stack
+ * This is where a process's state lives whenever it is in the kernel from
+ * U-mode, and where it resumes from when it first runs.
+ */
+static TrapFrame *process_trap_frame(Process *proc) {
+    return (TrapFrame *)(proc->stack_addr + PAGE_SIZE - TRAP_FRAME_SIZE);
 }
 
 /**
- * fs_close - Close a file
- * Returns 0 on success
+ * setup_process_stack - Initialize a process's kernel stack
+ * The top holds a TrapFrame for entering U-mode, already filled in by the
+ * caller. Below it, the first switch_context() into the process "returns"
+ * to process_trampoline, which restores that frame.
  */
-int fs_close(int fd) {
-    // In this simple implementation, just validate the fd
-    if (fd < 0 || fd >= MAX_INODES || !inode_table[fd].in_use) {
-        return -1;
-    }
-    return 0;
+static void setup_process_stack(Process *proc) {
+    // Allocate space for 13 saved registers (ra + s0-s11), all zero but ra
+    uint64_t *stack_top = (uint64_t *)process_trap_frame(proc) - 13;
+    proc->sp = (uint64_t)stack_top;
+    memset(stack_top, 0, 13 * sizeof(uint64_t));
+    stack_top[0] = (uint64_t)process_trampoline;
 }
 
 /**
- * fs_read - Read from a file
- * Returns number of bytes read
+ * process_free - Undo process_alloc() for a process that never ran
  */
-int fs_read(int fd, char *buf, int count) {
-    if (fd < 0 || fd >= MAX_INODES || !inode_table[fd].in_use) {
-        return -1;
+static void process_free(Process *proc) {
+    if (proc->pagetable) {
+        vm_destroy(proc->pagetable);
     }
-
-    Inode *inode = &inode_table[fd];
-    uint8_t *data = (uint8_t *)inode->data_addr;
-
-    // This is a simplified version that doesn't track offset
-    // For a real implementation, would need FileDescriptor with offset
-    int bytes_to_read = (count < (int)inode->size) ? count : (int)inode->size;
-    for (int i = 0; i < bytes_to_read; i++) {
-        buf[i] = data[i];
+    if (proc->stack_addr) {
+        free_page(proc->stack_addr);
     }
-
-    return bytes_to_read;
+    if (proc->fpstate) {
+        fpstate_free(proc->fpstate);
+    }
+    pcb_free(proc);
 }
 
 /**
- * fs_write - Write to a file
- * Returns number of bytes written
+ * process_alloc - Get a PCB with a kernel stack and an empty address space
+ * Returns NULL if memory ran out.
  */
-int fs_write(int fd, const char *buf, int count) {
-    if (fd < 0 || fd >= MAX_INODES || !inode_table[fd].in_use) {
-        return -1;
+static Process *process_alloc(void) {
+    Process *proc = pcb_alloc();
+    if (proc == NULL) {
+        return NULL;
     }
-
-    Inode *inode = &inode_table[fd];
-    uint8_t *data = (uint8_t *)inode->data_addr;
-
-    // Respect max file size
-    if (count > MAX_FILE_SIZE) {
-        count = MAX_FILE_SIZE;
+    proc->stack_addr = alloc_page_nozero();
+    proc->pagetable = vm_create();
+    if (proc->stack_addr == 0 || proc->pagetable == NULL) {
+        process_free(proc);
+        return NULL;
     }
+    proc->last_hart = -1;
+    proc->fp_hart = -1;
+    proc->vec_hart = -1;
+    return proc;
+}
 
-    for (int i = 0; i < count; i++) {
-        data[i] = buf[i];
+/**
+ * process_start - Give a new process a pid and queue it
+ * Returns the pid: once queued, the process may run and exit on another
+ * hart before the caller looks at it again.
+ */
+static int process_start(Process *proc) {
+    spin_lock(&process_table_lock);
+    int pid = proc->id = next_pid++;
+    proc->all_prev = NULL;
+    proc->all_next = process_table;
+    if (process_table) {
+        process_table->all_prev = proc;
     }
+    process_table = proc;
+    process_count++;
+    spin_unlock(&process_table_lock);
 
-    inode->size = count;
-    return count;
+    proc->state = PROC_READY;
+    sched_enqueue(proc);
+    return pid;
 }
 
 /**
- * fs_unlink - Delete a file
- * Returns 0 on success
+ * process_create - Create a new process running entry() in U-mode
+ * entry must be a user program from user.c. It starts on the user stack
+ * with interrupts enabled and ra = process_return, so returning from it
+ * exits. sched_class is SCHED_RT or SCHED_FAIR, with prio in that class's
+ * range (see common.h). The process is queued on the calling hart and may
+ * be stolen by others. Returns the new PCB, or NULL if the class or
+ * priority is invalid or memory ran out.
  */
-int fs_unlink(const char *filename) {
-    int inode_idx = fs_find_inode(filename);
-    if (inode_idx == -1) {
-        return -1;
+Process *process_create(void (*entry)(void), int sched_class, int prio) {
+    if (!sched_prio_valid(sched_class, prio)) {
+        printf("ERROR: Invalid scheduling class %d / priority %d\n", sched_class, prio);
+        return NULL;
     }
 
-    // Free the data page
-    if (inode_table[inode_idx].data_addr != 0) {
-        free_page(inode_table[inode_idx].data_addr);
+    Process *proc = process_alloc();
+    if (proc == NULL || process_map_image(proc) != 0) {
+        printf("ERROR: Out of memory for a new process\n");
+        if (proc) {
+            process_free(proc);
+        }
+        return NULL;
     }
 
-    // Mark inode as unused
-    inode_table[inode_idx].in_use = 0;
-    inode_table[inode_idx].size = 0;
+    TrapFrame *frame = process_trap_frame(proc);
+    memset(frame, 0, sizeof(TrapFrame));
+    frame->mepc = (uint64_t)entry;
+    // FS and VS start Off, see fpu_trap()
+    frame->mstatus = (read_csr(mstatus) & ~(MSTATUS_MPP | MSTATUS_FS | MSTATUS_VS)) |
+                     MSTATUS_MPP_U | MSTATUS_MPIE;
+    frame->sp = USER_STACK_TOP;
+    frame->ra = (uint64_t)process_return;
+    setup_process_stack(proc);
+    proc->sched_class = sched_class;
+    proc->prio = prio;
 
-    return 0;
+    process_start(proc);
+    return proc;
 }
 
 /**
- * fs_list - List all files in the filesystem
+ * process_fork - Duplicate the calling process (SYS_FORK)
+ * @frame: The caller's full trap frame
+ * The child gets a copy-on-write copy of the address space (vm_fork()),
+ * copies of the descriptors and mappings, the same scheduling class and
+ * priority, and the caller's registers with a0 = 0. It does not inherit
+ * the submission ring. Returns the child's pid, or -1 if memory ran out.
  */
-void fs_list(void) {
-    printf("\n--- File List ---\n");
-    int count = 0;
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (inode_table[i].in_use) {
-            printf("[%d] %s (%d bytes)\n", i, inode_table[i].filename, (int)inode_table[i].size);
-            count++;
+int process_fork(TrapFrame *frame) {
+    Process *cur = current_process();
+    Process *child = process_alloc();
+    uint64_t ring_end = cur->ring ? cur->ring_va + ring_pages(cur->ring_entries) * PAGE_SIZE : 0;
+    if (child == NULL || vm_fork(cur->pagetable, child->pagetable, cur->ring_va, ring_end) != 0 ||
+        fpu_fork(cur, child) != 0) {
+        printf("ERROR: Out of memory to fork process %d\n", cur->id);
+        if (child) {
+            process_free(child);
         }
+        vm_flush_current();
+        return -1;
     }
-    if (count == 0) {
-        printf("(no files)\n");
+    // Our writable pages just became copy-on-write
+    vm_flush_current();
+
+    if (fs_fork(&child->files, &cur->files, child->vmas, cur->vmas) != 0) {
+        printf("ERROR: Out of memory to fork process %d\n", cur->id);
+        process_free(child);
+        return -1;
     }
-    printf("-----------------\n");
-}
+    child->mmap_next = cur->mmap_next;
+    child->sched_class = cur->sched_class;
+    child->prio = cur->prio;
 
-// File system wrapper syscalls
-int sys_open(const char *filename) {
-    return syscall(SYS_OPEN, (uint64_t)filename, 0, 0);
-}
+    // trap_handler moves the parent past the ecall after we return
+    TrapFrame *child_frame = process_trap_frame(child);
+    memcpy(child_frame, frame, sizeof(TrapFrame));
+    child_frame->a0 = 0;
+    child_frame->mepc += 4;
+    child_frame->mstatus &= ~(MSTATUS_FS | MSTATUS_VS);
+    setup_process_stack(child);
 
-int sys_close(int fd) {
-    return syscall(SYS_CLOSE, (uint64_t)fd, 0, 0);
+    return process_start(child);
 }
 
-int sys_read(int fd, char *buf, int count) {
-    return syscall(SYS_READ, (uint64_t)fd, (uint64_t)buf, (uint64_t)count);
-}
+/**
+ * sched_setprio - Change the priority of a process within its class
+ * pid 0 means the calling process. A queued process moves to its new
+ * priority's list straight away; one running on another hart is re-ranked
+ * when its current slice ends. Returns 0, or -1 if there is no such process or prio is out of range.
+ */
+int sched_setprio(int pid, int prio) {
+    Process *cur = current_process();
+    if (pid == 0 && cur != NULL) {
+        pid = cur->id;
+    }
 
-int sys_write(int fd, const char *buf, int count) {
-    return syscall(SYS_WRITE, (uint64_t)fd, (uint64_t)buf, (uint64_t)count);
-}
+    // Holding the table lock keeps the process from being reaped under us
+    spin_lock(&process_table_lock);
+    Process *proc = process_table;
+    while (proc && proc->id != pid) {
+        proc = proc->all_next;
+    }
+    if (proc == NULL || proc->state == PROC_EXITED ||
+        !sched_prio_valid(proc->sched_class, prio)) {
+        spin_unlock(&process_table_lock);
+        return -1;
+    }
+
+    proc->prio = prio;
+    RunQueue *rq = proc->rq;
+    int queued = 0;
+    if (rq) {
+        spin_lock(&rq->lock);
+        if (proc->rq == rq) {
+            if (proc->rq_prio != prio) {
+                runqueue_remove_locked(rq, proc);
+                runqueue_insert_locked(rq, proc);
+            }
+            queued = 1;
+        }
+        spin_unlock(&rq->lock);
+    }
+    spin_unlock(&process_table_lock);
 
-int sys_unlink(const char *filename) {
-    return syscall(SYS_UNLINK, (uint64_t)filename, 0, 0);
+    if (queued) {
+        sched_kick(sched_rank(proc));
+    } else if (proc == cur) {
+        // We may have dropped below something that is queued
+        ipi_send(hart_id());
+    }
+    return 0;
 }
 
-void sys_list(void) {
-    syscall(SYS_LIST, 0, 0, 0);
+/**
+ * sched_print_stats - Print dispatch latency per scheduling class
+ */
+void sched_print_stats(void) {
+    static const char *names[SCHED_NCLASSES] = { "fair", "rt" };
+    for (int c = 0; c < SCHED_NCLASSES; c++) {
+        uint64_t dispatches = 0, total = 0, max = 0;
+        for (int i = 0; i < MAX_HARTS; i++) {
+            SchedStats *st = &harts[i].sched_stats[c];
+            dispatches += st->dispatches;
+            total += st->total_ticks;
+            if (st->max_ticks > max) {
+                max = st->max_ticks;
+            }
+        }
+        uint64_t avg_us = dispatches ? total * 1000000 / timebase_hz / dispatches : 0;
+        printf("Sched %s: %d dispatches, latency avg %d us, max %d us\n",
+               names[c], dispatches, avg_us, max * 1000000 / timebase_hz);
+    }
 }
 
 // ============================================================================
-// Memory Management - Page Allocator
+// Submission Rings - Batched File Syscalls
 // ============================================================================
+// A process registers one ring with SYS_RING_SETUP, fills submission
+// entries (RingSqe) and publishes them by advancing sq_tail, then asks the
+// kernel to run up to N of them with a single SYS_SUBMIT. Each entry is
+// passed to the ordinary fs_* function and its result lands in a
+// completion entry (RingCqe), so the trap cost is paid once per batch.
 
-#define PAGE_SIZE 4096
-#define KERNEL_BASE 0x80000000
-#define RAM_SIZE (128 * 1024 * 1024)  // 128MB (QEMU default)
-
-/**
- * Page structure - Each free page acts as a linked list node.
- * We store the "next" pointer in the first 8 bytes of each page.
- */
-typedef struct page {
-    struct page *next;
-} Page;
-
-/**
- * Global page allocator state
- */
-static Page *free_page_list = NULL;
-static uint64_t total_pages = 0;
-static uint64_t free_pages = 0;
+#define RING_MAX_ENTRIES 256
 
 /**
- * pages_init - Initialize the page allocator
- * Sets up a linked list of all free pages in RAM
+ * ring_pages - Pages backing a ring of the given size
  */
-void pages_init(void) {
-    // Calculate the end of the kernel image
-    extern uint8_t __kernel_end;
-    uint64_t kernel_end = (uint64_t)&__kernel_end;
-
-    // Align kernel_end up to the next page boundary
-    uint64_t free_mem_start = align_up(kernel_end, PAGE_SIZE);
-
-    // Calculate total available memory
-    uint64_t ram_end = KERNEL_BASE + RAM_SIZE;
-    total_pages = (ram_end - free_mem_start) / PAGE_SIZE;
-    free_pages = total_pages;
-
-    printf("\n--- Memory Manager Initialized ---\n");
-    printf("Kernel end:    0x%x\n", kernel_end);
-    printf("Free mem:      0x%x\n", free_mem_start);
-    printf("RAM end:       0x%x\n", ram_end);
-    printf("Total pages:   %d KB\n", total_pages);
-
-    // Build the linked list of free pages
-    // Start from the first free page and link them all together
-    Page *current = (Page *)free_mem_start;
-    free_page_list = current;
-
-    for (uint64_t i = 0; i < total_pages - 1; i++) {
-        Page *next = (Page *)((uint64_t)current + PAGE_SIZE);
-        current->next = next;
-        current = next;
-    }
-
-    // Last page has no next
-    current->next = NULL;
+static uint64_t ring_pages(uint32_t entries) {
+    uint64_t bytes = sizeof(Ring) + entries * (sizeof(RingSqe) + sizeof(RingCqe));
+    return (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
 }
 
 /**
- * alloc_page - Allocate a single 4KB page
- * Returns the physical address of the allocated page, or 0 on failure
+ * ring_setup - Give the calling process a submission ring
+ * entries must be a power of two up to RING_MAX_ENTRIES. The header and
+ * both arrays share one contiguous zeroed run from alloc_pages(), mapped
+ * into the process; the kernel keeps using the physical address. A process
+ * has at most one ring, freed when it exits. Returns the ring's user
+ * address, or 0.
  */
-uint64_t alloc_page(void) {
-    if (free_page_list == NULL) {
-        printf("ERROR: Out of memory! No free pages.\n");
+uint64_t ring_setup(uint32_t entries) {
+    Process *cur = current_process();
+    if (cur == NULL || cur->ring != NULL) {
+        return 0;
+    }
+    if (entries == 0 || entries > RING_MAX_ENTRIES || (entries & (entries - 1)) != 0) {
+        printf("ERROR: Ring size %d is not a power of two up to %d\n", entries, RING_MAX_ENTRIES);
         return 0;
     }
 
-    Page *page = free_page_list;
-    free_page_list = page->next;
-    free_pages--;
-
-    // Zero-fill the page
-    uint8_t *p = (uint8_t *)page;
-    for (int i = 0; i < PAGE_SIZE; i++) {
-        p[i] = 0;
+    uint64_t bytes = ring_pages(entries) * PAGE_SIZE;
+    uint64_t va = vm_alloc_va(bytes);
+    uint64_t addr = va ? alloc_pages(ring_pages(entries)) : 0;
+    if (addr == 0) {
+        printf("ERROR: Out of memory for a %d-entry ring\n", entries);
+        return 0;
+    }
+    if (vm_map(cur->pagetable, va, addr, bytes, PTE_U | PTE_R | PTE_W) != 0) {
+        vm_unmap(cur->pagetable, va, bytes);
+        free_pages(addr, ring_pages(entries));
+        return 0;
     }
+    vm_flush_current();
 
-    return (uint64_t)page;
+    Ring *ring = (Ring *)addr;
+    ring->entries = entries;
+    ring->sqes = (RingSqe *)(va + sizeof(Ring));
+    ring->cqes = (RingCqe *)(va + sizeof(Ring) + entries * sizeof(RingSqe));
+    cur->ring = ring;
+    cur->ring_va = va;
+    cur->ring_entries = entries;
+    return va;
 }
 
 /**
- * free_page - Return a page to the free list
- * Takes the physical address of the page to free
+ * ring_release - Free an exiting process's ring
+ * Its mapping goes with the address space.
  */
-void free_page(uint64_t page_addr) {
-    if (page_addr == 0) {
-        printf("ERROR: Attempted to free NULL page.\n");
-        return;
+static void ring_release(Process *proc) {
+    if (proc->ring) {
+        free_pages((uint64_t)proc->ring, ring_pages(proc->ring_entries));
+        proc->ring = NULL;
     }
-
-    Page *page = (Page *)page_addr;
-    page->next = free_page_list;
-    free_page_list = page;
-    free_pages++;
 }
 
 /**
- * alloc_pages - Allocate multiple contiguous pages
- * Note: This is a simple implementation that returns individual pages.
- * For true contiguous allocation, a more sophisticated allocator is needed.
+ * ring_execute - Run one submission entry, returning its result
  */
-uint64_t alloc_pages(uint64_t count) {
-    if (count == 1) {
-        return alloc_page();
+static int64_t ring_execute(const RingSqe *sqe) {
+    char name[MAX_FILENAME];
+    switch (sqe->opcode) {
+        case RING_OP_NOP:
+            return 0;
+        case RING_OP_OPEN:
+            if (fetch_filename(name, sqe->addr) != 0) {
+                return -1;
+            }
+            return fs_open(name, (int)sqe->flags);
+        case RING_OP_CLOSE:
+            return fs_close(sqe->fd);
+        case RING_OP_READ:
+            return fs_read(sqe->fd, (char *)sqe->addr, (int)sqe->len);
+        case RING_OP_WRITE:
+            return fs_write(sqe->fd, (const char *)sqe->addr, (int)sqe->len);
+        case RING_OP_UNLINK:
+            if (fetch_filename(name, sqe->addr) != 0) {
+                return -1;
+            }
+            return fs_unlink(name);
+        case RING_OP_PREAD:
+            return fs_pread(sqe->fd, (char *)sqe->addr, (int)sqe->len, sqe->offset);
+        case RING_OP_PWRITE:
+            return fs_pwrite(sqe->fd, (const char *)sqe->addr, (int)sqe->len, sqe->offset);
+        default:
+            return -1;
     }
-
-    // For now, just allocate the first page and warn
-    printf("WARNING: alloc_pages(%d) requested, but returning only 1 page.\n", count);
-    return alloc_page();
 }
 
 /**
- * mem_test - Simple test to verify page allocator is working
+ * ring_submit - Run up to count queued submissions of the calling process
+ * Entries run in order; each one's user_data and result go to the next
+ * completion slot. Stops early when the submission ring is empty or the
+ * completion ring is full. Returns the number of entries consumed, or -1
+ * if the process has no ring.
  */
-void mem_test(void) {
-    printf("\n--- Testing Page Allocator ---\n");
-
-    // Allocate a page
-    uint64_t page1 = alloc_page();
-    if (page1 == 0) {
-        printf("FAIL: Could not allocate first page\n");
-        return;
+int ring_submit(uint32_t count) {
+    Process *cur = current_process();
+    if (cur == NULL || cur->ring == NULL) {
+        return -1;
     }
-    printf("Allocated page 1: 0x%x\n", page1);
-    printf("Free pages now: %d\n", free_pages);
-
-    // Write a test value
-    uint64_t *test_ptr = (uint64_t *)page1;
-    *test_ptr = 0xDEADBEEF;
 
-    // Allocate another page
-    uint64_t page2 = alloc_page();
-    if (page2 == 0) {
-        printf("FAIL: Could not allocate second page\n");
-        return;
-    }
-    printf("Allocated page 2: 0x%x\n", page2);
-    printf("Free pages now: %d\n", free_pages);
+    // The arrays are found from the kernel's own address and entry count,
+    // since ring->sqes/cqes are the process's (and it can overwrite them)
+    Ring *ring = cur->ring;
+    RingSqe *sqes = (RingSqe *)((uint64_t)ring + sizeof(Ring));
+    RingCqe *cqes = (RingCqe *)(sqes + cur->ring_entries);
+    uint32_t mask = cur->ring_entries - 1;
+    uint32_t sq_head = ring->sq_head;
+    uint32_t cq_tail = ring->cq_tail;
+    uint32_t sq_tail = ring->sq_tail;
+    __sync_synchronize();           // Read the entries only after sq_tail
 
-    // Verify first page still has our value
-    if (*test_ptr == 0xDEADBEEF) {
-        printf("PASS: Page 1 still contains our test value\n");
-    } else {
-        printf("FAIL: Page 1 value was corrupted\n");
+    uint32_t done = 0;
+    while (done < count && sq_head != sq_tail && cq_tail - ring->cq_head <= mask) {
+        const RingSqe *sqe = &sqes[sq_head & mask];
+        RingCqe *cqe = &cqes[cq_tail & mask];
+        cqe->user_data = sqe->user_data;
+        cqe->result = ring_execute(sqe);
+        sq_head++;
+        cq_tail++;
+        done++;
     }
 
-    // Free the pages
-    free_page(page2);
-    printf("Freed page 2, free pages now: %d\n", free_pages);
-
-    free_page(page1);
-    printf("Freed page 1, free pages now: %d\n", free_pages);
+    __sync_synchronize();           // Completions are visible before cq_tail
+    ring->sq_head = sq_head;
+    ring->cq_tail = cq_tail;
+    return done;
 }
 
+#ifdef BENCH
 // ============================================================================
-// Process Management - Cooperative Multitasking
+// Benchmarks - make bench
 // ============================================================================
+// The bench image runs these in kernel_main instead of the demo processes,
+// then starts bench_main() (user.c) for the parts that need U-mode, and
+// powers off once every process has exited. Each result is one line:
+//     BENCH name=<name> arg=<size or count> iters=<n> cycles_per_op=<c>
+// so runs can be compared with grep. Cycle counts come from mcycle; under
+// QEMU they track instructions retired rather than real time.
 
-/**
- * Process Control Block (PCB)
- * Each process has its own stack and state
- */
-typedef struct {
-    uint64_t sp;         // Stack pointer
-    uint64_t stack_addr; // Base address of the process's stack
-    int id;              // Process ID
-} Process;
-
-#define MAX_PROCESSES 2
-static Process processes[MAX_PROCESSES];
-static int current_process = 0;
+#define BENCH_PAGE_ITERS   4096
+#define BENCH_PAGE_BATCH   512
+#define BENCH_LOOKUP_ITERS 4096
 
-/**
- * switch_context - Context switch assembly function
- * Implemented in boot.S
- */
-extern void switch_context(uint64_t *current_sp_ptr, uint64_t *next_sp_ptr);
+static uint64_t bench_pages[BENCH_PAGE_BATCH];
 
 /**
- * start_scheduler - Bootstrap into the first process
- * Implemented in boot.S
+ * bench_report - Print one result line
  */
-extern void start_scheduler(uint64_t *process_sp_ptr);
+static void bench_report(const char *name, uint64_t arg, uint64_t iters, uint64_t cycles) {
+    printf("BENCH name=%s arg=%u iters=%u cycles_per_op=%u\n", name, arg, iters, cycles / iters);
+}
 
 /**
- * yield - Voluntarily give up the CPU to the next process
+ * bench_alloc_page - alloc_page()/free_page() pairs, then batches deep
+ * enough to go through the shared pools and the buddy allocator
  */
-void yield(void) {
-    int next_process = (current_process + 1) % MAX_PROCESSES;
-
-    // Call assembly function to switch context
-    switch_context(&processes[current_process].sp, &processes[next_process].sp);
+static void bench_alloc_page(void) {
+    uint64_t start = read_csr(mcycle);
+    for (int i = 0; i < BENCH_PAGE_ITERS; i++) {
+        free_page(alloc_page());
+    }
+    bench_report("alloc_free_page", 1, BENCH_PAGE_ITERS, read_csr(mcycle) - start);
 
-    // Update the current process ID
-    current_process = next_process;
+    start = read_csr(mcycle);
+    for (int i = 0; i < BENCH_PAGE_BATCH; i++) {
+        bench_pages[i] = alloc_page();
+    }
+    for (int i = 0; i < BENCH_PAGE_BATCH; i++) {
+        free_page(bench_pages[i]);
+    }
+    bench_report("alloc_free_page_batch", BENCH_PAGE_BATCH, BENCH_PAGE_BATCH,
+                 read_csr(mcycle) - start);
 }
 
 /**
- * setup_process_stack - Initialize a process's stack
+ * bench_kmalloc - kmalloc()/kfree() pairs at a few sizes
  */
-void setup_process_stack(int proc_id, void (*entry_point)(void)) {
-    Process *proc = &processes[proc_id];
-
-    // The stack needs space for the saved registers
-    uint64_t *stack_top = (uint64_t *)(proc->stack_addr + PAGE_SIZE);
-
-    // Allocate space for 13 saved registers (ra + s0-s11)
-    stack_top -= 13;
-    proc->sp = (uint64_t)stack_top;
+static void bench_kmalloc(void) {
+    static const int sizes[] = { 32, 256, KMALLOC_MAX };
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        uint64_t start = read_csr(mcycle);
+        for (int i = 0; i < BENCH_PAGE_ITERS; i++) {
+            kfree(kmalloc(sizes[s]));
+        }
+        bench_report("kmalloc_kfree", sizes[s], BENCH_PAGE_ITERS, read_csr(mcycle) - start);
+    }
+}
 
-    // Set the return address (ra) to point to the entry function
-    stack_top[0] = (uint64_t)entry_point;
+#if CONFIG_FS
+static char bench_names[MAX_INODES][16];
 
-    // Initialize saved registers to 0
-    for (int i = 1; i < 13; i++) {
-        stack_top[i] = 0;
+/**
+ * bench_name - Write "bench<i>" into bench_names[i]
+ */
+static void bench_name(int i) {
+    char *name = bench_names[i];
+    char digits[8];
+    int len = 0;
+    do {
+        digits[len++] = '0' + i % 10;
+        i /= 10;
+    } while (i > 0);
+    memcpy(name, "bench", 5);
+    name += 5;
+    while (len > 0) {
+        *name++ = digits[--len];
     }
+    *name = '\0';
 }
 
 /**
- * Process A - increments counter and yields via system calls
+ * bench_fs_lookup - Filename lookups with 16, 256 and MAX_INODES files
+ * Times fs_find_inode(), the lock-free lookup behind fs_open(): there is no process
+ * yet to hold a descriptor. Every file is removed again afterwards.
  */
-int counter_a = 0;
-void process_a(void) {
-    static int done = 0;
-    while (1) {
-        // Set current_process ID when process A is running
-        current_process = 0;
-
-        if (!done) {
-            // First iteration: create and write to a file
-            sys_puts("\nProcess A: Creating file_a.txt...\n");
-            int fd = fs_open("file_a.txt");
-            if (fd >= 0) {
-                const char *data = "Hello from Process A!";
-                fs_write(fd, data, strlen(data));
-                sys_puts("Process A: Wrote to file_a.txt\n");
-                fs_close(fd);
+static void bench_fs_lookup(void) {
+    static const int counts[] = { 16, 256, MAX_INODES };
+    int files = 0;
+    for (int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++) {
+        spin_lock(&fs_lock);
+        while (files < counts[c]) {
+            bench_name(files);
+            if (fs_lookup_or_create(bench_names[files]) < 0) {
+                break;
             }
+            files++;
+        }
+        spin_unlock(&fs_lock);
 
-            // List files
-            fs_list();
-            done = 1;
+        uint64_t start = read_csr(mcycle);
+        for (int i = 0; i < BENCH_LOOKUP_ITERS; i++) {
+            if (fs_find_inode(bench_names[i % files]) < 0) {
+                printf("ERROR: bench file %s not found\n", bench_names[i % files]);
+            }
         }
+        uint64_t cycles = read_csr(mcycle) - start;
+        bench_report("fs_lookup", files, BENCH_LOOKUP_ITERS, cycles);
+    }
 
-        sys_yield();
+    for (int i = 0; i < files; i++) {
+        fs_unlink(bench_names[i]);
     }
 }
+#endif
 
 /**
- * Process B - reads from file and creates its own file
+ * bench_init - Run the kernel-side benchmarks and start bench_main()
  */
-void process_b(void) {
-    static int done = 0;
-    while (1) {
-        // Set current_process ID when process B is running
-        current_process = 1;
-
-        if (!done) {
-            // First iteration: read file created by Process A
-            sys_puts("\nProcess B: Opening file_a.txt...\n");
-            int fd = fs_open("file_a.txt");
-            if (fd >= 0) {
-                char buf[256];
-                int bytes = fs_read(fd, buf, sizeof(buf));
-                if (bytes > 0) {
-                    buf[bytes] = '\0';
-                    printf("Process B: Read from file_a.txt: '%s'\n", buf);
-                }
-                fs_close(fd);
-            }
-
-            // Create our own file
-            sys_puts("Process B: Creating file_b.txt...\n");
-            fd = fs_open("file_b.txt");
-            if (fd >= 0) {
-                const char *data = "Data from Process B";
-                fs_write(fd, data, strlen(data));
-                sys_puts("Process B: Wrote to file_b.txt\n");
-                fs_close(fd);
-            }
-
-            // List files again
-            fs_list();
-            done = 1;
-        }
+void bench_init(void) {
+    printf("\n--- Benchmarks ---\n");
+    bench_alloc_page();
+    bench_kmalloc();
+#if CONFIG_FS
+    bench_fs_lookup();
+#endif
 
-        sys_yield();
+    if (process_create(bench_main, SCHED_FAIR, 1) == NULL) {
+        panic("Failed to create the benchmark process");
     }
 }
+#endif
+
+// ============================================================================
+// Demo Processes and Boot
+// ============================================================================
 
 /**
  * processes_init - Initialize process management
  */
 void processes_init(void) {
-    printf("\n--- Initializing Process Manager ---\n");
+    pr_debug("\n--- Initializing Process Manager ---\n");
+
+    // Both start on the boot hart's queue; idle harts steal from it
+    Process *proc_a = process_create(process_a, SCHED_FAIR, 1);
+    if (proc_a == NULL) {
+        panic("Failed to create Process A");
+    }
+    pr_debug("Created Process A (pid %d): stack at 0x%x\n", proc_a->id, proc_a->stack_addr);
 
-    // Create Process A
-    processes[0].id = 0;
-    processes[0].stack_addr = alloc_page();
-    if (processes[0].stack_addr == 0) {
-        panic("Failed to allocate stack for Process A");
+    Process *proc_b = process_create(process_b, SCHED_FAIR, 1);
+    if (proc_b == NULL) {
+        panic("Failed to create Process B");
     }
-    setup_process_stack(0, process_a);
-    printf("Created Process A at 0x%x: stack at 0x%x\n", processes[0].stack_addr, process_a);
+    pr_debug("Created Process B (pid %d): stack at 0x%x\n", proc_b->id, proc_b->stack_addr);
 
-    // Create Process B
-    processes[1].id = 1;
-    processes[1].stack_addr = alloc_page();
-    if (processes[1].stack_addr == 0) {
-        panic("Failed to allocate stack for Process B");
+    // Only worth running with something to write back to
+    if (vblk_present()) {
+        Process *writeback = process_create(writeback_main, SCHED_FAIR, 1);
+        if (writeback == NULL) {
+            panic("Failed to create the writeback process");
+        }
+        pr_debug("Created writeback (pid %d)\n", writeback->id);
     }
-    setup_process_stack(1, process_b);
-    printf("Created Process B at 0x%x: stack at 0x%x\n", processes[1].stack_addr, process_b);
 
-    current_process = 0;
-    printf("Process Manager ready. Starting scheduler...\n\n");
+    pr_debug("Process Manager ready. Starting scheduler...\n\n");
+}
+
+/**
+ * secondary_main - C entry point for every hart except hart 0
+ * boot.S holds these harts back until the boot hart sets boot_release.
+ */
+void secondary_main(uint64_t hartid) {
+    hart_init(hartid);
+    mem_routines_init_hart();
+    trap_init_hart();
+    vm_init_hart();
+    timer_init_hart();
+    plic_init_hart();
+    pr_debug("Hart %d online\n", hartid);
+
+    scheduler_loop();
 }
 
-void kernel_main(void) {
+void kernel_main(uint64_t hartid, uint64_t dtb_addr) {
     // Clear BSS section (zero-initialize global variables)
     clear_bss();
+    hart_init(hartid);
+    uart_init();
 
     printf("\n");
     printf("================================\n");
     printf("RISC-V SimpleOS - Boot Sequence\n");
     printf("================================\n");
-    printf("Kernel loaded at address: 0x%x\n", 0x80000000);
-    printf("Test Math: 10 + 20 = %d\n", 10 + 20);
-    printf("Test Hex:  255 = 0x%x\n", 255);
+    pr_debug("Kernel loaded at address: 0x%x (hart %d)\n", 0x80000000, hartid);
+    pr_debug("Test Math: 10 + 20 = %d\n", 10 + 20);
+    pr_debug("Test Hex:  255 = 0x%x\n", 255);
+
+    mem_routines_init();
 
-    printf("\n[1] Initializing trap handling...\n");
+    pr_debug("\n[1] Initializing trap handling...\n");
     trap_init();
 
-    printf("\n[2] Initializing memory manager...\n");
+    pr_debug("\n[2] Initializing memory manager...\n");
+    if (fdt_init(dtb_addr) != 0) {
+        printf("WARNING: No device tree at 0x%x\n", dtb_addr);
+    }
     pages_init();
+    vm_init();
+    fpu_init();
+
+    timer_init();
+    plic_init();
 
-    printf("\n[3] Initializing process manager...\n");
+    pr_debug("\n[3] Initializing file system...\n");
+    fs_init();
+    vblk_init();
+    fs_load();
+
+    pr_debug("\n[4] Initializing process manager...\n");
+#ifdef BENCH
+    bench_init();
+#else
     processes_init();
+#endif
 
-    printf("[4] Starting scheduler...\n");
+    pr_debug("[5] Starting scheduler...\n");
     printf("================================\n\n");
 
-    // Bootstrap into the first process using its pre-initialized stack
-    // This jumps directly into process_a using the stack frame we set up
-    start_scheduler(&processes[0].sp);
+    // Let the other harts in; they will steal work from our run queue
+    __sync_synchronize();
+    boot_release = 1;
+
+    // Become this hart's idle context and start running processes
+    scheduler_loop();
 
     // Should never reach here
     panic("kernel_main returned!");
@@ -0,0 +1,29 @@
+#pragma once
+
+// System call numbers, shared by common.h and boot.S (the ecall fast path
+// bounds-checks a7 against NR_SYSCALLS), so only plain #defines belong here
+
+#define SYS_NULL   0        // Does nothing; measures the ecall round trip
+#define SYS_PUTS   1
+#define SYS_YIELD  2
+#define SYS_OPEN   3
+#define SYS_CLOSE  4
+#define SYS_READ   5
+#define SYS_WRITE  6
+#define SYS_UNLINK 7
+#define SYS_LIST   8
+#define SYS_SETPRIO 9
+#define SYS_RING_SETUP 10
+#define SYS_SUBMIT 11
+#define SYS_PREAD  12
+#define SYS_PWRITE 13
+#define SYS_LSEEK  14
+#define SYS_MMAP   15
+#define SYS_MUNMAP 16
+#define SYS_EXIT   17
+#define SYS_FORK   18       // Always takes the full-save trap path
+#define SYS_STATS  19       // Dump kernel counters (see kstat_print())
+#define SYS_SLEEP  20       // Sleep for a number of timer ticks
+#define SYS_PIPE   21       // Create a pipe: fds[0] reads, fds[1] writes
+#define SYS_SYNC   22       // Write changed files to disk (see fs_sync())
+#define NR_SYSCALLS 23      // Size of syscall_table
@@ -0,0 +1,468 @@
+#include "common.h"
+
+// ============================================================================
+// User Programs - Run in U-mode
+// ============================================================================
+// Everything in this file is linked into the .user_* sections (kernel.ld)
+// and mapped into each process's address space by process_map_image();
+// none of the kernel is. So this code may only reach the kernel through
+// ecall: no printf, no kernel strlen, and nothing that makes the compiler
+// emit a memcpy/memset call (large struct copies or array initializers).
+
+/**
+ * str_len - Length of a string (user-side copy of strlen)
+ */
+static size_t str_len(const char *s) {
+    size_t len = 0;
+    while (*s++) {
+        len++;
+    }
+    return len;
+}
+
+/**
+ * fmt_dec - Format an unsigned number at the end of buf[21]
+ * Returns where the NUL-terminated digits start.
+ */
+static char *fmt_dec(char buf[21], uint64_t value) {
+    int i = 20;
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    return &buf[i];
+}
+
+/**
+ * put_dec - Print an unsigned number through SYS_PUTS
+ */
+static void put_dec(uint64_t value) {
+    char buf[21];
+    sys_puts(fmt_dec(buf, value));
+}
+
+/**
+ * sys_exit - System call to terminate the calling process
+ */
+void sys_exit(void) {
+    syscall(SYS_EXIT, 0, 0, 0);
+}
+
+/**
+ * sys_fork - System call to duplicate the calling process
+ * The child shares our memory copy-on-write. Returns the child's pid in
+ * the parent, 0 in the child, or -1 on failure.
+ */
+int sys_fork(void) {
+    return syscall(SYS_FORK, 0, 0, 0);
+}
+
+/**
+ * process_return - Where a process's entry function returns to
+ * setup_process_stack() puts this in the initial ra.
+ */
+void process_return(void) {
+    sys_exit();
+}
+
+/**
+ * sys_puts - System call to print a string
+ * Invokes the SYS_PUTS syscall via ecall instruction
+ */
+void sys_puts(const char *s) {
+    syscall(SYS_PUTS, (uint64_t)s, 0, 0);
+}
+
+/**
+ * sys_yield - System call to yield control to next process
+ * Invokes the SYS_YIELD syscall via ecall instruction
+ */
+void sys_yield(void) {
+    syscall(SYS_YIELD, 0, 0, 0);
+}
+
+/**
+ * sys_sleep - System call to sleep for at least ticks timer ticks
+ */
+int sys_sleep(uint64_t ticks) {
+    return syscall(SYS_SLEEP, ticks, 0, 0);
+}
+
+/**
+ * sys_pipe - System call to create a pipe
+ * fds[0] becomes the read end and fds[1] the write end. flags is 0 or
+ * PIPE_FLIP. Returns 0 or -1.
+ */
+int sys_pipe(int fds[2], int flags) {
+    return syscall(SYS_PIPE, (uint64_t)fds, (uint64_t)flags, 0);
+}
+
+/**
+ * sys_sync - System call to write changed files to disk
+ * Returns the number of file pages written, or -1 without a disk.
+ */
+int sys_sync(void) {
+    return syscall(SYS_SYNC, 0, 0, 0);
+}
+
+/**
+ * syscall_bench - Print the average null-syscall round trip in cycles
+ * Build with CONFIG_SYSCALL_SLOW_PATH=y to compare against the full-save path.
+ * Uses rdcycle, which mcounteren opens to U-mode (see vm_init_hart()).
+ */
+void syscall_bench(void) {
+    const uint64_t iterations = 1000;
+    uint64_t start, end;
+    syscall(SYS_NULL, 0, 0, 0);
+    asm volatile("rdcycle %0" : "=r"(start));
+    for (uint64_t i = 0; i < iterations; i++) {
+        syscall(SYS_NULL, 0, 0, 0);
+    }
+    asm volatile("rdcycle %0" : "=r"(end));
+#if CONFIG_SYSCALL_SLOW_PATH
+    const char *path = "full-save";
+#else
+    const char *path = "fast";
+#endif
+    sys_puts("Null syscall: ");
+    put_dec((end - start) / iterations);
+    sys_puts(" cycles per round trip (");
+    sys_puts(path);
+    sys_puts(" path)\n");
+}
+
+/**
+ * sys_setprio - System call to change a process's priority (pid 0 = self)
+ */
+int sys_setprio(int pid, int prio) {
+    return syscall(SYS_SETPRIO, (uint64_t)pid, (uint64_t)prio, 0);
+}
+
+// File system wrapper syscalls
+int sys_open(const char *filename, int flags) {
+    return syscall(SYS_OPEN, (uint64_t)filename, (uint64_t)flags, 0);
+}
+
+int sys_close(int fd) {
+    return syscall(SYS_CLOSE, (uint64_t)fd, 0, 0);
+}
+
+int sys_read(int fd, char *buf, int count) {
+    return syscall(SYS_READ, (uint64_t)fd, (uint64_t)buf, (uint64_t)count);
+}
+
+int sys_write(int fd, const char *buf, int count) {
+    return syscall(SYS_WRITE, (uint64_t)fd, (uint64_t)buf, (uint64_t)count);
+}
+
+int sys_unlink(const char *filename) {
+    return syscall(SYS_UNLINK, (uint64_t)filename, 0, 0);
+}
+
+void sys_list(void) {
+    syscall(SYS_LIST, 0, 0, 0);
+}
+
+int sys_pread(int fd, char *buf, int count, uint64_t offset) {
+    return syscall6(SYS_PREAD, (uint64_t)fd, (uint64_t)buf, (uint64_t)count, offset, 0, 0);
+}
+
+int sys_pwrite(int fd, const char *buf, int count, uint64_t offset) {
+    return syscall6(SYS_PWRITE, (uint64_t)fd, (uint64_t)buf, (uint64_t)count, offset, 0, 0);
+}
+
+int64_t sys_lseek(int fd, int64_t offset, int whence) {
+    return syscall(SYS_LSEEK, (uint64_t)fd, (uint64_t)offset, (uint64_t)whence);
+}
+
+// addr is only a hint, and currently ignored
+void *sys_mmap(void *addr, uint64_t length, int prot, int flags, int fd, uint64_t offset) {
+    return (void *)syscall6(SYS_MMAP, (uint64_t)addr, length, (uint64_t)prot, (uint64_t)flags,
+                            (uint64_t)fd, offset);
+}
+
+int sys_munmap(void *addr, uint64_t length) {
+    return syscall(SYS_MUNMAP, (uint64_t)addr, length, 0);
+}
+
+/**
+ * sys_stats - System call to print the kernel's counters (see kstat_print())
+ */
+void sys_stats(void) {
+    syscall(SYS_STATS, 0, 0, 0);
+}
+
+// Submission ring syscalls, see ring_setup() / ring_submit()
+Ring *sys_ring_setup(uint32_t entries) {
+    return (Ring *)syscall(SYS_RING_SETUP, entries, 0, 0);
+}
+
+int sys_submit(uint32_t count) {
+    return syscall(SYS_SUBMIT, count, 0, 0);
+}
+
+// ============================================================================
+// Demo Processes
+// ============================================================================
+
+/**
+ * Process A - benchmarks the syscall path, then writes file_a.txt
+ */
+int counter_a = 0;
+void process_a(void) {
+    syscall_bench();
+
+    // Give B time to block on the file before there is anything to read
+    sys_sleep(5);
+    sys_puts("\nProcess A: Creating file_a.txt...\n");
+    int fd = sys_open("file_a.txt", 0);
+    if (fd >= 0) {
+        const char *data = "Hello from Process A!";
+        sys_write(fd, data, str_len(data));
+        sys_puts("Process A: Wrote to file_a.txt\n");
+        sys_close(fd);
+    }
+
+    // List files
+    sys_list();
+
+    // Spawn a worker that shares our pages until one of us writes, and
+    // feed it through a pipe; its read sleeps until our write arrives
+    int fds[2];
+    if (sys_pipe(fds, 0) != 0) {
+        return;
+    }
+    if (sys_fork() == 0) {
+        sys_close(fds[1]);
+        char buf[64];
+        int bytes;
+        while ((bytes = sys_read(fds[0], buf, sizeof(buf) - 1)) > 0) {
+            buf[bytes] = '\0';
+            sys_puts("Process A: forked worker got '");
+            sys_puts(buf);
+            sys_puts("'\n");
+        }
+        sys_close(fds[0]);
+        return;
+    }
+    sys_close(fds[0]);
+    const char *msg = "work item over a pipe";
+    sys_write(fds[1], msg, str_len(msg));
+    sys_close(fds[1]);
+}
+
+/**
+ * Process B - reads from file and creates its own file
+ */
+void process_b(void) {
+    // A may not have written file_a.txt yet; O_BLOCK waits for it
+    sys_puts("\nProcess B: Opening file_a.txt...\n");
+    int fd = sys_open("file_a.txt", O_BLOCK);
+    if (fd >= 0) {
+        char buf[256];
+        int bytes = sys_read(fd, buf, sizeof(buf) - 1);
+        if (bytes > 0) {
+            buf[bytes] = '\0';
+            sys_puts("Process B: Read from file_a.txt: '");
+            sys_puts(buf);
+            sys_puts("'\n");
+        }
+        sys_close(fd);
+    }
+
+    // Create our own file
+    sys_puts("Process B: Creating file_b.txt...\n");
+    fd = sys_open("file_b.txt", 0);
+    if (fd >= 0) {
+        const char *data = "Data from Process B";
+        sys_write(fd, data, str_len(data));
+        sys_puts("Process B: Wrote to file_b.txt\n");
+        sys_close(fd);
+    }
+
+    // Count boots in a file; it only survives a reset with a disk. O_SYNC:
+    // the write returns once the new count is committed
+    fd = sys_open("boots.txt", O_SYNC);
+    if (fd >= 0) {
+        char buf[21];
+        int bytes = sys_pread(fd, buf, sizeof(buf) - 1, 0);
+        uint64_t boots = 0;
+        for (int i = 0; i < bytes && buf[i] >= '0' && buf[i] <= '9'; i++) {
+            boots = boots * 10 + (buf[i] - '0');
+        }
+        char *digits = fmt_dec(buf, boots + 1);
+        sys_pwrite(fd, digits, str_len(digits), 0);
+        sys_close(fd);
+        sys_puts("Process B: boot number ");
+        sys_puts(digits);
+        sys_puts("\n");
+    }
+
+    // List files again
+    sys_list();
+    sys_stats();
+}
+
+/**
+ * writeback_main - Write changed files to disk every 100 ticks
+ * Started by processes_init() when there is a disk.
+ */
+void writeback_main(void) {
+    for (;;) {
+        sys_sleep(100);
+        if (sys_sync() < 0) {
+            sys_puts("writeback: sync failed\n");
+        }
+    }
+}
+
+#ifdef BENCH
+// ============================================================================
+// Benchmarks - make bench
+// ============================================================================
+// The parts of the benchmark suite that need a process, started by
+// bench_init() (kernel.c). Results use the same line format as the kernel's.
+
+#define BENCH_ECALL_ITERS 4096
+#define BENCH_YIELD_ITERS 1024
+#define BENCH_IO_BYTES    (1024 * 1024)     // Moved per size in the read/write benchmarks
+#define BENCH_IO_MAX      (64 * 1024)
+
+// Page-aligned so the PIPE_FLIP benchmark can flip it
+static char bench_buf[BENCH_IO_MAX] __attribute__((aligned(PAGE_SIZE)));
+
+/**
+ * rdcycle - Read the cycle counter (opened to U-mode by vm_init_hart())
+ */
+static uint64_t rdcycle(void) {
+    uint64_t cycles;
+    asm volatile("rdcycle %0" : "=r"(cycles));
+    return cycles;
+}
+
+/**
+ * bench_report - Print one result line, see bench_init()
+ */
+static void bench_report(const char *name, uint64_t arg, uint64_t iters, uint64_t cycles) {
+    sys_puts("BENCH name=");
+    sys_puts(name);
+    sys_puts(" arg=");
+    put_dec(arg);
+    sys_puts(" iters=");
+    put_dec(iters);
+    sys_puts(" cycles_per_op=");
+    put_dec(cycles / iters);
+    sys_puts("\n");
+}
+
+/**
+ * bench_ecall - Null syscall round trip
+ */
+static void bench_ecall(void) {
+    syscall(SYS_NULL, 0, 0, 0);
+    uint64_t start = rdcycle();
+    for (int i = 0; i < BENCH_ECALL_ITERS; i++) {
+        syscall(SYS_NULL, 0, 0, 0);
+    }
+    bench_report("null_ecall", 0, BENCH_ECALL_ITERS, rdcycle() - start);
+}
+
+/**
+ * bench_yield - Two processes yielding to each other
+ * Each of our yields switches to the child and back, so the result is per
+ * switch_context(). Only meaningful on one hart (make bench uses -smp 1).
+ */
+static void bench_yield(void) {
+    if (sys_fork() == 0) {
+        // Enough to outlast the parent's warm-up and timed loop
+        for (int i = 0; i < 2 * BENCH_YIELD_ITERS; i++) {
+            sys_yield();
+        }
+        sys_exit();
+    }
+
+    // Let the child take its copy-on-write faults first
+    for (int i = 0; i < 16; i++) {
+        sys_yield();
+    }
+    uint64_t start = rdcycle();
+    for (int i = 0; i < BENCH_YIELD_ITERS; i++) {
+        sys_yield();
+    }
+    bench_report("yield_pingpong", 2, 2 * BENCH_YIELD_ITERS, rdcycle() - start);
+}
+
+/**
+ * bench_io - fs_write and fs_read bandwidth, through pwrite/pread at offset 0
+ * arg is the transfer size; bytes per cycle is arg / cycles_per_op.
+ */
+static void bench_io(void) {
+    static const int sizes[] = { 64, 512, 4096, BENCH_IO_MAX };
+    int fd = sys_open("bench.dat", O_TRUNC);
+    if (fd < 0) {
+        sys_puts("ERROR: bench_io could not open bench.dat\n");
+        return;
+    }
+
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        int size = sizes[s];
+        int iters = BENCH_IO_BYTES / size;
+
+        uint64_t start = rdcycle();
+        for (int i = 0; i < iters; i++) {
+            sys_pwrite(fd, bench_buf, size, 0);
+        }
+        bench_report("fs_write", size, iters, rdcycle() - start);
+
+        start = rdcycle();
+        for (int i = 0; i < iters; i++) {
+            sys_pread(fd, bench_buf, size, 0);
+        }
+        bench_report("fs_read", size, iters, rdcycle() - start);
+    }
+
+    sys_close(fd);
+    sys_unlink("bench.dat");
+}
+
+/**
+ * bench_pipe - Pipe bandwidth between two forked processes
+ * BENCH_IO_BYTES go through in page-sized writes, copied or (PIPE_FLIP)
+ * remapped. Timed on the writer, so the last ring's worth may still be
+ * unread when the clock stops.
+ */
+static void bench_pipe(const char *name, int flags) {
+    int fds[2];
+    if (sys_pipe(fds, flags) != 0) {
+        sys_puts("ERROR: bench_pipe could not create a pipe\n");
+        return;
+    }
+    if (sys_fork() == 0) {
+        sys_close(fds[1]);
+        while (sys_read(fds[0], bench_buf, PAGE_SIZE) > 0) {
+        }
+        sys_exit();
+    }
+    sys_close(fds[0]);
+
+    int iters = BENCH_IO_BYTES / PAGE_SIZE;
+    uint64_t start = rdcycle();
+    for (int i = 0; i < iters; i++) {
+        sys_write(fds[1], bench_buf, PAGE_SIZE);
+    }
+    bench_report(name, PAGE_SIZE, iters, rdcycle() - start);
+    sys_close(fds[1]);
+}
+
+/**
+ * bench_main - The benchmark process
+ */
+void bench_main(void) {
+    bench_ecall();
+    bench_io();
+    bench_pipe("pipe_copy", 0);
+    bench_pipe("pipe_flip", PIPE_FLIP);
+    bench_yield();
+}
+#endif